@@ -0,0 +1,655 @@
+// Benchmark for the enhancement kernels.
+//
+// Generates synthetic images from VGA up to 8K in memory and times every operation with
+// every kernel set the CPU supports, on one thread and on a pool of threads, plus the
+// fused lookup-table chain against the same chain run stage by stage. Each figure is
+// reported next to a memcpy of the same image with the same number of threads, which
+// is as fast as any single pass over the image can go.
+//
+// Needs no video library, so it runs on any Linux machine:
+//     gcc -O2 -o bench bench.c -pthread -lm
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "point_pipeline.h"
+#include "cpu_dispatch.h"
+#include "thread_pool.h"
+#include "image.h"
+#include "timing.h"
+#include "resize.h"
+#include "histogram.h"
+#include "clahe.h"
+#include "convolve.h"
+#include "canny.h"
+#include "median.h"
+#include "options.h"
+
+#define BENCH_MAX_ITERATIONS 10000     // the samples of a measurement are kept on the stack
+
+struct bench_size {
+    const char *name;
+    int width, height;
+};
+
+static const struct bench_size sizes[] = {
+    { "VGA", 640, 480 },
+    { "HD", 1280, 720 },
+    { "FHD", 1920, 1080 },
+    { "4K", 3840, 2160 },
+    { "8K", 7680, 4320 },
+};
+
+#define SIZE_COUNT ((int) (sizeof(sizes) / sizeof(sizes[0])))
+
+// The images of one size. Every run starts from a fresh copy of source in colour.
+struct bench_images {
+    struct image source;
+    struct image colour;
+    struct image planar;
+    struct image gray;
+    struct image thumb;                 // a quarter of the width and height
+    struct resize_plan area, bilinear;  // colour to thumb
+    struct clahe_plan clahe;            // 8 x 8 tiles
+    struct convolve_plan gaussian;      // radius 2
+    struct convolve_plan sobel;         // both derivatives
+    int *derivative[2];                 // sobel's, of the gray image
+    struct canny_plan canny;
+    struct median_plan median3, median9;    // radius 1 and 4
+};
+
+struct bench_op;
+
+// One timed operation, split into row bands by the thread pool
+struct bench_run {
+    const struct bench_op *op;
+    struct bench_images *img;
+    const struct point_program *program;    // the fused chain, then the fused colour chain
+    int sweep;              // the sweep being run, for operations made of several
+    struct thread_pool *pool;
+    struct histogram *histograms;           // one per band
+};
+
+typedef void (*bench_fn)(struct bench_run *run, int y0, int y1);
+
+struct bench_op {
+    const char *name;
+    bench_fn fn;
+    int sweeps;             // separate passes over the image, with a barrier in between
+    int uses_kernels;       // 0 if the code is the same whatever kernel set is selected
+    int on_gray;            // the input is the gray image rather than the colour one
+};
+
+/********************************************
+*                OPERATIONS                 *
+********************************************/
+
+static void bench_memcpy(struct bench_run *run, int y0, int y1) {
+    struct image *src = &run->img->source, *dst = &run->img->colour;
+
+    memcpy (image_row (dst, 0, y0), image_row (src, 0, y0), src->stride * (y1 - y0));
+}
+
+static void bench_grayscale(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour, *gray = &run->img->gray;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->gray_from_bgr (image_row (img, 0, y), image_row (gray, 0, y), img->width);
+}
+
+static void bench_invert(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->invert (image_row (img, 0, y), image_row_bytes (img));
+}
+
+static void bench_brightness(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->brightness (image_row (img, 0, y), image_row_bytes (img), 10, 1);
+}
+
+static void bench_contrast(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->contrast (image_row (img, 0, y), img->width, 80, 20, 1);
+}
+
+static void bench_threshold(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->threshold (image_row (img, 0, y), img->width, 80);
+}
+
+static void bench_contrast_planar(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->planar;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->contrast_planar (image_row (img, 0, y), image_row (img, 1, y), image_row (img, 2, y), img->width,
+                                  80, 20, 1);
+}
+
+static void bench_threshold_planar(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->planar;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->threshold_planar (image_row (img, 0, y), image_row (img, 1, y), image_row (img, 2, y), img->width, 80);
+}
+
+static void bench_contrast_gray(struct bench_run *run, int y0, int y1) {
+    struct image *gray = &run->img->gray;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->contrast_gray (image_row (gray, 0, y), gray->width, 80, 20, 1);
+}
+
+static void bench_threshold_gray(struct bench_run *run, int y0, int y1) {
+    struct image *gray = &run->img->gray;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->threshold_gray (image_row (gray, 0, y), gray->width, 80);
+}
+
+static void bench_deinterleave(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour, *planar = &run->img->planar;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->deinterleave (image_row (img, 0, y), image_row (planar, 0, y), image_row (planar, 1, y),
+                               image_row (planar, 2, y), img->width);
+}
+
+static void bench_interleave(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour, *planar = &run->img->planar;
+    int y;
+
+    for (y = y0; y < y1; y++)
+        kernels->interleave (image_row (planar, 0, y), image_row (planar, 1, y), image_row (planar, 2, y),
+                             image_row (img, 0, y), img->width);
+}
+
+// Shrink the colour image to a quarter of its width and height. Bands are split by
+// source rows, so each one resizes the output rows that fall in its part of the image.
+static void bench_resize(struct bench_run *run, const struct resize_plan *plan, int y0, int y1) {
+    struct image *img = &run->img->colour, *thumb = &run->img->thumb;
+    int band = thread_pool_band_index (run->pool, img->height, y0);
+
+    resize_rows (plan, img, thumb, (int) ((long long) y0 * thumb->height / img->height),
+                 (int) ((long long) y1 * thumb->height / img->height), plan->rings + plan->ring_size * band);
+}
+
+static void bench_resize_area(struct bench_run *run, int y0, int y1) {
+    bench_resize (run, &run->img->area, y0, y1);
+}
+
+static void bench_resize_bilinear(struct bench_run *run, int y0, int y1) {
+    bench_resize (run, &run->img->bilinear, y0, y1);
+}
+
+// Count the gray levels and the channels of the colour image, each band into a
+// histogram of its own, as the sweep before a stretch does
+static void bench_histogram(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour;
+    struct histogram *h = &run->histograms[thread_pool_band_index (run->pool, img->height, y0)];
+    int y;
+
+    histogram_clear (h);
+    for (y = y0; y < y1; y++)
+        histogram_count_row (h, img, y, 1);
+}
+
+// CLAHE of the colour image into the gray one, 8 x 8 tiles clipped at twice the mean:
+// the tile histograms and maps, then the interpolation. A band makes the tile rows that
+// start in it.
+static void bench_clahe(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour, *gray = &run->img->gray;
+    struct clahe_plan *plan = &run->img->clahe;
+    int t0, t1;
+
+    if (run->sweep == 1) {
+        clahe_rows (plan, gray, gray, y0, y1);
+        return;
+    }
+    for (t0 = 0; t0 < plan->tiles_y && plan->tile_y[t0] < y0; t0++);
+    for (t1 = t0; t1 < plan->tiles_y && plan->tile_y[t1] < y1; t1++);
+    clahe_tile_rows (plan, img, gray, 2, thread_pool_band_index (run->pool, img->height, y0), t0, t1);
+}
+
+// A radius 2 Gaussian blur of the colour image into the gray one
+static void bench_gaussian(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour;
+
+    convolve_rows (&run->img->gaussian, img, &run->img->gray, NULL, y0, y1,
+                   thread_pool_band_index (run->pool, img->height, y0));
+}
+
+// The x and y Sobel derivatives of the gray image, into the derivative buffers
+static void bench_sobel(struct bench_run *run, int y0, int y1) {
+    struct image *gray = &run->img->gray;
+
+    convolve_rows (&run->img->sobel, gray, NULL, run->img->derivative, y0, y1,
+                   thread_pool_band_index (run->pool, gray->height, y0));
+}
+
+// Canny of the colour image into the gray one at the default thresholds: the blur, the
+// derivatives, suppression, tracing each band, then one round of growing across bands
+// and dropping the rest. The noise input makes this close to the worst case.
+static void bench_canny(struct bench_run *run, int y0, int y1) {
+    struct image *gray = &run->img->gray;
+    int band = thread_pool_band_index (run->pool, gray->height, y0);
+
+    switch (run->sweep) {
+        case 0:
+            bench_gaussian (run, y0, y1);
+            break;
+        case 1:
+            bench_sobel (run, y0, y1);
+            break;
+        case 2:
+            canny_suppress_rows (run->img->derivative[0], run->img->derivative[1], gray, CANNY_LOW, CANNY_HIGH, y0,
+                                 y1);
+            break;
+        case 3:
+            canny_trace_rows (&run->img->canny, gray, y0, y1);
+            break;
+        case 4:
+            canny_seed_rows (&run->img->canny, gray, band, y0, y1);
+            break;
+        case 5:
+            canny_grow_rows (&run->img->canny, gray, band, y0, y1);
+            break;
+        case 6:
+            canny_finish_rows (gray, y0, y1);
+            break;
+    }
+}
+
+// Medians of the colour image into the gray one: 3 x 3 with the min/max network, and
+// 9 x 9 with the sliding histograms
+static void bench_median(struct bench_run *run, struct median_plan *plan, int y0, int y1) {
+    struct image *img = &run->img->colour;
+
+    median_rows (plan, img, &run->img->gray, y0, y1, thread_pool_band_index (run->pool, img->height, y0));
+}
+
+static void bench_median3(struct bench_run *run, int y0, int y1) {
+    bench_median (run, &run->img->median3, y0, y1);
+}
+
+static void bench_median9(struct bench_run *run, int y0, int y1) {
+    bench_median (run, &run->img->median9, y0, y1);
+}
+
+static void bench_histogram_gray(struct bench_run *run, int y0, int y1) {
+    struct image *gray = &run->img->gray;
+    struct histogram *h = &run->histograms[thread_pool_band_index (run->pool, gray->height, y0)];
+    int y;
+
+    histogram_clear (h);
+    for (y = y0; y < y1; y++)
+        histogram_count_row (h, gray, y, 0);
+}
+
+// The chain of the main program with every stage enabled, one sweep per stage: the
+// grayscale stage writes the gray image and the rest work on it
+static void bench_chain(struct bench_run *run, int y0, int y1) {
+    struct image *gray = &run->img->gray;
+    int y;
+
+    if (run->sweep == 0) {
+        bench_grayscale (run, y0, y1);
+        return;
+    }
+    for (y = y0; y < y1; y++) {
+        switch (run->sweep) {
+            case 1:
+                kernels->invert (image_row (gray, 0, y), gray->width);
+                break;
+            case 2:
+                kernels->brightness (image_row (gray, 0, y), gray->width, 10, 1);
+                break;
+            case 3:
+                kernels->contrast_gray (image_row (gray, 0, y), gray->width, 80, 20, 1);
+                break;
+            case 4:
+                kernels->threshold_gray (image_row (gray, 0, y), gray->width, 80);
+                break;
+        }
+    }
+}
+
+// The same chain folded into lookup tables and applied in one sweep
+static void bench_chain_fused(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour, *gray = &run->img->gray;
+    byte *row;
+    int y;
+
+    for (y = y0; y < y1; y++) {
+        row = image_row (img, 0, y);
+        point_program_apply (run->program, row, row + 1, row + 2, 3, img->width, image_row (gray, 0, y));
+    }
+}
+
+// A chain that stays in colour: contrast decides per pixel between two sets of channel
+// maps, so this measures the fused pass that cannot be a plain table lookup
+static const struct point_stage colour_stages[] = {
+    { .op = POINT_BRIGHTNESS, .amount = 10, .sign = 1 },
+    { .op = POINT_CONTRAST, .threshold = 80, .amount = 20, .sign = 1 },
+    { .op = POINT_INVERT },
+};
+
+static void bench_colour_fused(struct bench_run *run, int y0, int y1) {
+    struct image *img = &run->img->colour;
+    byte *row;
+    int y;
+
+    for (y = y0; y < y1; y++) {
+        row = image_row (img, 0, y);
+        point_program_apply (run->program + 1, row, row + 1, row + 2, 3, img->width, NULL);
+    }
+}
+
+static const struct point_stage chain_stages[] = {
+    { .op = POINT_GRAYSCALE },
+    { .op = POINT_INVERT },
+    { .op = POINT_BRIGHTNESS, .amount = 10, .sign = 1 },
+    { .op = POINT_CONTRAST, .threshold = 80, .amount = 20, .sign = 1 },
+    { .op = POINT_THRESHOLD, .threshold = 80 },
+};
+
+static const struct bench_op bench_memcpy_op = { "memcpy", bench_memcpy, 1, 0, 0 };
+
+static const struct bench_op bench_ops[] = {
+    { "grayscale",          bench_grayscale,        1, 1, 0 },
+    { "invert",             bench_invert,           1, 1, 0 },
+    { "brightness",         bench_brightness,       1, 1, 0 },
+    { "contrast",           bench_contrast,         1, 1, 0 },
+    { "threshold",          bench_threshold,        1, 1, 0 },
+    { "contrast planar",    bench_contrast_planar,  1, 1, 0 },
+    { "threshold planar",   bench_threshold_planar, 1, 1, 0 },
+    { "contrast gray",      bench_contrast_gray,    1, 1, 1 },
+    { "threshold gray",     bench_threshold_gray,   1, 1, 1 },
+    { "deinterleave",       bench_deinterleave,     1, 1, 0 },
+    { "interleave",         bench_interleave,       1, 1, 0 },
+    { "resize area",        bench_resize_area,      1, 1, 0 },
+    { "resize bilinear",    bench_resize_bilinear,  1, 1, 0 },
+    { "histogram",          bench_histogram,        1, 1, 0 },
+    { "histogram gray",     bench_histogram_gray,   1, 1, 1 },
+    { "clahe",              bench_clahe,            2, 1, 0 },
+    { "gaussian",           bench_gaussian,         1, 1, 0 },
+    { "sobel",              bench_sobel,            1, 1, 1 },
+    { "canny",              bench_canny,            7, 1, 0 },
+    { "median 3x3",         bench_median3,          1, 1, 0 },
+    { "median 9x9",         bench_median9,          1, 1, 0 },
+    { "chain",              bench_chain,            5, 1, 0 },
+    { "chain fused",        bench_chain_fused,      1, 0, 0 },
+    { "colour fused",       bench_colour_fused,     1, 0, 0 },
+};
+
+#define OP_COUNT ((int) (sizeof(bench_ops) / sizeof(bench_ops[0])))
+
+/********************************************
+*                  RUNNER                   *
+********************************************/
+
+static void bench_band(void *arg, int y0, int y1) {
+    struct bench_run *run = (struct bench_run *) arg;
+
+    run->op->fn (run, y0, y1);
+}
+
+// Median time of one run of the operation in ns. Every run starts from the source
+// pixels; one untimed run first takes the page faults of freshly allocated images.
+static long long bench_measure(struct thread_pool *pool, struct bench_run *run, int iterations) {
+    long long samples[iterations], start;
+    struct image *src = &run->img->source;
+    int i, s;
+
+    for (i = -1; i < iterations; i++) {
+        memcpy (run->img->colour.plane[0], src->plane[0], src->stride * src->height);
+        start = timing_now ();
+        for (s = 0; s < run->op->sweeps; s++) {
+            run->sweep = s;
+            thread_pool_run (pool, src->height, bench_band, run);
+        }
+        if (i >= 0) samples[i] = timing_now () - start;
+    }
+    qsort (samples, iterations, sizeof(long long), timing_compare);
+    return timing_percentile (samples, iterations, 50);
+}
+
+// Print one result; mbps_memcpy is the baseline for the same size and thread count
+static void bench_report(const struct bench_size *size, const char *op, const char *variant, int threads,
+                         long long ns, long long bytes, double mbps_memcpy, int json) {
+    static int printed = 0;
+    double mbps = bytes * 1e3 / ns, mpps = (double) size->width * size->height * 1e3 / ns;
+
+    if (json)
+        printf ("%s\n  {\"size\": \"%s\", \"width\": %d, \"height\": %d, \"operation\": \"%s\", \"kernels\": \"%s\", "
+                "\"threads\": %d, \"median_ns\": %lld, \"mb_per_s\": %.1f, \"mp_per_s\": %.1f, \"memcpy_fraction\": %.3f}",
+                printed++ ? "," : "", size->name, size->width, size->height, op, variant, threads, ns, mbps, mpps,
+                mbps / mbps_memcpy);
+    else
+        printf ("%-5s %-18s %-9s %7d %10.3f %10.1f %10.1f %7.0f%%\n", size->name, op, variant, threads, ns / 1e6,
+                mbps, mpps, 100 * mbps / mbps_memcpy);
+}
+
+static int bench_alloc(struct bench_images *img, int width, int height, int nbands) {
+    unsigned int x = 2463534242u;
+    size_t i, n;
+
+    memset (img, 0, sizeof(struct bench_images));
+    if (image_alloc (&img->source, width, height, IMAGE_INTERLEAVED) < 0
+        || image_alloc (&img->colour, width, height, IMAGE_INTERLEAVED) < 0
+        || image_alloc (&img->planar, width, height, IMAGE_PLANAR) < 0
+        || image_alloc (&img->gray, width, height, IMAGE_GRAY) < 0
+        || image_alloc (&img->thumb, width / 4, height / 4, IMAGE_INTERLEAVED) < 0
+        || resize_plan_init (&img->area, width, height, width / 4, height / 4, RESIZE_AREA) < 0
+        || resize_plan_init (&img->bilinear, width, height, width / 4, height / 4, RESIZE_BILINEAR) < 0
+        || resize_plan_rings (&img->area, 3, nbands) < 0 || resize_plan_rings (&img->bilinear, 3, nbands) < 0
+        || clahe_plan_init (&img->clahe, width, height, 8, nbands) < 0)
+        return -1;
+    convolve_filter_init (&img->gaussian.filter[0], CONVOLVE_GAUSSIAN, 2);
+    img->gaussian.nfilters = 1;
+    convolve_filter_init (&img->sobel.filter[0], CONVOLVE_SOBEL_X, 1);
+    convolve_filter_init (&img->sobel.filter[1], CONVOLVE_SOBEL_Y, 1);
+    img->sobel.nfilters = 2;
+    img->derivative[0] = malloc (sizeof(int) * (size_t) width * height);
+    img->derivative[1] = malloc (sizeof(int) * (size_t) width * height);
+    if (convolve_plan_scratch (&img->gaussian, width, nbands) < 0
+        || convolve_plan_scratch (&img->sobel, width, nbands) < 0 || !img->derivative[0] || !img->derivative[1]
+        || canny_plan_init (&img->canny, width, height, nbands) < 0
+        || median_plan_init (&img->median3, width, 1, nbands) < 0
+        || median_plan_init (&img->median9, width, 4, nbands) < 0)
+        return -1;
+    // xorshift noise, so every pixel average and threshold decision is exercised
+    n = img->source.stride * height;
+    for (i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        img->source.plane[0][i] = (byte) x;
+    }
+    memcpy (img->colour.plane[0], img->source.plane[0], n);
+    for (i = 0; i < (size_t) height; i++)
+        kernels->deinterleave (image_row (&img->source, 0, i), image_row (&img->planar, 0, i),
+                               image_row (&img->planar, 1, i), image_row (&img->planar, 2, i), width);
+    return 0;
+}
+
+static void bench_free(struct bench_images *img) {
+    image_free (&img->source);
+    image_free (&img->colour);
+    image_free (&img->planar);
+    image_free (&img->gray);
+    image_free (&img->thumb);
+    resize_plan_free (&img->area);
+    resize_plan_free (&img->bilinear);
+    clahe_plan_free (&img->clahe);
+    convolve_plan_free (&img->gaussian);
+    convolve_plan_free (&img->sobel);
+    free (img->derivative[0]);
+    free (img->derivative[1]);
+    canny_plan_free (&img->canny);
+    median_plan_free (&img->median3);
+    median_plan_free (&img->median9);
+}
+
+// Run every operation on one image size with the given pool
+static void bench_size(const struct bench_size *size, struct bench_images *img, struct thread_pool *pool,
+                       const struct point_program *program, struct histogram *histograms, const char *variant,
+                       int iterations, int json) {
+    const struct kernel_table *selected = kernels;
+    struct bench_run run;
+    long long ns, bytes;
+    double mbps_memcpy;
+    int i, k;
+
+    run.img = img;
+    run.program = program;
+    run.pool = pool;
+    run.histograms = histograms;
+    run.op = &bench_memcpy_op;
+    bytes = img->source.stride * size->height;
+    ns = bench_measure (pool, &run, iterations);
+    mbps_memcpy = bytes * 1e3 / ns;
+    bench_report (size, run.op->name, "-", pool->nthreads, ns, bytes, mbps_memcpy, json);
+
+    for (i = 0; i < OP_COUNT; i++) {
+        run.op = &bench_ops[i];
+        bytes = run.op->on_gray ? image_bytes (&img->gray) : image_bytes (&img->colour);
+        if (!run.op->uses_kernels) {
+            ns = bench_measure (pool, &run, iterations);
+            bench_report (size, run.op->name, "lut", pool->nthreads, ns, bytes, mbps_memcpy, json);
+            continue;
+        }
+        for (k = 0; k < KERNEL_TABLE_COUNT; k++) {
+            if (variant && strcmp (variant, kernel_tables[k].name) != 0) continue;
+            if (!kernel_tables[k].supported ()) continue;
+            kernels = &kernel_tables[k];
+            ns = bench_measure (pool, &run, iterations);
+            bench_report (size, run.op->name, kernels->name, pool->nthreads, ns, bytes, mbps_memcpy, json);
+        }
+        kernels = selected;
+    }
+}
+
+static void bench_usage(void) {
+    printf("Usage: bench [-k variant] [-w weights] [-j threads] [-n iterations] [-m size] [-t format]\n");
+    printf("-k: only benchmarks this kernel variant (default: every one the CPU supports)\n");
+    printf("-w: channel weights of the gray level: average (default), bt601 or bt709\n");
+    printf("-j: threads for the threaded runs (default: one per CPU)\n");
+    printf("-n: timed runs per measurement; the median is reported (default: 10)\n");
+    printf("-m: largest image size: VGA, HD, FHD, 4K or 8K (default: 8K)\n");
+    printf("-t: prints a table (default) or json\n");
+}
+
+// Parse the number of option opt, from min to max. Returns -1 after printing what is
+// wrong and the usage.
+static int bench_option(int opt, const char *text, int min, int max, int *value) {
+    if (parse_number (text, value, max) == 0 && *value >= min) return 0;
+    printf("Error: -%c takes a number from %d to %d\n", opt, min, max);
+    bench_usage ();
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    char *variant = NULL, *largest = "8K";
+    int iterations = 10, nthreads = thread_pool_cpus (), json = 0;
+    int i, opt, last;
+    struct thread_pool *single, *pool;
+    static struct point_program program[2];
+    struct histogram *histograms;
+    struct bench_images img;
+
+    while ((opt = getopt (argc, argv, "hk:w:j:n:m:t:")) != -1) {
+        switch (opt) {
+            case 'k':
+                variant = optarg;
+                break;
+            case 'w':
+                if (luma_select (optarg) < 0)
+                    return -1;
+                break;
+            case 'j':
+                if (bench_option (opt, optarg, 1, THREAD_POOL_MAX_THREADS, &nthreads) < 0)
+                    return -1;
+                break;
+            case 'n':
+                if (bench_option (opt, optarg, 1, BENCH_MAX_ITERATIONS, &iterations) < 0)
+                    return -1;
+                break;
+            case 'm':
+                largest = optarg;
+                break;
+            case 't':
+                if (strcmp (optarg, "table") != 0 && strcmp (optarg, "json") != 0) {
+                    printf("Error: -t takes table or json\n");
+                    bench_usage ();
+                    return -1;
+                }
+                json = (strcmp (optarg, "json") == 0);
+                break;
+            default:
+                bench_usage ();
+                return 0;
+        }
+    }
+    for (last = 0; last < SIZE_COUNT && strcmp (largest, sizes[last].name) != 0; last++);
+    if (last == SIZE_COUNT) {
+        printf("Error: -m takes VGA, HD, FHD, 4K or 8K\n");
+        bench_usage ();
+        return -1;
+    }
+    // checks the forced variant and leaves the best kernels selected for the setup code
+    if (kernel_dispatch_init (variant) < 0)
+        return -1;
+    single = thread_pool_create (1);
+    pool = (nthreads > 1) ? thread_pool_create (nthreads) : NULL;
+    if (!single || (nthreads > 1 && !pool)) {
+        printf("Error: could not start worker threads\n");
+        return -1;
+    }
+    histograms = malloc (sizeof(struct histogram) * (pool ? pool->nthreads : 1));
+    if (!histograms) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    point_program_compile (&program[0], chain_stages, sizeof(chain_stages) / sizeof(chain_stages[0]));
+    point_program_compile (&program[1], colour_stages, sizeof(colour_stages) / sizeof(colour_stages[0]));
+
+    if (json)
+        printf ("[");
+    else
+        printf ("%-5s %-18s %-9s %7s %10s %10s %10s %8s\n", "SIZE", "OPERATION", "KERNELS", "THREADS", "MEDIAN ms",
+                "MB/s", "MP/s", "MEMCPY");
+    for (i = 0; i <= last; i++) {
+        if (bench_alloc (&img, sizes[i].width, sizes[i].height, pool ? pool->nthreads : 1) < 0) {
+            printf("Error: out of memory for %s images\n", sizes[i].name);
+            bench_free (&img);
+            break;
+        }
+        bench_size (&sizes[i], &img, single, program, histograms, variant, iterations, json);
+        if (pool) bench_size (&sizes[i], &img, pool, program, histograms, variant, iterations, json);
+        bench_free (&img);
+    }
+    if (json) printf ("\n]\n");
+
+    free (histograms);
+    thread_pool_destroy (single);
+    thread_pool_destroy (pool);
+    return 0;
+}
@@ -4,7 +4,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef VIDEO_SW
+#include "video_sw.h"
+#else
 #include <intelfpgaup/video.h>
+#endif
+#include "cpu_dispatch.h"
 #define PI 3.141592654
 
 typedef unsigned char byte;
@@ -50,29 +55,8 @@ int read_bmp(char *filename, byte **header, struct pixel **data) {
 // Adjust the brightness of each pixel in the image
 // The brightness value should be between -255 and 255
 void brightness_operation(struct pixel **data, int brightness,int sign) {
-    int x, y;
-    int new_r, new_g, new_b;
-    // Declare image as a 2-D array so that we can use the syntax image[row][column]
-    struct pixel (*image)[width] = (struct pixel (*)[width])*data;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            // Adjust the brightness of each channel (r, g, b) separately
-            if (sign==1){
-            new_r = image[y][x].r + brightness;
-            new_g = image[y][x].g + brightness;
-            new_b = image[y][x].b + brightness;
-            }
-	    else{
-            new_r = image[y][x].r - brightness;
-            new_g = image[y][x].g - brightness;
-            new_b = image[y][x].b - brightness;
-	    }
-            // Ensure the values stay within the valid range of 0-255
-            image[y][x].r = (new_r < 0) ? 0 : ((new_r > 255) ? 255 : new_r);
-            image[y][x].g = (new_g < 0) ? 0 : ((new_g > 255) ? 255 : new_g);
-            image[y][x].b = (new_b < 0) ? 0 : ((new_b > 255) ? 255 : new_b);
-        }
-    }
+    // Adjust every channel separately with a saturating add or subtract
+    kernels->brightness ((unsigned char *) *data, (size_t) width * height * 3, brightness, sign);
 }
 
 // Write the grayscale image to disk. The 8-bit grayscale values should be inside the
@@ -147,18 +131,20 @@ int main(int argc, char *argv[]) {
     struct pixel *image;
     //signed int *G_x, *G_y;
     byte *header;
+    char *kernel_variant = NULL;
     int debug = 0, video = 0;
     time_t start, end;
     
     // Check inputs
     if (argc < 2) {
-        printf("Usage: part1 [-d] [-v] <BMP filename>\n");
+        printf("Usage: part1 [-d] [-v] [-k variant] <BMP filename>\n");
         printf("-d: produces debug output for each stage\n");
         printf("-v: draws the input and output images on a video-out display\n");
+        printf("-k: forces a kernel variant (avx512bw, avx2, sse2, neon or scalar) instead of the best one for this CPU\n");
         return 0;
     }
     int opt;
-    while ((opt = getopt (argc, argv, "dv")) != -1) {
+    while ((opt = getopt (argc, argv, "dvk:")) != -1) {
         switch (opt) {
             case 'd':  
                 debug = 1;
@@ -166,11 +152,18 @@ int main(int argc, char *argv[]) {
             case 'v':  
                 video = 1;
                 break;  
+            case 'k':
+                kernel_variant = optarg;
+                break;
             case '?':  
                 printf("unknown option: %c\n", optopt); 
                 break;  
         }  
     }  
+    // Pick the kernels for this CPU (or the ones forced with -k)
+    if (kernel_dispatch_init (kernel_variant) < 0)
+        return -1;
+    if (debug) printf("KERNELS: %s\n", kernels->name);
     // Open input image file (24-bit bitmap image)
     if (read_bmp (argv[optind], &header, &image) < 0) {
         printf("Failed to read BMP\n");
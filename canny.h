@@ -0,0 +1,228 @@
+// Canny edge detection, from the derivatives of convolve.h.
+//
+// The image is blurred and its x and y Sobel derivatives taken with the convolution
+// engine, into the whole-image int buffers that write_signed_bmp reads. What is left
+// is done here, in two steps split into bands of rows by the thread pool:
+//   canny_suppress_rows   non-maximum suppression. A pixel stays a candidate only if
+//                         its gradient magnitude |dx| + |dy| is above low and is a peak
+//                         along the gradient direction, rounded to one of four; it is
+//                         strong if above high as well. The band is done a tile of
+//                         CANNY_TILE columns at a time, keeping the magnitudes of the
+//                         three rows the tile needs in a small ring, so each magnitude
+//                         is computed once and the derivatives of a tile stay in L1.
+//   hysteresis            the candidates connected to a strong pixel become edges and
+//                         the rest are dropped. Each band first follows the edges inside
+//                         its own rows (canny_trace_rows), with a stack of its own. An
+//                         edge that crosses into another band is then picked up by a
+//                         wavefront: every band collects its candidates touching an edge
+//                         in the row just outside it (canny_seed_rows, which only reads),
+//                         and grows from them (canny_grow_rows, which only writes its own
+//                         rows), round after round until no band finds any. Real edges
+//                         rarely cross more than a couple of band boundaries, so that
+//                         takes few rounds. canny_finish_rows then drops what is left.
+// The output is a gray image: 255 on the edges and 0 elsewhere.
+#ifndef CANNY_H
+#define CANNY_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+#define CANNY_BLUR_RADIUS 2     // of the Gaussian blur before the derivatives
+#define CANNY_TILE 256          // columns of non-maximum suppression at a time
+#define CANNY_MAX_LEVEL 2040    // the largest magnitude, 4 * 255 for each derivative
+#define CANNY_LOW 40            // default thresholds on the magnitude
+#define CANNY_HIGH 100
+#define CANNY_WEAK 1            // a candidate, until hysteresis decides
+#define CANNY_EDGE 255
+
+struct canny_plan {
+    int width, height;
+    int *stack;                 // a pixel per pixel of the image; a band uses the part at its rows
+    int *seeds;                 // per band: two rows of pixels to grow from
+    int *nseeds;                // per band
+    int nbands;
+};
+
+static inline void canny_plan_free(struct canny_plan *plan) {
+    free (plan->stack);
+    free (plan->seeds);
+    free (plan->nseeds);
+    memset (plan, 0, sizeof(struct canny_plan));
+}
+
+// Plan for width x height images with room for nbands bands. The plan must start out
+// zeroed; it is kept if it already fits. Returns -1 if out of memory.
+static inline int canny_plan_init(struct canny_plan *plan, int width, int height, int nbands) {
+    if (plan->stack && plan->width == width && plan->height == height && plan->nbands >= nbands) return 0;
+    canny_plan_free (plan);
+    plan->width = width;
+    plan->height = height;
+    plan->nbands = nbands;
+    plan->stack = malloc (sizeof(int) * (size_t) width * height);
+    plan->seeds = malloc (sizeof(int) * 2 * width * nbands);
+    plan->nseeds = calloc (nbands, sizeof(int));
+    if (!plan->stack || !plan->seeds || !plan->nseeds) {
+        canny_plan_free (plan);
+        return -1;
+    }
+    return 0;
+}
+
+// Gradient magnitudes of columns [x0 - 1, x1] of row y into mag, 0 outside the image
+static inline void canny_magnitude(const int *gx, const int *gy, int width, int height, int y, int x0, int x1,
+                                   int *mag) {
+    const int *dx, *dy;
+    int x;
+
+    if (y < 0 || y >= height) {
+        memset (mag, 0, sizeof(int) * (x1 - x0 + 2));
+        return;
+    }
+    dx = gx + (size_t) y * width;
+    dy = gy + (size_t) y * width;
+    mag[0] = (x0 > 0) ? abs (dx[x0 - 1]) + abs (dy[x0 - 1]) : 0;
+    mag[x1 - x0 + 1] = (x1 < width) ? abs (dx[x1]) + abs (dy[x1]) : 0;
+    mag++;
+    for (x = x0; x < x1; x++)
+        mag[x - x0] = abs (dx[x]) + abs (dy[x]);
+}
+
+// Non-maximum suppression of rows [y0, y1) from the derivatives gx and gy into the gray
+// image out: CANNY_EDGE for the strong peaks, CANNY_WEAK for the others above low, 0
+// for the rest
+static inline void canny_suppress_rows(const int *gx, const int *gy, struct image *out, int low, int high, int y0,
+                                       int y1) {
+    // tan 22.5 degrees in 15 fraction bits; tan 67.5 is that plus 2
+    const int tan22 = 13573;
+    int ring[3][CANNY_TILE + 2], *prev, *cur, *next, *t;
+    int width = out->width, height = out->height, x0, x1, x, y, i, m, dx, dy, ax, ay, s, peak;
+    byte *row;
+
+    for (x0 = 0; x0 < width; x0 = x1) {
+        x1 = (x0 + CANNY_TILE < width) ? x0 + CANNY_TILE : width;
+        prev = ring[0];
+        cur = ring[1];
+        next = ring[2];
+        canny_magnitude (gx, gy, width, height, y0 - 1, x0, x1, prev);
+        canny_magnitude (gx, gy, width, height, y0, x0, x1, cur);
+        for (y = y0; y < y1; y++) {
+            canny_magnitude (gx, gy, width, height, y + 1, x0, x1, next);
+            row = image_row (out, 0, y);
+            memset (row + x0, 0, x1 - x0);
+            for (x = x0; x < x1; x++) {
+                i = x - x0 + 1;
+                m = cur[i];
+                if (m <= low) continue;
+                dx = gx[(size_t) y * width + x];
+                dy = gy[(size_t) y * width + x];
+                ax = abs (dx);
+                ay = abs (dy) << 15;
+                if (ay < ax * tan22)
+                    peak = m > cur[i - 1] && m >= cur[i + 1];
+                else if (ay > ax * tan22 + (ax << 16))
+                    peak = m > prev[i] && m >= next[i];
+                else {
+                    // the diagonal the gradient points along
+                    s = ((dx ^ dy) < 0) ? -1 : 1;
+                    peak = m > prev[i - s] && m > next[i + s];
+                }
+                if (peak) row[x] = (m > high) ? CANNY_EDGE : CANNY_WEAK;
+            }
+            t = prev;
+            prev = cur;
+            cur = next;
+            next = t;
+        }
+    }
+}
+
+// Turn the candidates connected to the n pixels on stack into edges, following them
+// within rows [y0, y1) of img; the pixels on the stack are edges already
+static inline void canny_grow(struct image *img, int *stack, int n, int y0, int y1) {
+    int width = img->width, p, x, y, nx, ny;
+    byte *row;
+
+    while (n > 0) {
+        p = stack[--n];
+        x = p % width;
+        y = p / width;
+        for (ny = (y > y0) ? y - 1 : y0; ny <= y + 1 && ny < y1; ny++) {
+            row = image_row (img, 0, ny);
+            for (nx = (x > 0) ? x - 1 : 0; nx <= x + 1 && nx < width; nx++) {
+                if (row[nx] != CANNY_WEAK) continue;
+                row[nx] = CANNY_EDGE;
+                stack[n++] = ny * width + nx;
+            }
+        }
+    }
+}
+
+// Follow the edges of rows [y0, y1) of img within those rows
+static inline void canny_trace_rows(struct canny_plan *plan, struct image *img, int y0, int y1) {
+    int *stack = plan->stack + (size_t) y0 * img->width, x, y;
+    const byte *row;
+
+    for (y = y0; y < y1; y++) {
+        row = image_row (img, 0, y);
+        for (x = 0; x < img->width; x++) {
+            if (row[x] != CANNY_EDGE) continue;
+            stack[0] = y * img->width + x;
+            canny_grow (img, stack, 1, y0, y1);
+        }
+    }
+}
+
+// Collect the candidates of band, rows [y0, y1), that touch an edge in the row above or
+// below it. Reads img only.
+static inline void canny_seed_rows(struct canny_plan *plan, const struct image *img, int band, int y0, int y1) {
+    int *seeds = plan->seeds + (size_t) 2 * img->width * band, n = 0, x, k, side, y, outside;
+    const byte *row, *next;
+
+    for (side = 0; side < 2; side++) {
+        y = side ? y1 - 1 : y0;
+        outside = side ? y1 : y0 - 1;
+        if (outside < 0 || outside >= img->height) continue;
+        row = image_row (img, 0, y);
+        next = image_row (img, 0, outside);
+        for (x = 0; x < img->width; x++) {
+            if (row[x] != CANNY_WEAK) continue;
+            for (k = (x > 0) ? x - 1 : 0; k <= x + 1 && k < img->width; k++)
+                if (next[k] == CANNY_EDGE) break;
+            if (k <= x + 1 && k < img->width)
+                seeds[n++] = y * img->width + x;
+        }
+    }
+    plan->nseeds[band] = n;
+}
+
+// Grow the edges of band, rows [y0, y1), from the seeds canny_seed_rows collected
+static inline void canny_grow_rows(struct canny_plan *plan, struct image *img, int band, int y0, int y1) {
+    int *seeds = plan->seeds + (size_t) 2 * img->width * band, *stack = plan->stack + (size_t) y0 * img->width;
+    int i, p;
+    byte *pixel;
+
+    for (i = 0; i < plan->nseeds[band]; i++) {
+        p = seeds[i];
+        pixel = image_row (img, 0, p / img->width) + p % img->width;
+        // a seed in a one-row band may be collected from both sides
+        if (*pixel != CANNY_WEAK) continue;
+        *pixel = CANNY_EDGE;
+        stack[0] = p;
+        canny_grow (img, stack, 1, y0, y1);
+    }
+}
+
+// Drop the candidates that were never reached
+static inline void canny_finish_rows(struct image *img, int y0, int y1) {
+    byte *row;
+    int x, y;
+
+    for (y = y0; y < y1; y++) {
+        row = image_row (img, 0, y);
+        for (x = 0; x < img->width; x++)
+            if (row[x] == CANNY_WEAK) row[x] = 0;
+    }
+}
+
+#endif
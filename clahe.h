@@ -0,0 +1,216 @@
+// Contrast-limited adaptive histogram equalization (CLAHE).
+//
+// The image is divided into a grid of tiles and each tile gets an equalization map of
+// its own, made from the histogram of its gray levels, so a dark corner is stretched
+// by what is in that corner rather than by the whole image. Before the map is made,
+// every bin is clipped to clip times the mean bin count and what was cut off is spread
+// evenly over all the bins, which limits how much the flat areas of a tile (and the
+// noise in them) are amplified. A pixel is then mapped through the four tiles whose
+// centres surround it and the results are interpolated bilinearly, so the tile edges
+// do not show.
+//
+// Two sweeps, both split into bands by the thread pool:
+//   clahe_tile_rows   a band of tile rows: count each tile's histogram (a colour image
+//                     is turned gray on the way, into the output) and make its map
+//   clahe_rows        a band of image rows: map every pixel. The columns between two
+//                     tile centres and the weights of each column are worked out once
+//                     per image size, and the maps of the two tile rows a row reads
+//                     stay in L1.
+// The output is always a gray image.
+#ifndef CLAHE_H
+#define CLAHE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "cpu_dispatch.h"
+#include "image.h"
+#include "histogram.h"
+
+#define CLAHE_MAX_TILES 64
+#define CLAHE_WEIGHT_BITS 8     // fraction bits of the interpolation weights
+
+struct clahe_plan {
+    int width, height;
+    int tiles_x, tiles_y;
+    int *tile_x;                // first column of each tile, and the width after the last
+    int *tile_y;                // first row of each tile, and the height after the last
+    int *span;                  // columns between two tile centres: span[k] to span[k + 1] - 1
+    int *left, *right;          // map offsets of the tiles each span is interpolated between
+    int nspans;
+    int *weight;                // weight of the right tile in each column
+    unsigned char *maps;        // 256 entries per tile, row by row
+    unsigned int *banks;        // per band: the banked histograms of one row of tiles
+    int nbands;
+};
+
+static inline void clahe_plan_free(struct clahe_plan *plan) {
+    free (plan->tile_x);
+    free (plan->tile_y);
+    free (plan->span);
+    free (plan->left);
+    free (plan->right);
+    free (plan->weight);
+    free (plan->maps);
+    free (plan->banks);
+    memset (plan, 0, sizeof(struct clahe_plan));
+}
+
+// Tile and weight of the tile centres to either side of pixel i of n, split into tiles
+// tiles, as the position between the two centres rounded to CLAHE_WEIGHT_BITS fixed
+// point. Pixels before the first centre or after the last take that tile alone.
+static inline void clahe_between(int i, int n, int tiles, int *first, int *second, int *weight) {
+    long long pos = (long long) (2 * i + 1) * tiles - n;
+
+    *first = *second = 0;
+    *weight = 0;
+    if (pos < 0) return;
+    pos = ((pos << CLAHE_WEIGHT_BITS) + n) / (2 * n);
+    *first = (int) (pos >> CLAHE_WEIGHT_BITS);
+    if (*first >= tiles - 1) {
+        *first = *second = tiles - 1;
+        return;
+    }
+    *second = *first + 1;
+    *weight = (int) (pos & ((1 << CLAHE_WEIGHT_BITS) - 1));
+}
+
+// Plan for width x height images split into up to tiles x tiles tiles (fewer if the
+// image is narrower or shorter than that), with room for nbands bands counting at the
+// same time. The plan must start out zeroed; it is kept if it already fits. Returns -1
+// if out of memory.
+static inline int clahe_plan_init(struct clahe_plan *plan, int width, int height, int tiles, int nbands) {
+    int tx = (tiles < width) ? tiles : width, ty = (tiles < height) ? tiles : height, i, first, second;
+
+    if (plan->maps && plan->width == width && plan->height == height && plan->tiles_x == tx && plan->tiles_y == ty
+        && plan->nbands >= nbands)
+        return 0;
+    clahe_plan_free (plan);
+    plan->width = width;
+    plan->height = height;
+    plan->tiles_x = tx;
+    plan->tiles_y = ty;
+    plan->nbands = nbands;
+    plan->tile_x = malloc (sizeof(int) * (tx + 1));
+    plan->tile_y = malloc (sizeof(int) * (ty + 1));
+    // every tile centre starts a span, plus the columns before the first one
+    plan->span = malloc (sizeof(int) * (tx + 2));
+    plan->left = malloc (sizeof(int) * (tx + 1));
+    plan->right = malloc (sizeof(int) * (tx + 1));
+    plan->weight = malloc (sizeof(int) * width);
+    plan->maps = malloc ((size_t) tx * ty * 256);
+    plan->banks = malloc (sizeof(unsigned int) * HISTOGRAM_BANKS * 256 * tx * nbands);
+    if (!plan->tile_x || !plan->tile_y || !plan->span || !plan->left || !plan->right || !plan->weight || !plan->maps
+        || !plan->banks) {
+        clahe_plan_free (plan);
+        return -1;
+    }
+    for (i = 0; i <= tx; i++)
+        plan->tile_x[i] = (int) ((long long) width * i / tx);
+    for (i = 0; i <= ty; i++)
+        plan->tile_y[i] = (int) ((long long) height * i / ty);
+    for (i = 0; i < width; i++) {
+        clahe_between (i, width, tx, &first, &second, &plan->weight[i]);
+        if (i == 0 || first * 256 != plan->left[plan->nspans - 1] || second * 256 != plan->right[plan->nspans - 1]) {
+            plan->span[plan->nspans] = i;
+            plan->left[plan->nspans] = first * 256;
+            plan->right[plan->nspans] = second * 256;
+            plan->nspans++;
+        }
+    }
+    plan->span[plan->nspans] = width;
+    return 0;
+}
+
+// Clip the histogram of a tile of area pixels to clip times the mean bin count (no
+// limit if clip is 0), spread the excess over the bins and make the equalization map
+static inline void clahe_map(unsigned int *count, long long area, int clip, unsigned char *map) {
+    long long limit = (long long) clip * area / 256, excess = 0, below = 0;
+    int v, step, spread;
+
+    if (clip > 0) {
+        if (limit < 1) limit = 1;
+        for (v = 0; v < 256; v++) {
+            if (count[v] > limit) {
+                excess += count[v] - limit;
+                count[v] = (unsigned int) limit;
+            }
+        }
+        for (v = 0; v < 256; v++)
+            count[v] += (unsigned int) (excess / 256);
+        // the remainder one at a time, evenly spaced over the range
+        spread = (int) (excess % 256);
+        step = spread ? 256 / spread : 0;
+        for (v = 0; spread > 0; v += step, spread--)
+            count[v]++;
+    }
+    for (v = 0; v < 256; v++) {
+        below += count[v];
+        map[v] = (unsigned char) ((below * 255 + area / 2) / area);
+    }
+}
+
+// Count the tiles in rows of tiles [t0, t1) and make their maps, with the banks of
+// band. img is the input; a colour one is made gray into out first, and the tiles are
+// counted from there.
+static inline void clahe_tile_rows(struct clahe_plan *plan, const struct image *img, struct image *out, int clip,
+                                   int band, int t0, int t1) {
+    unsigned int (*banks)[HISTOGRAM_BANKS][256] = (unsigned int (*)[HISTOGRAM_BANKS][256])
+                                                  (plan->banks + (size_t) HISTOGRAM_BANKS * 256 * plan->tiles_x * band);
+    unsigned int count[256];
+    const byte *row;
+    int t, y, tx, k, v, rows;
+
+    for (t = t0; t < t1; t++) {
+        rows = plan->tile_y[t + 1] - plan->tile_y[t];
+        memset (banks, 0, sizeof(unsigned int) * HISTOGRAM_BANKS * 256 * plan->tiles_x);
+        for (y = plan->tile_y[t]; y < plan->tile_y[t + 1]; y++) {
+            if (img->layout == IMAGE_INTERLEAVED)
+                kernels->gray_from_bgr (image_row (img, 0, y), image_row (out, 0, y), img->width);
+            else if (img->layout == IMAGE_PLANAR)
+                kernels->gray_from_planar (image_row (img, 0, y), image_row (img, 1, y), image_row (img, 2, y),
+                                           image_row (out, 0, y), img->width);
+            row = image_row ((img->layout == IMAGE_GRAY) ? img : out, 0, y);
+            for (tx = 0; tx < plan->tiles_x; tx++)
+                histogram_count_bytes (banks[tx], row + plan->tile_x[tx], 1, plan->tile_x[tx + 1] - plan->tile_x[tx]);
+        }
+        for (tx = 0; tx < plan->tiles_x; tx++) {
+            for (v = 0; v < 256; v++)
+                for (count[v] = 0, k = 0; k < HISTOGRAM_BANKS; k++)
+                    count[v] += banks[tx][k][v];
+            clahe_map (count, (long long) (plan->tile_x[tx + 1] - plan->tile_x[tx]) * rows, clip,
+                       plan->maps + ((size_t) t * plan->tiles_x + tx) * 256);
+        }
+    }
+}
+
+// Map rows [y0, y1) of the gray image in into out (which may be the same image)
+static inline void clahe_rows(const struct clahe_plan *plan, const struct image *in, struct image *out, int y0,
+                              int y1) {
+    const int one = 1 << CLAHE_WEIGHT_BITS;
+    const unsigned char *top, *bottom, *tl, *tr, *bl, *br;
+    const byte *src;
+    byte *dst;
+    int y, x, k, t0, t1, wy, v, a, b;
+
+    for (y = y0; y < y1; y++) {
+        clahe_between (y, plan->height, plan->tiles_y, &t0, &t1, &wy);
+        top = plan->maps + (size_t) t0 * plan->tiles_x * 256;
+        bottom = plan->maps + (size_t) t1 * plan->tiles_x * 256;
+        src = image_row (in, 0, y);
+        dst = image_row (out, 0, y);
+        for (k = 0; k < plan->nspans; k++) {
+            tl = top + plan->left[k];
+            tr = top + plan->right[k];
+            bl = bottom + plan->left[k];
+            br = bottom + plan->right[k];
+            for (x = plan->span[k]; x < plan->span[k + 1]; x++) {
+                v = src[x];
+                a = tl[v] * one + (tr[v] - tl[v]) * plan->weight[x];
+                b = bl[v] * one + (br[v] - bl[v]) * plan->weight[x];
+                dst[x] = (byte) ((a * one + (b - a) * wy + one * one / 2) >> (2 * CLAHE_WEIGHT_BITS));
+            }
+        }
+    }
+}
+
+#endif
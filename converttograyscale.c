@@ -4,7 +4,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef VIDEO_SW
+#include "video_sw.h"
+#else
 #include <intelfpgaup/video.h>
+#endif
+#include "cpu_dispatch.h"
 #define PI 3.141592654
 
 typedef unsigned char byte;
@@ -48,18 +53,9 @@ int read_bmp(char *filename, byte **header, struct pixel **data) {
 }
 
 // Determine the grayscale 8-bit value by averaging the r, g, and b channel values.
-// Store the 8-bit grayscale value in the r channel.
+// Store the 8-bit grayscale value in all three channels.
 void convert_to_grayscale(struct pixel *data) {
-    int x, y;
-    
-    // declare image as a 2-D array so that we can use the syntax image[row][column]
-    struct pixel (*image)[width] = (struct pixel (*)[width]) data;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            // Just use the 8 bits of the r field to hold the entire grayscale image
-            image[y][x].r = (image[y][x].r + image[y][x].b + image[y][x].g) / 3;
-        }
-    }
+    kernels->grayscale ((unsigned char *) data, (size_t) width * height);
 }
 
 // Write the grayscale image to disk. The 8-bit grayscale values should be inside the
@@ -133,18 +129,20 @@ int main(int argc, char *argv[]) {
     struct pixel *image;
     //signed int *G_x, *G_y;
     byte *header;
+    char *kernel_variant = NULL;
     int debug = 0, video = 0;
     time_t start, end;
     
     // Check inputs
     if (argc < 2) {
-        printf("Usage: part1 [-d] [-v] <BMP filename>\n");
+        printf("Usage: part1 [-d] [-v] [-k variant] <BMP filename>\n");
         printf("-d: produces debug output for each stage\n");
         printf("-v: draws the input and output images on a video-out display\n");
+        printf("-k: forces a kernel variant (avx512bw, avx2, sse2, neon or scalar) instead of the best one for this CPU\n");
         return 0;
     }
     int opt;
-    while ((opt = getopt (argc, argv, "dv")) != -1) {
+    while ((opt = getopt (argc, argv, "dvk:")) != -1) {
         switch (opt) {
             case 'd':  
                 debug = 1;
@@ -152,11 +150,18 @@ int main(int argc, char *argv[]) {
             case 'v':  
                 video = 1;
                 break;  
+            case 'k':
+                kernel_variant = optarg;
+                break;
             case '?':  
                 printf("unknown option: %c\n", optopt); 
                 break;  
         }  
     }  
+    // Pick the kernels for this CPU (or the ones forced with -k)
+    if (kernel_dispatch_init (kernel_variant) < 0)
+        return -1;
+    if (debug) printf("KERNELS: %s\n", kernels->name);
     // Open input image file (24-bit bitmap image)
     if (read_bmp (argv[optind], &header, &image) < 0) {
         printf("Failed to read BMP\n");
@@ -0,0 +1,215 @@
+// Separable 2-D convolution: Gaussian and box blurs, sharpening and Sobel derivatives.
+//
+// Every filter here is separable, a horizontal pass of taps weights followed by a
+// vertical one, so a taps x taps filter costs 2 * taps multiply-adds per pixel instead
+// of taps squared. Each source row is made gray (if it is colour), padded at either
+// end by repeating its edge pixel and filtered horizontally into a row of 16-bit sums,
+// which goes into a ring of taps rows; each output row is then the vertical pass over
+// the ring. The rows an output row needs only ever move down, so every source row is
+// read and filtered once per band however many output rows it contributes to. Rows
+// above the top and below the bottom repeat the edge rows.
+//
+// Two kinds of output:
+//   bytes    gaussian, box and sharpen. The weights are in the resize engine's fixed
+//            point (RESIZE_WEIGHT_BITS, adding up to one) and the horizontal sums keep
+//            RESIZE_ROW_BITS fraction bits, so the vertical pass is the resize engine's
+//            kernel. Sharpen is the image plus a multiple of its difference from a
+//            Gaussian blur, added once the blurred row is done.
+//   signed   sobel. Integer weights, and the vertical sums are kept whole as ints, one
+//            per pixel with no row padding, which is the derivative format that
+//            write_signed_bmp reads.
+// Both passes are vector kernels (simd_kernels.h). A plan may hold two filters of the
+// same size, e.g. the x and y derivatives, which then share the loading of every row.
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu_dispatch.h"
+#include "image.h"
+
+#define CONVOLVE_MAX_RADIUS 15
+#define CONVOLVE_MAX_TAPS (2 * CONVOLVE_MAX_RADIUS + 1)
+#define CONVOLVE_MAX_FILTERS 2
+
+enum convolve_kind {
+    CONVOLVE_GAUSSIAN,
+    CONVOLVE_BOX,
+    CONVOLVE_SOBEL_X,   // derivative across the rows, smoothed along the columns
+    CONVOLVE_SOBEL_Y    // derivative along the columns, smoothed across the rows
+};
+
+struct convolve_filter {
+    int radius;                     // taps is 2 * radius + 1
+    int is_signed;                  // writes derivatives rather than a gray image
+    int shift;                      // of the horizontal sums
+    short h[CONVOLVE_MAX_TAPS];     // horizontal weights
+    short v[CONVOLVE_MAX_TAPS];     // vertical weights
+};
+
+struct convolve_plan {
+    struct convolve_filter filter[CONVOLVE_MAX_FILTERS];    // all of the same radius
+    int nfilters;
+    int sharpen;            // 256ths of the difference from the blur added to the image, 0 for none
+    short *scratch;         // per band: a padded source row, then a ring of rows per filter
+    size_t band_size;       // shorts of scratch per band
+    int nbands;
+};
+
+// Round weights that add up to one into RESIZE_WEIGHT_BITS fixed point, giving the
+// rounding error to the largest so the fixed-point weights add up to exactly one and
+// flat areas stay flat
+static inline void convolve_normalize(const double *weight, int taps, short *out) {
+    double total = 0;
+    int t, sum = 0, largest = 0;
+
+    for (t = 0; t < taps; t++)
+        total += weight[t];
+    for (t = 0; t < taps; t++) {
+        out[t] = (short) (weight[t] / total * (1 << RESIZE_WEIGHT_BITS) + 0.5);
+        sum += out[t];
+        if (out[t] > out[largest]) largest = t;
+    }
+    out[largest] += (1 << RESIZE_WEIGHT_BITS) - sum;
+}
+
+// Set up a filter of the given radius (sobel is always radius 1). The Gaussian uses the
+// sigma OpenCV picks for its size, 0.3 * (radius - 1) + 0.8.
+static inline void convolve_filter_init(struct convolve_filter *f, enum convolve_kind kind, int radius) {
+    static const short smooth[3] = { 1, 2, 1 }, derive[3] = { -1, 0, 1 };
+    double weight[CONVOLVE_MAX_TAPS], sigma = 0.3 * (radius - 1) + 0.8;
+    int t;
+
+    memset (f, 0, sizeof(struct convolve_filter));
+    if (kind == CONVOLVE_SOBEL_X || kind == CONVOLVE_SOBEL_Y) {
+        f->radius = 1;
+        f->is_signed = 1;
+        memcpy (f->h, (kind == CONVOLVE_SOBEL_X) ? derive : smooth, sizeof(smooth));
+        memcpy (f->v, (kind == CONVOLVE_SOBEL_X) ? smooth : derive, sizeof(smooth));
+        return;
+    }
+    f->radius = radius;
+    f->shift = RESIZE_WEIGHT_BITS - RESIZE_ROW_BITS;
+    for (t = 0; t <= 2 * radius; t++)
+        weight[t] = (kind == CONVOLVE_BOX) ? 1 : exp (-(double) (t - radius) * (t - radius) / (2 * sigma * sigma));
+    convolve_normalize (weight, 2 * radius + 1, f->h);
+    memcpy (f->v, f->h, sizeof(f->h));
+}
+
+// Shorts a padded source row of width pixels takes, rounded up to keep the rings aligned
+static inline size_t convolve_line_size(int width, int radius) {
+    return ((size_t) width + 2 * radius + 15) / 16 * 8;
+}
+
+static inline void convolve_plan_free(struct convolve_plan *plan) {
+    free (plan->scratch);
+    plan->scratch = NULL;
+    plan->band_size = 0;
+    plan->nbands = 0;
+}
+
+// Make room for nbands bands filtering width-pixel rows with the plan's filters; the
+// scratch is kept until it is too small. Returns -1 if out of memory.
+static inline int convolve_plan_scratch(struct convolve_plan *plan, int width, int nbands) {
+    int taps = 2 * plan->filter[0].radius + 1;
+    size_t size = convolve_line_size (width, plan->filter[0].radius) + (size_t) plan->nfilters * taps * width;
+
+    if (plan->scratch && plan->band_size >= size && plan->nbands >= nbands) return 0;
+    free (plan->scratch);
+    plan->scratch = malloc (sizeof(short) * size * nbands);
+    plan->band_size = plan->scratch ? size : 0;
+    plan->nbands = plan->scratch ? nbands : 0;
+    return plan->scratch ? 0 : -1;
+}
+
+// Gray level of row y of img, padded with radius copies of the edge pixels on either
+// side
+static inline void convolve_load(byte *line, const struct image *img, int y, int radius) {
+    byte *row = line + radius;
+
+    if (img->layout == IMAGE_INTERLEAVED)
+        kernels->gray_from_bgr (image_row (img, 0, y), row, img->width);
+    else if (img->layout == IMAGE_PLANAR)
+        kernels->gray_from_planar (image_row (img, 0, y), image_row (img, 1, y), image_row (img, 2, y), row, img->width);
+    else
+        memcpy (row, image_row (img, 0, y), img->width);
+    memset (line, row[0], radius);
+    memset (row + img->width, row[img->width - 1], radius);
+}
+
+// Add amount 256ths of the difference between the row and its blur to the row, into
+// blurred
+static inline void convolve_sharpen(const byte *row, byte *blurred, int amount, int n) {
+    int x, v;
+
+    for (x = 0; x < n; x++) {
+        v = row[x] + (((row[x] - blurred[x]) * amount + 128) >> 8);
+        blurred[x] = (v < 0) ? 0 : ((v > 255) ? 255 : v);
+    }
+}
+
+// Gradient magnitude of a row of derivatives, |gx| + |gy| clamped to 255; gy may be
+// NULL for a single derivative
+static inline void convolve_magnitude(const int *gx, const int *gy, byte *out, int n) {
+    int x, v;
+
+    for (x = 0; x < n; x++) {
+        v = abs (gx[x]) + (gy ? abs (gy[x]) : 0);
+        out[x] = (v > 255) ? 255 : v;
+    }
+}
+
+// Filter rows [y0, y1) of src with the scratch of band. Byte filters write the rows of
+// dst, a gray image of the same size; signed filter k writes derivative[k], width ints
+// per row, and their gradient magnitude goes into dst unless it is NULL.
+static inline void convolve_rows(const struct convolve_plan *plan, const struct image *src, struct image *dst,
+                                 int *const *derivative, int y0, int y1, int band) {
+    int radius = plan->filter[0].radius, taps = 2 * radius + 1, width = src->width;
+    short *scratch = plan->scratch + plan->band_size * band;
+    short *rings = scratch + convolve_line_size (width, radius);
+    byte *line = (byte *) scratch;
+    const short *rows[CONVOLVE_MAX_TAPS];
+    const struct convolve_filter *f;
+    int held[CONVOLVE_MAX_TAPS], slots[CONVOLVE_MAX_TAPS], y, t, s, k, slot;
+
+    for (slot = 0; slot < taps; slot++)
+        held[slot] = -1;
+    for (y = y0; y < y1; y++) {
+        // taps consecutive rows, clamped to the image, never share a slot
+        for (t = 0; t < taps; t++) {
+            s = y + t - radius;
+            s = (s < 0) ? 0 : ((s >= src->height) ? src->height - 1 : s);
+            slot = s % taps;
+            if (held[slot] != s) {
+                convolve_load (line, src, s, radius);
+                for (k = 0; k < plan->nfilters; k++)
+                    kernels->convolve_horizontal (line, plan->filter[k].h, taps, plan->filter[k].shift,
+                                                  rings + ((size_t) k * taps + slot) * width, width);
+                held[slot] = s;
+            }
+            slots[t] = slot;
+        }
+        for (k = 0; k < plan->nfilters; k++) {
+            f = &plan->filter[k];
+            for (t = 0; t < taps; t++)
+                rows[t] = rings + ((size_t) k * taps + slots[t]) * width;
+            if (f->is_signed)
+                kernels->convolve_vertical_signed (rows, f->v, taps, derivative[k] + (size_t) y * width, width);
+            else
+                kernels->resize_vertical (rows, f->v, taps, image_row (dst, 0, y), width);
+        }
+        if (plan->filter[0].is_signed && dst)
+            convolve_magnitude (derivative[0] + (size_t) y * width,
+                                (plan->nfilters > 1) ? derivative[1] + (size_t) y * width : NULL, image_row (dst, 0, y),
+                                width);
+        if (plan->sharpen) {
+            if (src->layout != IMAGE_GRAY)
+                convolve_load (line, src, y, radius);
+            convolve_sharpen ((src->layout == IMAGE_GRAY) ? image_row (src, 0, y) : line + radius,
+                              image_row (dst, 0, y), plan->sharpen, width);
+        }
+    }
+}
+
+#endif
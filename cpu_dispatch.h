@@ -0,0 +1,165 @@
+// Runtime selection of the enhancement kernels.
+//
+// kernel_dispatch_init() checks the CPU once at startup and points `kernels` at the
+// widest kernel set it supports: AVX-512BW, AVX2 or SSE2 on x86, NEON on the HPS, and
+// the scalar reference everywhere else. Passing a variant name (the -k option of every
+// program) forces that set instead, which is how the variants are benchmarked against
+// each other on one machine.
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include "simd_kernels.h"
+
+#if defined(SIMD_HAVE_NEON) && defined(__arm__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+struct kernel_table {
+    const char *name;
+    int (*supported)(void);
+    void (*grayscale)(unsigned char *bgr, size_t npixels);
+    void (*invert)(unsigned char *p, size_t n);
+    void (*brightness)(unsigned char *p, size_t n, int brightness, int sign);
+    void (*contrast)(unsigned char *bgr, size_t npixels, int threshold, int contrast_factor, int sign);
+    void (*threshold)(unsigned char *bgr, size_t npixels, int threshold);
+    // the same operations on separate b, g and r planes
+    void (*contrast_planar)(unsigned char *b, unsigned char *g, unsigned char *r, size_t n,
+                            int threshold, int contrast_factor, int sign);
+    void (*threshold_planar)(unsigned char *b, unsigned char *g, unsigned char *r, size_t n, int threshold);
+    // ... and on a single gray plane (invert and brightness need no gray version)
+    void (*contrast_gray)(unsigned char *p, size_t n, int threshold, int contrast_factor, int sign);
+    void (*threshold_gray)(unsigned char *p, size_t n, int threshold);
+    // conversion between interleaved pixels, planes and gray
+    void (*deinterleave)(const unsigned char *bgr, unsigned char *b, unsigned char *g, unsigned char *r, size_t n);
+    void (*interleave)(const unsigned char *b, const unsigned char *g, const unsigned char *r, unsigned char *bgr, size_t n);
+    void (*gray_from_bgr)(const unsigned char *bgr, unsigned char *gray, size_t npixels);
+    void (*gray_from_planar)(const unsigned char *b, const unsigned char *g, const unsigned char *r,
+                             unsigned char *gray, size_t n);
+    // vertical pass of the resize engine (resize.h)
+    void (*resize_vertical)(const short *const *rows, const short *weights, int taps, unsigned char *out, size_t n);
+    // passes of the convolution engine (convolve.h)
+    void (*convolve_horizontal)(const unsigned char *src, const short *weights, int taps, int shift, short *out,
+                                size_t n);
+    void (*convolve_vertical_signed)(const short *const *rows, const short *weights, int taps, int *out, size_t n);
+    // 3 x 3 median of padded gray rows (median.h)
+    void (*median3)(const unsigned char *const *rows, unsigned char *out, size_t n);
+};
+
+static int cpu_has_scalar(void) {
+    return 1;
+}
+
+#if defined(SIMD_HAVE_X86)
+static int cpu_has_sse2(void) {
+    __builtin_cpu_init ();
+    return __builtin_cpu_supports ("sse2");
+}
+
+static int cpu_has_avx2(void) {
+    __builtin_cpu_init ();
+    return __builtin_cpu_supports ("avx2");
+}
+
+static int cpu_has_avx512bw(void) {
+    __builtin_cpu_init ();
+    return __builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw");
+}
+#endif
+
+#if defined(SIMD_HAVE_NEON)
+static int cpu_has_neon(void) {
+#if defined(__arm__) && defined(__linux__)
+    // 32-bit ARM: the kernel reports whether this core actually has the NEON unit
+    return (getauxval (AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+    return 1;   // NEON is mandatory on AArch64
+#endif
+}
+#endif
+
+// Kernel sets from widest to narrowest; the first supported one is the default
+static const struct kernel_table kernel_tables[] = {
+#if defined(SIMD_HAVE_X86)
+    { "avx512bw", cpu_has_avx512bw, grayscale_kernel_avx512bw, invert_kernel_avx512bw,
+      brightness_kernel_avx512bw, contrast_kernel_avx512bw, threshold_kernel_avx512bw,
+      contrast_planar_kernel_avx512bw, threshold_planar_kernel_avx512bw,
+      contrast_gray_kernel_avx512bw, threshold_gray_kernel_avx512bw,
+      deinterleave_kernel_avx512bw, interleave_kernel_avx512bw,
+      gray_from_bgr_kernel_avx512bw, gray_from_planar_kernel_avx512bw,
+      resize_vertical_kernel_avx512bw,
+      convolve_horizontal_kernel_avx512bw, convolve_vertical_signed_kernel_avx512bw,
+      median3_kernel_avx512bw },
+    { "avx2", cpu_has_avx2, grayscale_kernel_avx2, invert_kernel_avx2,
+      brightness_kernel_avx2, contrast_kernel_avx2, threshold_kernel_avx2,
+      contrast_planar_kernel_avx2, threshold_planar_kernel_avx2,
+      contrast_gray_kernel_avx2, threshold_gray_kernel_avx2,
+      deinterleave_kernel_avx2, interleave_kernel_avx2,
+      gray_from_bgr_kernel_avx2, gray_from_planar_kernel_avx2,
+      resize_vertical_kernel_avx2,
+      convolve_horizontal_kernel_avx2, convolve_vertical_signed_kernel_avx2,
+      median3_kernel_avx2 },
+    { "sse2", cpu_has_sse2, grayscale_kernel_sse2, invert_kernel_sse2,
+      brightness_kernel_sse2, contrast_kernel_sse2, threshold_kernel_sse2,
+      contrast_planar_kernel_sse2, threshold_planar_kernel_sse2,
+      contrast_gray_kernel_sse2, threshold_gray_kernel_sse2,
+      deinterleave_kernel_sse2, interleave_kernel_sse2,
+      gray_from_bgr_kernel_sse2, gray_from_planar_kernel_sse2,
+      resize_vertical_kernel_sse2,
+      convolve_horizontal_kernel_sse2, convolve_vertical_signed_kernel_sse2,
+      median3_kernel_sse2 },
+#endif
+#if defined(SIMD_HAVE_NEON)
+    { "neon", cpu_has_neon, grayscale_kernel_neon, invert_kernel_neon,
+      brightness_kernel_neon, contrast_kernel_neon, threshold_kernel_neon,
+      contrast_planar_kernel_neon, threshold_planar_kernel_neon,
+      contrast_gray_kernel_neon, threshold_gray_kernel_neon,
+      deinterleave_kernel_neon, interleave_kernel_neon,
+      gray_from_bgr_kernel_neon, gray_from_planar_kernel_neon,
+      resize_vertical_kernel_neon,
+      convolve_horizontal_kernel_neon, convolve_vertical_signed_kernel_neon,
+      median3_kernel_neon },
+#endif
+    { "scalar", cpu_has_scalar, grayscale_kernel_scalar, invert_kernel_scalar,
+      brightness_kernel_scalar, contrast_kernel_scalar, threshold_kernel_scalar,
+      contrast_planar_kernel_scalar, threshold_planar_kernel_scalar,
+      contrast_gray_kernel_scalar, threshold_gray_kernel_scalar,
+      deinterleave_kernel_scalar, interleave_kernel_scalar,
+      gray_from_bgr_kernel_scalar, gray_from_planar_kernel_scalar,
+      resize_vertical_kernel_scalar,
+      convolve_horizontal_kernel_scalar, convolve_vertical_signed_kernel_scalar,
+      median3_kernel_scalar },
+};
+
+#define KERNEL_TABLE_COUNT ((int) (sizeof(kernel_tables) / sizeof(kernel_tables[0])))
+
+// The kernel set in use; always valid, even before kernel_dispatch_init() is called
+static const struct kernel_table *kernels = &kernel_tables[KERNEL_TABLE_COUNT - 1];
+
+// Select the kernels. force is a variant name, or NULL to pick the best one the CPU
+// supports. Returns -1 if the forced variant is unknown or not supported here.
+static int kernel_dispatch_init(const char *force) {
+    int i;
+
+    for (i = 0; i < KERNEL_TABLE_COUNT; i++) {
+        if (force && strcmp (force, kernel_tables[i].name) != 0) continue;
+        if (!kernel_tables[i].supported ()) {
+            if (force) {
+                printf ("Error: %s kernels are not supported on this CPU\n", force);
+                return -1;
+            }
+            continue;
+        }
+        kernels = &kernel_tables[i];
+        return 0;
+    }
+    printf ("Error: unknown kernel variant %s (available:", force);
+    for (i = 0; i < KERNEL_TABLE_COUNT; i++)
+        printf (" %s", kernel_tables[i].name);
+    printf (")\n");
+    return -1;
+}
+
+#endif
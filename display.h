@@ -0,0 +1,110 @@
+// Row-at-a-time output to the VGA pixel buffer.
+//
+// video_pixel costs one driver write per pixel, a system call on the board, so a full
+// 320x240 frame took tens of thousands of them. draw_image instead builds each screen
+// row in an RGB565 line buffer and hands over the whole row at once; how the row then
+// reaches the screen depends on the build:
+//   -DVIDEO_SW    one bulk copy into the software framebuffer of video_sw.h
+//   -DVIDEO_MMAP  one copy into the back buffer, mapped through /dev/mem. The driver
+//                 still flips the pages, so it shows the buffer it would have drawn into.
+//   otherwise     one video_pixel call per pixel, as before
+// The frame is flipped once, by display_show.
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef VIDEO_SW
+#include "video_sw.h"
+#else
+#include <intelfpgaup/video.h>
+#endif
+#ifdef VIDEO_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+
+// Pixel buffer DMA controller of the DE1-SoC Computer, on the lightweight HPS-to-FPGA bridge
+#define DISPLAY_CTRL_BASE 0xFF203020
+#define DISPLAY_CTRL_BACK 1         // word offset of the back buffer address register
+#define DISPLAY_ROW_BYTES 1024      // pixel (x, y) is at (y << 10) | (x << 1)
+#endif
+
+struct display {
+    int width, height;              // screen size
+    unsigned short *pixels;         // mapped back buffer, NULL if rows go through the driver
+    size_t stride;                  // pixels from one row of the mapped buffer to the next
+    void *map;
+    size_t map_size;
+};
+
+// Start a frame on a width x height screen and clear it
+static inline void display_begin(struct display *d, int width, int height) {
+#ifdef VIDEO_MMAP
+    volatile unsigned int *ctrl;
+    long page = sysconf (_SC_PAGESIZE);
+    unsigned int back;
+    int fd;
+#endif
+
+    memset (d, 0, sizeof(struct display));
+    d->width = width;
+    d->height = height;
+    video_clear ( );
+#ifdef VIDEO_MMAP
+    // find the back buffer the driver will show next; fall back to video_pixel if the
+    // registers cannot be mapped (not root, or a system without the controller)
+    fd = open ("/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0) return;
+    ctrl = mmap (NULL, page, PROT_READ, MAP_SHARED, fd, DISPLAY_CTRL_BASE & ~(page - 1));
+    if (ctrl != MAP_FAILED) {
+        back = ctrl[(DISPLAY_CTRL_BASE & (page - 1)) / 4 + DISPLAY_CTRL_BACK];
+        munmap ((void *) ctrl, page);
+        d->map_size = (size_t) height * DISPLAY_ROW_BYTES;
+        d->map = mmap (NULL, d->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, back);
+        if (d->map == MAP_FAILED) {
+            d->map = NULL;
+        } else {
+            d->pixels = d->map;
+            d->stride = DISPLAY_ROW_BYTES / sizeof(unsigned short);
+        }
+    }
+    close (fd);
+#endif
+}
+
+// Write n RGB565 pixels to row y starting at column x; pixels off the screen are dropped
+static inline void display_row(struct display *d, int x, int y, const unsigned short *line, int n) {
+#ifndef VIDEO_SW
+    int i;
+#endif
+
+    if (y < 0 || y >= d->height) return;
+    if (x < 0) {
+        line -= x;
+        n += x;
+        x = 0;
+    }
+    if (x + n > d->width) n = d->width - x;
+    if (n <= 0) return;
+    if (d->pixels) {
+        memcpy (d->pixels + (size_t) y * d->stride + x, line, n * sizeof(unsigned short));
+        return;
+    }
+#ifdef VIDEO_SW
+    video_sw_row (x, y, line, n);
+#else
+    for (i = 0; i < n; i++)
+        video_pixel (x + i, y, line[i]);
+#endif
+}
+
+// Finish the frame and flip it onto the screen
+static inline void display_show(struct display *d) {
+    if (d->map) munmap (d->map, d->map_size);
+    d->map = NULL;
+    d->pixels = NULL;
+    video_show ( );
+}
+
+#endif
@@ -0,0 +1,172 @@
+// Histograms of the image and the levels derived from them.
+//
+// Otsu, stretch and equalize pick their threshold or map from the histogram of the
+// image they are applied to (see point_pipeline.h), so a fixed threshold no longer
+// breaks when the lighting changes. One pass over a colour image counts the gray level
+// and, when they are needed, the b, g and r channels together; a gray image only has
+// the gray level.
+//
+// A count that increments the same bin for consecutive pixels has to wait for the
+// previous increment to be stored before it can load the bin again, and flat image
+// areas, where that happens for whole rows, are the common case. Each histogram is
+// therefore kept as HISTOGRAM_BANKS sub-histograms used by consecutive pixels in turn,
+// so neighbouring increments never touch the same counter; the banks are only added up
+// once the counting is done. Every band of rows counts into a histogram of its own,
+// and the bands are merged after the sweep, so the threads share nothing while they
+// count.
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <string.h>
+#include "cpu_dispatch.h"
+#include "image.h"
+
+#define HISTOGRAM_BANKS 4
+#define HISTOGRAM_CHUNK 1024    // pixels whose gray level is computed at a time
+
+enum histogram_plane {
+    HISTOGRAM_B,
+    HISTOGRAM_G,
+    HISTOGRAM_R,
+    HISTOGRAM_LUMA,
+    HISTOGRAM_PLANES
+};
+
+// Counts of one band of rows, spread over the banks
+struct histogram {
+    unsigned int bank[HISTOGRAM_PLANES][HISTOGRAM_BANKS][256];
+};
+
+static inline void histogram_clear(struct histogram *h) {
+    memset (h, 0, sizeof(struct histogram));
+}
+
+// Count n values step bytes apart, each bank taking every fourth one
+static inline void histogram_count_bytes(unsigned int (*bank)[256], const byte *p, size_t step, size_t n) {
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4, p += 4 * step) {
+        bank[0][p[0]]++;
+        bank[1][p[step]]++;
+        bank[2][p[2 * step]]++;
+        bank[3][p[3 * step]]++;
+    }
+    for (; i < n; i++, p += step)
+        bank[0][*p]++;
+}
+
+// Count row y of img: the gray level, and if channels is set the b, g and r channels of
+// a colour image as well. The gray levels of a colour image are computed a chunk at a
+// time with the selected kernels, into a buffer that stays in L1.
+static inline void histogram_count_row(struct histogram *h, const struct image *img, int y, int channels) {
+    byte gray[HISTOGRAM_CHUNK];
+    const byte *b, *g, *r;
+    size_t x, n, step = (img->layout == IMAGE_INTERLEAVED) ? 3 : 1;
+
+    if (img->layout == IMAGE_GRAY) {
+        histogram_count_bytes (h->bank[HISTOGRAM_LUMA], image_row (img, 0, y), 1, img->width);
+        return;
+    }
+    b = image_row (img, 0, y);
+    g = (step == 3) ? b + 1 : image_row (img, 1, y);
+    r = (step == 3) ? b + 2 : image_row (img, 2, y);
+    if (channels) {
+        histogram_count_bytes (h->bank[HISTOGRAM_B], b, step, img->width);
+        histogram_count_bytes (h->bank[HISTOGRAM_G], g, step, img->width);
+        histogram_count_bytes (h->bank[HISTOGRAM_R], r, step, img->width);
+    }
+    for (x = 0; x < (size_t) img->width; x += n) {
+        n = ((size_t) img->width - x < HISTOGRAM_CHUNK) ? (size_t) img->width - x : HISTOGRAM_CHUNK;
+        if (step == 3)
+            kernels->gray_from_bgr (b + 3 * x, gray, n);
+        else
+            kernels->gray_from_planar (b + x, g + x, r + x, gray, n);
+        histogram_count_bytes (h->bank[HISTOGRAM_LUMA], gray, 1, n);
+    }
+}
+
+// Add up the banks of the first nbands histograms of bands into counts
+static inline void histogram_merge(const struct histogram *bands, int nbands,
+                                   unsigned int counts[HISTOGRAM_PLANES][256]) {
+    int i, p, k, v;
+
+    memset (counts, 0, sizeof(unsigned int) * HISTOGRAM_PLANES * 256);
+    for (i = 0; i < nbands; i++)
+        for (p = 0; p < HISTOGRAM_PLANES; p++)
+            for (k = 0; k < HISTOGRAM_BANKS; k++)
+                for (v = 0; v < 256; v++)
+                    counts[p][v] += bands[i].bank[p][k][v];
+}
+
+static inline long long histogram_total(const unsigned int *count) {
+    long long total = 0;
+    int v;
+
+    for (v = 0; v < 256; v++)
+        total += count[v];
+    return total;
+}
+
+// Otsu's threshold: the level that splits the histogram into the two classes with the
+// largest variance between them, returned as a threshold stage's level (the first
+// level of the brighter class). 128 for an empty histogram.
+static inline int histogram_otsu(const unsigned int *count) {
+    long long total = histogram_total (count), below = 0;
+    double sum = 0, sum_below = 0, mean_below, mean_above, between, best = -1;
+    int v, level = 128;
+
+    if (total == 0) return level;
+    for (v = 0; v < 256; v++)
+        sum += (double) v * count[v];
+    for (v = 0; v < 255; v++) {
+        below += count[v];
+        sum_below += (double) v * count[v];
+        if (below == 0) continue;
+        if (below == total) break;
+        mean_below = sum_below / below;
+        mean_above = (sum - sum_below) / (total - below);
+        between = (double) below * (total - below) * (mean_below - mean_above) * (mean_below - mean_above);
+        if (between > best) {
+            best = between;
+            level = v + 1;
+        }
+    }
+    return level;
+}
+
+// Linear map taking the level below which percent of the pixels lie to 0 and the one
+// above which percent lie to 255, clipping the pixels outside. The identity if the two
+// meet.
+static inline void histogram_stretch_map(const unsigned int *count, int percent, unsigned char *map) {
+    long long total = histogram_total (count), clip = total * percent / 100, seen;
+    int v, lo, hi;
+
+    for (lo = 0, seen = count[0]; lo < 255 && seen <= clip; seen += count[++lo]);
+    for (hi = 255, seen = count[255]; hi > 0 && seen <= clip; seen += count[--hi]);
+    for (v = 0; v < 256; v++) {
+        if (hi <= lo)
+            map[v] = v;
+        else
+            map[v] = (v <= lo) ? 0 : (v >= hi) ? 255 : ((v - lo) * 255 + (hi - lo) / 2) / (hi - lo);
+    }
+}
+
+// Histogram equalization: each level maps to the share of pixels at or below it, with
+// the darkest level present mapped to 0, so the output uses the whole range about
+// evenly. The identity if the image has a single level.
+static inline void histogram_equalize_map(const unsigned int *count, unsigned char *map) {
+    long long total = histogram_total (count), below = 0, first = 0;
+    int v;
+
+    for (v = 0; v < 256 && count[v] == 0; v++);
+    if (v < 256) first = count[v];
+    for (v = 0; v < 256; v++) {
+        below += count[v];
+        if (total == first)
+            map[v] = v;
+        else
+            map[v] = (below <= first) ? 0 : (unsigned char) (((below - first) * 255 + (total - first) / 2) / (total - first));
+    }
+}
+
+#endif
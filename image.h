@@ -0,0 +1,136 @@
+// Image container shared by the operations and the BMP reader and writer.
+//
+// An image is either interleaved (rows of struct pixel, exactly as a 24-bit BMP stores
+// them) or planar (separate b, g and r planes, the way image_read.v splits its input
+// into org_B, org_G and org_R). Planar rows start on a 64-byte boundary so vector
+// loads never straddle two rows. The BMP reader and writer convert between the two
+// with the interleave and deinterleave kernels of the selected kernel set.
+//
+// Once an image has been converted to grayscale its three channels are equal, so it is
+// kept as a single gray plane instead: every later stage reads and writes a third of
+// the memory, and the writer repeats each value into b, g and r only on the way out.
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "cpu_dispatch.h"
+
+typedef unsigned char byte;
+
+struct pixel {
+    byte b;
+    byte g;
+    byte r;
+};
+
+enum image_layout {
+    IMAGE_INTERLEAVED,
+    IMAGE_PLANAR,
+    IMAGE_GRAY,         // one byte per pixel, the output of the grayscale stage
+    IMAGE_LAYOUT_ANY    // only used by operations that have no preference
+};
+
+struct image_pool;
+
+struct image {
+    int width, height;
+    enum image_layout layout;
+    int nplanes;            // 1 for interleaved and gray, 3 for planar
+    size_t stride;          // bytes from the start of one row to the next, in every plane
+    byte *plane[3];         // interleaved, gray: plane[0] holds the pixels; planar: b, g and r
+    void *buffer;           // memory owned by the image, NULL if the pixels are borrowed
+    struct image_pool *pool;    // pool buffer came from (image_pool.h), NULL if from malloc
+    void *map;              // file mapping owned by the image, NULL if none
+    size_t map_size;
+};
+
+#define IMAGE_ALIGN 64
+
+static inline byte *image_row(const struct image *img, int plane, int y) {
+    return img->plane[plane] + (size_t) y * img->stride;
+}
+
+// Bytes of pixel data in one row of one plane
+static inline size_t image_row_bytes(const struct image *img) {
+    return (size_t) img->width * ((img->layout == IMAGE_INTERLEAVED) ? 3 : 1);
+}
+
+// Bytes of pixel data in the whole image, all planes
+static inline size_t image_bytes(const struct image *img) {
+    return image_row_bytes (img) * img->nplanes * img->height;
+}
+
+static inline struct pixel image_pixel(const struct image *img, int x, int y) {
+    struct pixel p;
+
+    if (img->layout == IMAGE_PLANAR) {
+        p.b = image_row (img, 0, y)[x];
+        p.g = image_row (img, 1, y)[x];
+        p.r = image_row (img, 2, y)[x];
+    } else if (img->layout == IMAGE_GRAY) {
+        p.b = image_row (img, 0, y)[x];
+        p.g = p.b;
+        p.r = p.b;
+    } else {
+        p = ((struct pixel *) image_row (img, 0, y))[x];
+    }
+    return p;
+}
+
+// Bytes of buffer behind the image, all planes with their row padding
+static inline size_t image_buffer_size(const struct image *img) {
+    return img->stride * img->height * img->nplanes;
+}
+
+// Set the size, layout and row stride of an image that has no pixels yet
+static inline void image_layout_init(struct image *img, int width, int height, enum image_layout layout) {
+    memset (img, 0, sizeof(struct image));
+    img->width = width;
+    img->height = height;
+    img->layout = layout;
+    if (layout == IMAGE_PLANAR || layout == IMAGE_GRAY) {
+        img->nplanes = (layout == IMAGE_PLANAR) ? 3 : 1;
+        img->stride = ((size_t) width + IMAGE_ALIGN - 1) & ~(size_t) (IMAGE_ALIGN - 1);
+    } else {
+        img->nplanes = 1;
+        img->stride = (size_t) width * 3;
+    }
+}
+
+// Allocate an image. Returns -1 if out of memory.
+static inline int image_alloc(struct image *img, int width, int height, enum image_layout layout) {
+    int i;
+
+    image_layout_init (img, width, height, layout);
+    if (posix_memalign (&img->buffer, IMAGE_ALIGN, image_buffer_size (img)) != 0) {
+        img->buffer = NULL;
+        return -1;
+    }
+    for (i = 0; i < img->nplanes; i++)
+        img->plane[i] = (byte *) img->buffer + img->stride * height * i;
+    return 0;
+}
+
+// Describe interleaved pixels that are already in memory, e.g. in a mapped file,
+// without copying them. Rows are stride bytes apart.
+static inline void image_borrow(struct image *img, int width, int height, byte *pixels, size_t stride) {
+    memset (img, 0, sizeof(struct image));
+    img->width = width;
+    img->height = height;
+    img->layout = IMAGE_INTERLEAVED;
+    img->nplanes = 1;
+    img->stride = stride;
+    img->plane[0] = pixels;
+}
+
+// Images whose buffer came from a pool are freed with image_release instead
+static inline void image_free(struct image *img) {
+    if (!img->pool) free (img->buffer);
+    img->buffer = NULL;
+    if (img->map) munmap (img->map, img->map_size);
+    img->map = NULL;
+}
+
+#endif
@@ -0,0 +1,173 @@
+// Reusable image buffers for runs over many images.
+//
+// Allocating a fresh buffer for every image costs more than the malloc call: a large
+// allocation is a new mapping, so the first pass over every image takes a page fault
+// per 4 KiB page, and the pages are handed back to the system when it is freed, only to
+// be faulted in again for the next image. A pool keeps the buffers of finished images
+// and hands them out again, already mapped, to the next image of a similar size.
+//
+// Buffer sizes are rounded up to a size class, a quarter of a power of two apart, so
+// images of slightly different sizes still share buffers, and a free buffer is reused
+// for any request of its class. With huge pages enabled, buffers of at least
+// IMAGE_POOL_HUGE_PAGE bytes are rounded up to whole huge pages and backed by them:
+// reserved huge pages (MAP_HUGETLB) if the system has any, otherwise transparent ones.
+// One TLB entry then covers 2 MiB instead of 4 KiB of the image.
+//
+// Free buffers are kept up to a limit in bytes; past it the least recently returned are
+// unmapped. The pool is locked, so one thread can take buffers and another return them.
+#ifndef IMAGE_POOL_H
+#define IMAGE_POOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "image.h"
+
+#define IMAGE_POOL_PAGE 4096
+#define IMAGE_POOL_HUGE_PAGE ((size_t) 2 << 20)
+
+// Header written into the start of a free buffer, so the free list needs no memory of
+// its own
+struct image_pool_block {
+    struct image_pool_block *next;
+    size_t size;
+};
+
+struct image_pool {
+    int huge;                           // back large buffers with huge pages
+    size_t limit;                       // most bytes of free buffers kept
+    size_t kept;                        // bytes of free buffers now kept
+    struct image_pool_block *free;      // free buffers, most recently returned first
+    pthread_mutex_t lock;
+    long long hits, misses;             // requests served from the free list, and by a new mapping
+};
+
+static void image_pool_init(struct image_pool *pool, size_t limit, int huge) {
+    memset (pool, 0, sizeof(struct image_pool));
+    pool->limit = limit;
+    pool->huge = huge;
+    pthread_mutex_init (&pool->lock, NULL);
+}
+
+// Unmap every free buffer. Buffers still held by images must be released first.
+static void image_pool_destroy(struct image_pool *pool) {
+    struct image_pool_block *block;
+
+    while ((block = pool->free) != NULL) {
+        pool->free = block->next;
+        munmap (block, block->size);
+    }
+    pool->kept = 0;
+    pthread_mutex_destroy (&pool->lock);
+}
+
+// Size class of a request of size bytes: rounded up to the next quarter power of two,
+// then to whole pages (huge pages for large buffers if they are enabled)
+static size_t image_pool_class(const struct image_pool *pool, size_t size) {
+    size_t step = IMAGE_POOL_PAGE, page;
+
+    while (step * 8 < size)
+        step *= 2;
+    size = (size + step - 1) & ~(step - 1);
+    page = (pool->huge && size >= IMAGE_POOL_HUGE_PAGE) ? IMAGE_POOL_HUGE_PAGE : IMAGE_POOL_PAGE;
+    return (size + page - 1) & ~(page - 1);
+}
+
+// Map a new buffer of a size class. Returns NULL if out of memory.
+static void *image_pool_map(const struct image_pool *pool, size_t size) {
+    void *buffer = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (pool->huge && size % IMAGE_POOL_HUGE_PAGE == 0)
+        buffer = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (buffer == MAP_FAILED) {
+        buffer = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+        if (pool->huge && size >= IMAGE_POOL_HUGE_PAGE) madvise (buffer, size, MADV_HUGEPAGE);
+#endif
+    }
+    return buffer;
+}
+
+// Get a buffer of at least size bytes, page aligned. Returns NULL if out of memory.
+static void *image_pool_get(struct image_pool *pool, size_t size) {
+    struct image_pool_block *block, **link;
+
+    size = image_pool_class (pool, size);
+    pthread_mutex_lock (&pool->lock);
+    for (link = &pool->free; *link; link = &(*link)->next) {
+        if ((*link)->size == size) {
+            block = *link;
+            *link = block->next;
+            pool->kept -= size;
+            pool->hits++;
+            pthread_mutex_unlock (&pool->lock);
+            return block;
+        }
+    }
+    pool->misses++;
+    pthread_mutex_unlock (&pool->lock);
+    return image_pool_map (pool, size);
+}
+
+// Give back a buffer of size bytes (the size it was requested with) from image_pool_get
+static void image_pool_put(struct image_pool *pool, void *buffer, size_t size) {
+    struct image_pool_block *block = (struct image_pool_block *) buffer, **link, *evict = NULL;
+
+    size = image_pool_class (pool, size);
+    pthread_mutex_lock (&pool->lock);
+    if (size > pool->limit) {
+        pthread_mutex_unlock (&pool->lock);
+        munmap (buffer, size);
+        return;
+    }
+    block->size = size;
+    block->next = pool->free;
+    pool->free = block;
+    pool->kept += size;
+    // over the limit: cut the list where the buffers returned longest ago start
+    if (pool->kept > pool->limit) {
+        size = 0;
+        for (link = &pool->free; size + (*link)->size <= pool->limit; link = &(*link)->next)
+            size += (*link)->size;
+        evict = *link;
+        *link = NULL;
+        pool->kept = size;
+    }
+    pthread_mutex_unlock (&pool->lock);
+    while ((block = evict) != NULL) {
+        evict = block->next;
+        munmap (block, block->size);
+    }
+}
+
+// image_alloc with the pixels in a buffer from the pool, or a plain image_alloc if pool
+// is NULL. Returns -1 if out of memory.
+static int image_pool_alloc(struct image_pool *pool, struct image *img, int width, int height,
+                            enum image_layout layout) {
+    int i;
+
+    if (!pool) return image_alloc (img, width, height, layout);
+    image_layout_init (img, width, height, layout);
+    img->buffer = image_pool_get (pool, image_buffer_size (img));
+    if (!img->buffer) return -1;
+    img->pool = pool;
+    for (i = 0; i < img->nplanes; i++)
+        img->plane[i] = (byte *) img->buffer + img->stride * height * i;
+    return 0;
+}
+
+// Free an image, giving its buffer back to the pool it came from, if any
+static void image_release(struct image *img) {
+    if (img->pool) {
+        image_pool_put (img->pool, img->buffer, image_buffer_size (img));
+        img->pool = NULL;
+        img->buffer = NULL;
+    }
+    image_free (img);
+}
+
+#endif
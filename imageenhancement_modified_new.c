@@ -1,347 +1,2097 @@
-#include <stdio.h>
-#include <unistd.h>
-#include <math.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
-#include <intelfpgaup/video.h>
-#define PI 3.141592654
-
-typedef unsigned char byte;
-// The dimensions of the image
-int width, height;
-int screen_x, screen_y, char_x, char_y;
-
-struct pixel {
-    byte b;
-    byte g;
-    byte r;
-};
-
-// Read BMP file and extract the pixel values (store in data) and header (store in header)
-// Data is data[0] = BLUE, data[1] = GREEN, data[2] = RED, data[3] = BLUE, etc...
-int read_bmp(char *filename, byte **header, struct pixel **data) {
-    struct pixel *data_tmp;
-    byte *header_tmp;
-    FILE *file = fopen (filename, "rb");
-    
-    if (!file) return -1;
-    
-    // read the 54-byte header
-    header_tmp = malloc (54 * sizeof(byte));
-    fread (header_tmp, sizeof(byte), 54, file); 
-
-    // get height and width of image from the header
-    width = *(int*)(header_tmp + 18);  // width is a 32-bit int at offset 18
-    height = *(int*)(header_tmp + 22); // height is a 32-bit int at offset 22
-
-    // Read in the image
-    int size = width * height;
-    data_tmp = malloc (size * sizeof(struct pixel)); 
-    fread (data_tmp, sizeof(struct pixel), size, file); // read the data
-    fclose (file);
-    
-    *header = header_tmp;
-    *data = data_tmp;
-    
-    return 0;
-}
-
-// Determine the grayscale 8-bit value by averaging the r, g, and b channel values.
-// Store the 8-bit grayscale value in the r channel.
-void convert_to_grayscale(struct pixel *data) {
-    int x, y;
-    
-    // declare image as a 2-D array so that we can use the syntax image[row][column]
-    struct pixel (*image)[width] = (struct pixel (*)[width]) data;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            // Just use the 8 bits of the r field to hold the entire grayscale image
-            image[y][x].r = (image[y][x].r + image[y][x].b + image[y][x].g) / 3;
-        }
-    }
-}
-
-// Write the grayscale image to disk. The 8-bit grayscale values should be inside the
-// r channel of each pixel.
-void write_bmp(char *filename, byte *header, struct pixel *data) {
-    FILE* file = fopen (filename, "wb");
-    // declare image as a 2-D array so that we can use the syntax image[row][column]
-    struct pixel (*image)[width] = (struct pixel (*)[width]) data;
-    
-    // write the 54-byte header
-    fwrite (header, sizeof(byte), 54, file); 
-    int y, x;
-    
-    // the r field of the pixel has the grayscale value; copy to g and b.
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            image[y][x].b = image[y][x].r;
-            image[y][x].g = image[y][x].r;
-        }
-    }
-    int size = width * height;
-    fwrite (image, sizeof(struct pixel), size, file); // write the data
-    fclose (file);
-}
-
-// The input data is either the x- or y-derivative of the image, as calculated by Sobel. The
-// output produced is a bmp file in which each pixel corresponds to the absolute value of the 
-// derivative at that pixel. This bmp file allows us to visualize the derivative as a bmp image.
-void write_signed_bmp(char *filename, byte *header, signed int *data) {
-    FILE* file = fopen (filename, "wb");
-    struct pixel bytes;
-    int val;
-
-    signed int (*image)[width] = (signed int (*)[width]) data; // allow image[][]
-    // write the 54-byte header
-    fwrite (header, sizeof(byte), 54, file); 
-    int y, x;
-    
-    // convert the derivatives' values to pixels by copying each to an r, g, and b
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            val = abs(image[y][x]);
-            val = (val > 255) ? 255 : val;
-            bytes.r = val;
-            bytes.g = bytes.r;
-            bytes.b = bytes.r;
-            fwrite (&bytes, sizeof(struct pixel), 1, file); // write the data
-        }
-    }
-    fclose (file);
-}
-
-// Invert operation. Operate on the .r, .g, and .b fields of the pixels.
-void invert_operation(struct pixel **data) {
-    int x, y;
-
-    // Declare image as a 2-D array so that we can use the syntax image[row][column]
-    struct pixel (*image)[width] = (struct pixel (*)[width])*data;
-
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            // Subtract each channel's value from the maximum channel value (255) to invert the image
-            image[y][x].r = 255 - image[y][x].r;
-            image[y][x].g = 255 - image[y][x].g;
-            image[y][x].b = 255 - image[y][x].b;
-        }
-    }
-}
-
-// Adjust the brightness of each pixel in the image
-// The brightness value should be between -255 and 255
-void brightness_operation(struct pixel **data, int brightness,int sign) {
-    int x, y;
-    int new_r, new_g, new_b;
-    // Declare image as a 2-D array so that we can use the syntax image[row][column]
-    struct pixel (*image)[width] = (struct pixel (*)[width])*data;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            // Adjust the brightness of each channel (r, g, b) separately
-            if (sign==1){
-            new_r = image[y][x].r + brightness;
-            new_g = image[y][x].g + brightness;
-            new_b = image[y][x].b + brightness;
-            }
-	    else{
-            new_r = image[y][x].r - brightness;
-            new_g = image[y][x].g - brightness;
-            new_b = image[y][x].b - brightness;
-	    }
-            // Ensure the values stay within the valid range of 0-255
-            image[y][x].r = (new_r < 0) ? 0 : ((new_r > 255) ? 255 : new_r);
-            image[y][x].g = (new_g < 0) ? 0 : ((new_g > 255) ? 255 : new_g);
-            image[y][x].b = (new_b < 0) ? 0 : ((new_b > 255) ? 255 : new_b);
-        }
-    }
-}
-// Adjust the contrast of the image by multiplying the color channels by the factor
-void contrast_operation(struct pixel **data,int threshold,int contrast_factor,int sign) {
-    int x, y;
-    int new_r, new_g, new_b;
-    int avg_rgb;
-    // Declare image as a 2-D array so that we can use the syntax image[row][column]
-    struct pixel (*image)[width] = (struct pixel (*)[width]) data;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-        	if(sign==1)
-           {
-           	 avg_rgb = (image[y][x].r + image[y][x].b + image[y][x].g) / 3;
-           	if(avg_rgb>threshold){
-            new_r = image[y][x].r + contrast_factor;
-            new_g= image[y][x].g + contrast_factor;
-            new_b= image[y][x].b + contrast_factor;
-            }}
-            else
-            {
-            if(avg_rgb<threshold){
-            new_r = image[y][x].r - contrast_factor;
-            new_g = image[y][x].g - contrast_factor;
-            new_b = image[y][x].b - contrast_factor;	
-            }}
-            image[y][x].r = (new_r < 0) ? 0 : ((new_r > 255) ? 255 : new_r);
-            image[y][x].g = (new_g < 0) ? 0 : ((new_g > 255) ? 255 : new_g);
-            image[y][x].b = (new_b < 0) ? 0 : ((new_b > 255) ? 255 : new_b);
-        }
-    }
-}
-
-// Apply a threshold to convert the grayscale image to a binary image
-void threshold_operation(struct pixel **data, int threshold) {
-    int x, y;
-
-
-    // Declare image as a 2-D array so that we can use the syntax image[row][column]
-    struct pixel (*image)[width] = (struct pixel (*)[width]) data;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-        	float avg_rgb = (image[y][x].r + image[y][x].b + image[y][x].g) / 3;
-            // Set the pixel to black if grayscale value is below threshold, white otherwise
-            if (avg_rgb < threshold) {
-                image[y][x].r = 0;  // Black
-                image[y][x].g = 0;
-                image[y][x].b = 0;
-            } else {
-                image[y][x].r = 255;  // White
-                image[y][x].g = 255;
-                image[y][x].b = 255;
-            }
-        }
-    }
-free(*data);
-*data = (struct pixel *) image;
-}
-
-
-// Render an image on the VGA display
-void draw_image (struct pixel  * data)
-{
-    int x, y, stride_x, stride_y, i, j, vga_x, vga_y;
-    int r, g, b, color;
-    struct pixel (*image)[width] = (struct pixel (*)[width]) data; // allow image[][]
-
-    video_clear ( );
-    // scale the image to fit the screen
-    stride_x = (width > screen_x) ? width / screen_x : 1;
-    stride_y = (height > screen_y) ? height / screen_y : 1;
-    // scale proportionally (don't stretch the image)
-    stride_y = (stride_x > stride_y) ? stride_x : stride_y;
-    stride_x = (stride_y > stride_x) ? stride_y : stride_x;
-    for (y = 0; y < height; y += stride_y) {
-        for (x = 0; x < width; x += stride_x) {
-            // find the average of the pixels being scaled down to the VGA resolution
-            r = 0; g = 0; b = 0;
-            for (i = 0; i < stride_y; i++) {
-                for (j = 0; j < stride_x; ++j) {
-                    r += image[y + i][x + j].r;
-                    g += image[y + i][x + j].g;
-                    b += image[y + i][x + j].b;
-                }
-            }
-            r = r / (stride_x * stride_y);
-            g = g / (stride_x * stride_y);
-            b = b / (stride_x * stride_y);
-
-            // now write the pixel color to the VGA display
-            r = r >> 3;      // VGA has 5 bits of red
-            g = g >> 2;      // VGA has 6 bits of green
-            b = b >> 3;      // VGA has 5 bits of blue
-            color = r << 11 | g << 5 | b;
-            vga_x = x / stride_x;
-            vga_y = y / stride_y;
-            if (screen_x > width / stride_x)   // center if needed
-                video_pixel (vga_x + (screen_x-(width/stride_x))/2, (screen_y-1) - vga_y, color); 
-            else
-                if ((vga_x < screen_x) && (vga_y < screen_y))
-                    video_pixel (vga_x, (screen_y-1) - vga_y, color); 
-        }
-    }
-    video_show ( );
-}
-
-int main(int argc, char *argv[]) {
-    struct pixel *image;
-    //signed int *G_x, *G_y;
-    byte *header;
-    int debug = 0, video = 0;
-    time_t start, end;
-    
-    // Check inputs
-    if (argc < 2) {
-        printf("Usage: part1 [-d] [-v] <BMP filename>\n");
-        printf("-d: produces debug output for each stage\n");
-        printf("-v: draws the input and output images on a video-out display\n");
-        return 0;
-    }
-    int opt;
-    while ((opt = getopt (argc, argv, "dv")) != -1) {
-        switch (opt) {
-            case 'd':  
-                debug = 1;
-                break;  
-            case 'v':  
-                video = 1;
-                break;  
-            case '?':  
-                printf("unknown option: %c\n", optopt); 
-                break;  
-        }  
-    }  
-    // Open input image file (24-bit bitmap image)
-    if (read_bmp (argv[optind], &header, &image) < 0) {
-        printf("Failed to read BMP\n");
-        return 0;
-    }
-    if (video) {
-        if (!video_open ())
-        {
-            printf ("Error: could not open video device\n");
-            return -1;
-        }
-        video_read (&screen_x, &screen_y, &char_x, &char_y);   // get VGA screen size
-        draw_image (image);
-    }
-
-    /********************************************
-    *          IMAGE PROCESSING STAGES          *
-    ********************************************/
-    
-    // Start measuring time
-    start = clock ();
-    
-    /// Grayscale conversion
-    convert_to_grayscale (image);
-    if (debug) write_bmp ("stage0_grayscale.bmp", header, image);
-    
-    /// invert operation
-    invert_operation (&image);
-    if (debug) write_bmp ("invert_operation.bmp", header, image);
-    
-    ///brightness operation
-   // brightness_operation (&image, 10, 1);
-   // if (debug) write_bmp ("brightness_operation.bmp", header, image);
-      
-    ///contrast operation
-    //contrast_operation (&image,80,20, 1);
-    //if (debug) write_bmp ("contrast_operation.bmp", header, image);
-    
-    ///threshold operation
-    //threshold_operation (&image,80);
-    //if (debug) write_bmp ("threshold_operation.bmp", header, image);
-    
-    
-    end = clock();
-    
-    printf("TIME ELAPSED: %.0f ms\n", ((double) (end - start)) * 1000 / CLOCKS_PER_SEC);
-    
-    write_bmp ("edges.bmp", header, image);
-    
-    // if (video) {
-        // getchar ();
-        // draw_image (image);
-        // video_close ( );
-    // }
-    return 0;
-}
-
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <strings.h>
+#include <limits.h>
+#include "display.h"
+#include "point_pipeline.h"
+#include "cpu_dispatch.h"
+#include "thread_pool.h"
+#include "image.h"
+#include "timing.h"
+#include "resize.h"
+#include "work_queue.h"
+#include "image_pool.h"
+#include "pipeline.h"
+#include "histogram.h"
+#include "clahe.h"
+#include "convolve.h"
+#include "canny.h"
+#include "median.h"
+#include "options.h"
+#define PI 3.141592654
+
+// Header fields are little-endian 32-bit values at 2-byte aligned offsets, so they are
+// copied rather than dereferenced (ARM faults on some unaligned multi-word accesses)
+int bmp_get32(const byte *field) {
+    int v;
+
+    memcpy (&v, field, 4);
+    return v;
+}
+
+void bmp_put32(byte *field, int v) {
+    memcpy (field, &v, 4);
+}
+
+// Bytes per row in a 24-bit BMP file: each row is padded to a multiple of 4 bytes
+size_t bmp_row_size(int width) {
+    return ((size_t) width * 3 + 3) & ~(size_t) 3;
+}
+
+// Size of a file with the 54-byte header followed by the pixel data
+size_t bmp_file_size(int width, int height) {
+    return 54 + bmp_row_size (width) * height;
+}
+
+// Copy one row of the file's pixel data into row y of the image. The file holds
+// data[0] = BLUE, data[1] = GREEN, data[2] = RED, data[3] = BLUE, etc...
+// which is kept as is for an interleaved image and split into planes for a planar one.
+void bmp_load_row(struct image *img, int y, const byte *data) {
+    if (img->layout == IMAGE_INTERLEAVED)
+        memcpy (image_row (img, 0, y), data, (size_t) img->width * 3);
+    else
+        kernels->deinterleave (data, image_row (img, 0, y), image_row (img, 1, y), image_row (img, 2, y), img->width);
+}
+
+// Fill one row of the file's pixel data from row y of the image
+void bmp_store_row(struct image *img, int y, byte *data) {
+    if (img->layout == IMAGE_INTERLEAVED)
+        memcpy (data, image_row (img, 0, y), (size_t) img->width * 3);
+    else if (img->layout == IMAGE_GRAY)
+        kernels->interleave (image_row (img, 0, y), image_row (img, 0, y), image_row (img, 0, y), data, img->width);
+    else
+        kernels->interleave (image_row (img, 0, y), image_row (img, 1, y), image_row (img, 2, y), data, img->width);
+}
+
+// Map the whole file instead of reading it. An interleaved image uses the pixel data in
+// the mapping as its buffer, so nothing is copied: the mapping is private, and the first
+// write to a page gives the process its own copy without touching the file. A planar
+// image is split into planes straight from the mapping, into a buffer from buffers
+// (malloc if NULL).
+// Returns -1 if the file cannot be mapped (e.g. it is a pipe or shorter than the header says).
+int map_bmp(int fd, size_t offset, int width, int height, struct image *img, enum image_layout layout,
+            struct image_pool *buffers) {
+    size_t stride = bmp_row_size (width), size = offset + stride * height;
+    struct stat st;
+    byte *map;
+    int y;
+
+    if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) || (size_t) st.st_size < size) return -1;
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return -1;
+    if (layout == IMAGE_INTERLEAVED) {
+        image_borrow (img, width, height, map + offset, stride);
+        img->map = map;
+        img->map_size = size;
+        return 0;
+    }
+    if (image_pool_alloc (buffers, img, width, height, layout) < 0) {
+        munmap (map, size);
+        return -1;
+    }
+    madvise (map, size, MADV_SEQUENTIAL);
+    for (y = 0; y < height; y++)
+        bmp_load_row (img, y, map + offset + stride * y);
+    munmap (map, size);
+    return 0;
+}
+
+// Read the pixel data with stdio, for files that cannot be mapped. Returns -1 if the
+// file ends before the last row.
+int read_bmp_stream(int fd, size_t offset, int width, int height, struct image *img, enum image_layout layout,
+                    struct image_pool *buffers) {
+    size_t stride = bmp_row_size (width);
+    FILE *file = fdopen (fd, "rb");
+    byte *row;
+    int y;
+
+    if (!file) return -1;
+    row = malloc (stride);
+    if (!row || image_pool_alloc (buffers, img, width, height, layout) < 0) {
+        free (row);
+        fclose (file);
+        return -1;
+    }
+    fseek (file, offset, SEEK_SET);
+    for (y = 0; y < height; y++) {
+        if (fread (row, sizeof(byte), stride, file) != stride) break;
+        bmp_load_row (img, y, row);
+    }
+    free (row);
+    fclose (file);
+    if (y < height) {
+        image_release (img);
+        return -1;
+    }
+    return 0;
+}
+
+// Read the 54-byte header (store in header) and get the image size and the offset of
+// the pixel data from it. Returns -1 if the header cannot be read or the image is not a
+// bottom-up one of at least one pixel.
+int read_bmp_header(int fd, byte **header, size_t *offset, int *width, int *height) {
+    byte *header_tmp = malloc (54 * sizeof(byte));
+
+    if (!header_tmp || read (fd, header_tmp, 54) != 54) {
+        free (header_tmp);
+        return -1;
+    }
+
+    // get height and width of image from the header
+    *width = bmp_get32 (header_tmp + 18);   // width is a 32-bit int at offset 18
+    *height = bmp_get32 (header_tmp + 22);  // height is a 32-bit int at offset 22
+    *offset = (unsigned int) bmp_get32 (header_tmp + 10);  // the pixel data starts at the offset stored at 10
+    if (*width < 1 || *height < 1) {
+        free (header_tmp);
+        return -1;
+    }
+
+    *header = header_tmp;
+    return 0;
+}
+
+// Read BMP file and extract the pixel values (store in img, which also carries the
+// image size) and header (store in header). Images that need a buffer of their own get
+// it from buffers if it is not NULL; the image is then freed with image_release.
+int read_bmp(char *filename, byte **header, struct image *img, enum image_layout layout,
+             struct image_pool *buffers) {
+    size_t offset;
+    int width, height, fd = open (filename, O_RDONLY);
+    
+    if (fd < 0) return -1;
+    if (read_bmp_header (fd, header, &offset, &width, &height) < 0) {
+        close (fd);
+        return -1;
+    }
+    if (map_bmp (fd, offset, width, height, img, layout, buffers) == 0) {
+        close (fd);     // the mapping stays valid
+    } else if (read_bmp_stream (fd, offset, width, height, img, layout, buffers) < 0) {
+        free (*header);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy the 54-byte header for an output image of the given size. The pixel data always
+// follows the header directly, so the offset and info-header size are rewritten for
+// inputs that had a longer header.
+void bmp_output_header(byte *out, byte *header, int out_width, int out_height) {
+    size_t data_size = bmp_row_size (out_width) * out_height;
+
+    memcpy (out, header, 54);
+    bmp_put32 (out + 2, 54 + data_size);    // file size
+    bmp_put32 (out + 10, 54);               // pixel data offset
+    bmp_put32 (out + 14, 40);               // BITMAPINFOHEADER
+    bmp_put32 (out + 18, out_width);
+    bmp_put32 (out + 22, out_height);
+    bmp_put32 (out + 34, data_size);        // pixel data size
+}
+
+// Determine the grayscale 8-bit value by averaging the r, g, and b channel values.
+// Store the 8-bit grayscale value in the gray image, one byte per pixel, so later stages
+// touch a third of the memory. Like the other operations, it works on rows y0 to y1 - 1
+// so bands can run in parallel.
+void convert_to_grayscale(struct image *gray, struct image *img, int y0, int y1) {
+    int y;
+
+    for (y = y0; y < y1; y++) {
+        if (img->layout == IMAGE_PLANAR)
+            kernels->gray_from_planar (image_row (img, 0, y), image_row (img, 1, y), image_row (img, 2, y),
+                                       image_row (gray, 0, y), img->width);
+        else
+            kernels->gray_from_bgr (image_row (img, 0, y), image_row (gray, 0, y), img->width);
+    }
+}
+
+// Start writing filename as a new file next to it, which output_finish renames over
+// filename once it is complete. filename is left alone until then, so it may be the
+// input, still mapped or being read. Returns the new file's descriptor and its name in
+// tmp_name, or -1 after printing the error.
+int output_create(const char *filename, char **tmp_name) {
+    size_t len = strlen (filename);
+    int fd = -1;
+
+    *tmp_name = malloc (len + 8);
+    if (*tmp_name) {
+        memcpy (*tmp_name, filename, len);
+        memcpy (*tmp_name + len, ".XXXXXX", 8);
+        fd = mkstemp (*tmp_name);
+    }
+    if (fd < 0) {
+        printf ("Error: could not write %s\n", filename);
+        free (*tmp_name);
+        *tmp_name = NULL;
+        return -1;
+    }
+    fchmod (fd, 0644);
+    return fd;
+}
+
+// Rename the file from output_create over filename if ok, or remove it. Returns -1 if
+// filename was not written, printing the error if the rename failed.
+int output_finish(char *tmp_name, const char *filename, int ok) {
+    if (ok && rename (tmp_name, filename) < 0) {
+        printf ("Error: could not write %s\n", filename);
+        ok = 0;
+    }
+    if (!ok) unlink (tmp_name);
+    free (tmp_name);
+    return ok ? 0 : -1;
+}
+
+// Is filename the file open as fd?
+int same_file(int fd, const char *filename) {
+    struct stat a, b;
+
+    return fstat (fd, &a) == 0 && stat (filename, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// Write the image to disk. The output file is sized up front and mapped, and every row
+// is written straight into the mapping: planar images are interleaved again and gray
+// images copy their one value into the r, g, and b channels on the way. Files that
+// cannot be mapped are written with stdio instead. The file is written under another
+// name and only then renamed (output_create), since img may be the input's mapping.
+void write_bmp(char *filename, byte *header, struct image *img) {
+    size_t stride = bmp_row_size (img->width), size = 54 + stride * img->height;
+    char *tmp_name;
+    int fd = output_create (filename, &tmp_name), ok;
+    byte *map, *row;
+    FILE *file;
+    int y;
+    
+    if (fd < 0) return;
+    if (ftruncate (fd, size) == 0) {
+        map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            // the new file is zero-filled, which already takes care of the row padding
+            bmp_output_header (map, header, img->width, img->height);
+            for (y = 0; y < img->height; y++)
+                bmp_store_row (img, y, map + 54 + stride * y);
+            munmap (map, size);
+            ok = close (fd) == 0;
+            if (!ok) printf ("Error: could not write %s\n", filename);
+            output_finish (tmp_name, filename, ok);
+            return;
+        }
+    }
+    file = fdopen (fd, "wb");
+    row = calloc (stride > 54 ? stride : 54, sizeof(byte));
+    ok = file && row;
+    if (ok) {
+        // write the 54-byte header
+        bmp_output_header (row, header, img->width, img->height);
+        ok = fwrite (row, sizeof(byte), 54, file) == 54;
+        memset (row, 0, 54);
+        for (y = 0; y < img->height && ok; y++) {
+            bmp_store_row (img, y, row);
+            ok = fwrite (row, sizeof(byte), stride, file) == stride; // write the data
+        }
+    }
+    free (row);
+    if (file) ok = (fclose (file) == 0) && ok;
+    else close (fd);
+    if (!ok) printf ("Error: could not write %s\n", filename);
+    output_finish (tmp_name, filename, ok);
+}
+
+// The input data is either the x- or y-derivative of the image, as calculated by Sobel. The
+// output produced is a bmp file in which each pixel corresponds to the absolute value of the 
+// derivative at that pixel. This bmp file allows us to visualize the derivative as a bmp image.
+// data holds height rows of width values; rows are padded to 4 bytes like write_bmp's.
+void write_signed_bmp(char *filename, byte *header, const signed int *data, int width, int height) {
+    FILE* file = fopen (filename, "wb");
+    size_t stride = bmp_row_size (width);
+    byte *row;
+    int val;
+
+    row = calloc (stride > 54 ? stride : 54, sizeof(byte));
+    if (!file || !row) {
+        if (file) fclose (file);
+        free (row);
+        return;
+    }
+    // write the 54-byte header
+    bmp_output_header (row, header, width, height);
+    fwrite (row, sizeof(byte), 54, file); 
+    memset (row, 0, 54);
+    int y, x;
+    
+    // convert the derivatives' values to pixels by copying each to an r, g, and b
+    for (y = 0; y < height; y++, data += width) {
+        for (x = 0; x < width; x++) {
+            val = abs(data[x]);
+            val = (val > 255) ? 255 : val;
+            row[3 * x] = val;
+            row[3 * x + 1] = val;
+            row[3 * x + 2] = val;
+        }
+        fwrite (row, sizeof(byte), stride, file); // write the data
+    }
+    free (row);
+    fclose (file);
+}
+
+// Invert operation. Operate on the .r, .g, and .b fields of the pixels.
+void invert_operation(struct image *img, int y0, int y1) {
+    int y, c;
+
+    // Subtract each channel's value from the maximum channel value (255) to invert the image
+    for (y = y0; y < y1; y++)
+        for (c = 0; c < img->nplanes; c++)
+            kernels->invert (image_row (img, c, y), image_row_bytes (img));
+}
+
+// Adjust the brightness of each pixel in the image
+// The brightness value should be between -255 and 255
+void brightness_operation(struct image *img, int brightness,int sign, int y0, int y1) {
+    int y, c;
+
+    // Adjust every channel separately with a saturating add or subtract
+    for (y = y0; y < y1; y++)
+        for (c = 0; c < img->nplanes; c++)
+            kernels->brightness (image_row (img, c, y), image_row_bytes (img), brightness, sign);
+}
+// Adjust the contrast of the image: with sign 1, pixels whose average is above the threshold
+// are brightened by contrast_factor; with sign 0, pixels below the threshold are darkened.
+void contrast_operation(struct image *img,int threshold,int contrast_factor,int sign, int y0, int y1) {
+    int y;
+
+    for (y = y0; y < y1; y++) {
+        if (img->layout == IMAGE_PLANAR)
+            kernels->contrast_planar (image_row (img, 0, y), image_row (img, 1, y), image_row (img, 2, y), img->width,
+                                      threshold, contrast_factor, sign);
+        else if (img->layout == IMAGE_GRAY)
+            kernels->contrast_gray (image_row (img, 0, y), img->width, threshold, contrast_factor, sign);
+        else
+            kernels->contrast (image_row (img, 0, y), img->width, threshold, contrast_factor, sign);
+    }
+}
+
+// Apply a threshold to convert the grayscale image to a binary image
+void threshold_operation(struct image *img, int threshold, int y0, int y1) {
+    int y;
+
+    // Set the pixel to black if grayscale value is below threshold, white otherwise
+    for (y = y0; y < y1; y++) {
+        if (img->layout == IMAGE_PLANAR)
+            kernels->threshold_planar (image_row (img, 0, y), image_row (img, 1, y), image_row (img, 2, y), img->width,
+                                       threshold);
+        else if (img->layout == IMAGE_GRAY)
+            kernels->threshold_gray (image_row (img, 0, y), img->width, threshold);
+        else
+            kernels->threshold (image_row (img, 0, y), img->width, threshold);
+    }
+}
+
+// Map the b, g and r channels through tables of their own (stretch, equalize); a gray
+// image goes through the b table
+void map_operation(struct image *img, const unsigned char (*map)[256], int y0, int y1) {
+    byte *p;
+    int y, c, x;
+
+    for (y = y0; y < y1; y++) {
+        if (img->layout == IMAGE_INTERLEAVED) {
+            p = image_row (img, 0, y);
+            for (x = 0; x < img->width; x++, p += 3) {
+                p[0] = map[0][p[0]];
+                p[1] = map[1][p[1]];
+                p[2] = map[2][p[2]];
+            }
+        } else {
+            for (c = 0; c < img->nplanes; c++) {
+                p = image_row (img, c, y);
+                for (x = 0; x < img->width; x++)
+                    p[x] = map[c][p[x]];
+            }
+        }
+    }
+}
+
+
+// The VGA display: its size, read when it is opened, and the resize weights of the last
+// image drawn on it
+struct screen {
+    int width, height;
+    int char_width, char_height;    // size of the character buffer
+    struct resize_plan plan;
+};
+
+// Render an image on the VGA display. The image is resized to fill as much of the
+// screen as it can without being stretched, packed into RGB565 a row at a time and
+// each row written with one call.
+void draw_image (struct screen *screen, const struct image *img)
+{
+    int x, y, columns, rows, x0, y0, width = img->width, height = img->height;
+    int screen_x = screen->width, screen_y = screen->height;
+    const byte *b, *g, *r;
+    size_t step;
+    unsigned short *line;
+    struct image preview;
+    struct display display;
+
+    // scale proportionally (don't stretch the image)
+    if ((long long) width * screen_y > (long long) height * screen_x) {
+        columns = screen_x;
+        rows = (int) ((long long) height * screen_x / width);
+    } else {
+        rows = screen_y;
+        columns = (int) ((long long) width * screen_y / height);
+    }
+    if (columns < 1) columns = 1;
+    if (rows < 1) rows = 1;
+    if (resize_plan_init (&screen->plan, width, height, columns, rows, resize_filter_for (width, height, columns, rows)) < 0
+        || image_alloc (&preview, columns, rows, img->layout) < 0) {
+        printf("Error: out of memory\n");
+        return;
+    }
+    line = malloc (sizeof(unsigned short) * columns);
+    if (!line || resize_rows (&screen->plan, img, &preview, 0, rows, NULL) < 0) {
+        printf("Error: out of memory\n");
+        free (line);
+        image_free (&preview);
+        return;
+    }
+    // centre the image
+    x0 = (screen_x - columns) / 2;
+    y0 = (screen_y - rows) / 2;
+    display_begin (&display, screen_x, screen_y);
+    for (y = 0; y < rows; y++) {
+        if (preview.layout == IMAGE_PLANAR) {
+            b = image_row (&preview, 0, y);
+            g = image_row (&preview, 1, y);
+            r = image_row (&preview, 2, y);
+            step = 1;
+        } else if (preview.layout == IMAGE_GRAY) {
+            b = g = r = image_row (&preview, 0, y);
+            step = 1;
+        } else {
+            b = image_row (&preview, 0, y);
+            g = b + 1;
+            r = b + 2;
+            step = 3;
+        }
+        // VGA has 5 bits of red, 6 of green and 5 of blue
+        for (x = 0; x < columns; x++, b += step, g += step, r += step)
+            line[x] = (*r >> 3) << 11 | (*g >> 2) << 5 | *b >> 3;
+        // BMP rows are stored bottom-up
+        display_row (&display, x0, y0 + (rows - 1) - y, line, columns);
+    }
+    display_show (&display);
+    free (line);
+    image_free (&preview);
+}
+
+// Run one stage on rows y0 to y1 - 1. Grayscale writes its result to gray; the other
+// stages work in place. An adaptive stage must have been filled in (chain_adapt).
+void run_stage(struct image *image, struct image *gray, const struct point_stage *stage, int y0, int y1) {
+    switch (stage->op) {
+        case POINT_GRAYSCALE:
+            if (image->layout != IMAGE_GRAY)
+                convert_to_grayscale (gray, image, y0, y1);
+            break;
+        case POINT_INVERT:
+            invert_operation (image, y0, y1);
+            break;
+        case POINT_BRIGHTNESS:
+            brightness_operation (image, stage->amount, stage->sign, y0, y1);
+            break;
+        case POINT_CONTRAST:
+            contrast_operation (image, stage->threshold, stage->amount, stage->sign, y0, y1);
+            break;
+        case POINT_THRESHOLD:
+        case POINT_OTSU:
+            threshold_operation (image, stage->threshold, y0, y1);
+            break;
+        case POINT_STRETCH:
+        case POINT_EQUALIZE:
+            map_operation (image, stage->map, y0, y1);
+            break;
+        default:
+            break;      // filters run as steps of their own (run_filter)
+    }
+}
+
+// One sweep over the image, shared by the threads that each take a band of rows
+struct sweep {
+    struct image *image;
+    const struct point_stage *stage;        // a single stage, or NULL for the fused program
+    const struct point_program *program;    // NULL too for a sweep that only measures the image
+    struct image *gray;                     // where a sweep that makes the image gray writes, else NULL
+    struct thread_pool *pool;
+    struct histogram *histograms;           // one per band to count the output into, or NULL
+    int channels;                           // count the channels too, not just the gray level
+};
+
+void sweep_band(void *arg, int y0, int y1) {
+    struct sweep *sweep = (struct sweep *) arg;
+
+    struct image *img = sweep->image, *out = sweep->gray ? sweep->gray : sweep->image;
+    struct histogram *histogram = NULL;
+    byte *row, *gray_row;
+    int y;
+
+    if (sweep->histograms) {
+        histogram = &sweep->histograms[thread_pool_band_index (sweep->pool, img->height, y0)];
+        histogram_clear (histogram);
+    }
+    // each output row is counted right after it is written, while it is still in cache
+    for (y = y0; y < y1; y++) {
+        row = image_row (img, 0, y);
+        gray_row = sweep->gray ? image_row (sweep->gray, 0, y) : NULL;
+        if (sweep->stage)
+            run_stage (img, sweep->gray, sweep->stage, y, y + 1);
+        else if (sweep->program && img->layout == IMAGE_GRAY)
+            point_program_apply (sweep->program, row, row, row, 1, img->width, row);
+        else if (sweep->program && img->layout == IMAGE_PLANAR)
+            point_program_apply (sweep->program, row, image_row (img, 1, y), image_row (img, 2, y), 1, img->width,
+                                 gray_row);
+        else if (sweep->program)
+            point_program_apply (sweep->program, row, row + 1, row + 2, 3, img->width, gray_row);
+        if (histogram)
+            histogram_count_row (histogram, out, y, sweep->channels);
+    }
+}
+
+// How each operation is written in a pipeline spec (-p), what it writes in debug mode,
+// the layout it runs fastest on, and whether it needs the whole image. Brightness and
+// invert treat every byte alike, so they have no preference; the operations that
+// average the channels load them directly from planes instead of shuffling them out of
+// interleaved pixels. Grayscale reads either layout equally fast, and so does the
+// histogram behind the adaptive stages; those measure the whole image, so they cannot
+// run a strip at a time, and neither can CLAHE, whose tiles span many rows, or the
+// convolutions, canny and the median, which read the rows above and below the one they
+// write.
+struct operation_info {
+    const char *name;
+    const char *spec;
+    const char *debug_name;
+    enum image_layout layout;
+    int whole_image;
+};
+
+const struct operation_info operations[] = {
+    [POINT_GRAYSCALE]  = { "grayscale",  "grayscale (or gray)",          "stage0_grayscale.bmp",     IMAGE_LAYOUT_ANY, 0 },
+    [POINT_INVERT]     = { "invert",     "invert",                       "invert_operation.bmp",     IMAGE_LAYOUT_ANY, 0 },
+    [POINT_BRIGHTNESS] = { "brightness", "brightness:<+|-amount>",       "brightness_operation.bmp", IMAGE_LAYOUT_ANY, 0 },
+    [POINT_CONTRAST]   = { "contrast",   "contrast:<level>:<+|-amount>", "contrast_operation.bmp",   IMAGE_PLANAR,     0 },
+    [POINT_THRESHOLD]  = { "threshold",  "threshold:<level>",            "threshold_operation.bmp",  IMAGE_PLANAR,     0 },
+    [POINT_OTSU]       = { "otsu",       "otsu",                         "otsu_operation.bmp",       IMAGE_LAYOUT_ANY, 1 },
+    [POINT_STRETCH]    = { "stretch",    "stretch[:<percent>]",          "stretch_operation.bmp",    IMAGE_LAYOUT_ANY, 1 },
+    [POINT_EQUALIZE]   = { "equalize",   "equalize",                     "equalize_operation.bmp",   IMAGE_LAYOUT_ANY, 1 },
+    [POINT_CLAHE]      = { "clahe",      "clahe[:<tiles>[:<clip>]]",     "clahe_operation.bmp",      IMAGE_LAYOUT_ANY, 1 },
+    [POINT_GAUSSIAN]   = { "gaussian",   "gaussian[:<radius>]",          "gaussian_operation.bmp",   IMAGE_LAYOUT_ANY, 1 },
+    [POINT_BOX]        = { "box",        "box[:<radius>]",               "box_operation.bmp",        IMAGE_LAYOUT_ANY, 1 },
+    [POINT_SHARPEN]    = { "sharpen",    "sharpen[:<percent>[:<radius>]]", "sharpen_operation.bmp",  IMAGE_LAYOUT_ANY, 1 },
+    [POINT_SOBEL]      = { "sobel",      "sobel[:x|y]",                  "sobel_operation.bmp",      IMAGE_LAYOUT_ANY, 1 },
+    [POINT_CANNY]      = { "canny",      "canny[:<low>[:<high>]]",       "canny_operation.bmp",      IMAGE_LAYOUT_ANY, 1 },
+    [POINT_MEDIAN]     = { "median",     "median[:<radius>]",            "median_operation.bmp",     IMAGE_LAYOUT_ANY, 1 },
+};
+
+#define NOPERATIONS ((int) (sizeof(operations) / sizeof(operations[0])))
+
+// Pick the working layout for a chain run stage by stage: planar pays for the
+// conversion at read and write time, so it is only used when most stages prefer it.
+// The fused lookup-table pass is equally fast on both, so it stays interleaved.
+// Stages after a grayscale run on the gray image, so only the ones before it count.
+enum image_layout choose_layout(const struct point_stage *stages, int nstages, int fused) {
+    int i, planar = 0, interleaved = 0;
+
+    if (fused) return IMAGE_INTERLEAVED;
+    for (i = 0; i < nstages && stages[i].op != POINT_GRAYSCALE; i++) {
+        if (operations[stages[i].op].layout == IMAGE_PLANAR) planar++;
+        if (operations[stages[i].op].layout == IMAGE_INTERLEAVED) interleaved++;
+    }
+    return (planar > i / 2 && planar > interleaved) ? IMAGE_PLANAR : IMAGE_INTERLEAVED;
+}
+
+// The stages to run, either folded into programs or one sweep per stage. A fused chain
+// is split in front of every adaptive stage (see point_pipeline.h): each run of stages
+// from one to the next is folded into a program of its own, compiled once the
+// adaptive stage at its head has been filled in from the image. It is split around
+// every filter as well, which runs as a step of its own.
+struct chain {
+    const struct point_stage *stages;
+    int nstages;
+    int fused;
+    const struct point_program *program;    // the stages before the first adaptive one, when fused
+    int resize_width, resize_height;        // size of the output image, 0 to keep the input size
+};
+
+// What running the chain keeps from one image to the next, so that only a change of
+// size allocates: the resize weights and rings, the CLAHE tiles, the convolution rings
+// and derivatives, canny's stacks, the median's rings and column histograms, a
+// histogram for every band, and what an adaptive stage is filled in with
+struct chain_scratch {
+    struct resize_plan resize;
+    struct clahe_plan clahe;
+    struct convolve_plan convolve;
+    int *derivative[CONVOLVE_MAX_FILTERS];  // sobel's, width ints per row, NULL until needed
+    size_t derivative_size;                 // ints in each
+    struct canny_plan canny;
+    struct median_plan median;
+    struct histogram *histograms;           // one per band, NULL until a stage needs them
+    int nhistograms;
+    unsigned int counts[HISTOGRAM_PLANES][256];     // the bands merged, for the next stage
+    struct point_stage stage;               // the adaptive stage being run, filled in
+    unsigned char map[3][256];              // and its maps
+    struct point_stage stages[POINT_MAX_STAGES + 1];    // the fused run it heads
+    struct point_program program;           // and its program
+};
+
+// One image on its way through the program. Everything that depends on the image lives
+// here rather than in globals, so any number of jobs can be in flight in one process.
+struct job {
+    char *in_name, *out_name;
+    int width, height;                      // of the input, once it has been read
+    byte *header;
+    struct image image;                     // the input
+    struct pipeline pipe;                   // the chain planned for the input's size
+    struct image work[PIPELINE_MAX_BUFFERS];    // the plan's buffers
+    struct image *result;                   // the input or one of work, once processed
+    struct image_pool *buffers;             // where the images are allocated, NULL for malloc
+    long long read_ns, write_ns;
+};
+
+// Timing slots: reading, drawing the input (-v), one per sweep of the chain (the resize
+// counts as one), writing and the whole run
+#define SLOT_READ 0
+#define SLOT_DISPLAY 1
+#define SLOT_CHAIN 2
+#define NSLOTS (SLOT_CHAIN + PIPELINE_MAX_STEPS + 2)
+
+// Steps of a planned chain (the op of a pipeline_step)
+enum chain_step {
+    STEP_FUSED,         // the stages from arg up to the next adaptive one, folded into a program
+    STEP_STAGE,         // one point stage
+    STEP_FILTER,        // one filter, into a gray image of its own
+    STEP_CANNY_BLUR,    // canny, a step per part so that each is timed on its own: the blur, into a gray image,
+    STEP_CANNY_GRADIENT,    // then in place the derivatives,
+    STEP_CANNY_SUPPRESS,    // non-maximum suppression
+    STEP_CANNY_HYSTERESIS,  // and hysteresis
+    STEP_MEASURE,       // only the histogram of the input, for a chain that starts with an adaptive stage
+    STEP_RESIZE         // to chain->resize_width x chain->resize_height
+};
+
+// Number of stages from first up to the next adaptive one or filter, which a fused
+// chain runs as one program
+int chain_segment_length(const struct chain *chain, int first) {
+    int n = 1;
+
+    while (first + n < chain->nstages && !point_stage_is_adaptive (&chain->stages[first + n])
+           && !point_stage_is_filter (&chain->stages[first + n]))
+        n++;
+    return n;
+}
+
+// Plan the buffers for running the chain over a width x height image in layout: the
+// point stages work in place, except a grayscale (or a fused program ending in one) on
+// a colour image, which writes a gray plane; filters write a gray image and a resize an
+// image of their own. Canny is a step per part, all but the first in place. Returns -1
+// if the chain needs more steps or buffers than a plan holds.
+int chain_plan(const struct chain *chain, struct pipeline *pipe, int width, int height, enum image_layout layout) {
+    int i, n, gray, part, ok = 1;
+
+    pipeline_begin (pipe, width, height, layout);
+    for (i = 0; i < chain->nstages && ok; i += n) {
+        // an adaptive stage is measured by the sweep before it, if there is one
+        if (point_stage_is_adaptive (&chain->stages[i])
+            && (pipe->nsteps == 0
+                || (pipe->step[pipe->nsteps - 1].op != STEP_FUSED && pipe->step[pipe->nsteps - 1].op != STEP_STAGE))) {
+            ok = pipeline_add (pipe, STEP_MEASURE, NULL, 1, width, height, layout) == 0;
+            if (!ok) break;
+        }
+        n = 1;
+        if (chain->stages[i].op == POINT_CANNY) {
+            ok = pipeline_add (pipe, STEP_CANNY_BLUR, &chain->stages[i], 0, width, height, IMAGE_GRAY) == 0;
+            for (part = STEP_CANNY_GRADIENT; part <= STEP_CANNY_HYSTERESIS && ok; part++)
+                ok = pipeline_add (pipe, part, &chain->stages[i], 1, width, height, IMAGE_GRAY) == 0;
+            continue;
+        }
+        if (point_stage_is_filter (&chain->stages[i])) {
+            ok = pipeline_add (pipe, STEP_FILTER, &chain->stages[i], 0, width, height, IMAGE_GRAY) == 0;
+            continue;
+        }
+        if (chain->fused) n = chain_segment_length (chain, i);
+        gray = chain->fused ? point_stages_make_gray (&chain->stages[i], n) : chain->stages[i].op == POINT_GRAYSCALE;
+        gray = gray && pipeline_current (pipe)->layout != IMAGE_GRAY;
+        ok = pipeline_add (pipe, chain->fused ? STEP_FUSED : STEP_STAGE, &chain->stages[i], !gray, width, height,
+                           IMAGE_GRAY) == 0;
+    }
+    if (ok && chain->resize_width > 0)
+        ok = pipeline_add (pipe, STEP_RESIZE, NULL, 0, chain->resize_width, chain->resize_height,
+                           pipeline_current (pipe)->layout) == 0;
+    return ok ? 0 : -1;
+}
+
+int chain_sweeps(const struct chain *chain) {
+    struct pipeline pipe;
+
+    chain_plan (chain, &pipe, 1, 1, IMAGE_INTERLEAVED);
+    return pipe.nsteps;
+}
+
+// Does the step start with an adaptive stage, which needs the histogram of its input?
+int chain_step_adapts(const struct pipeline_step *step) {
+    return (step->op == STEP_FUSED || step->op == STEP_STAGE)
+           && point_stage_is_adaptive ((const struct point_stage *) step->arg);
+}
+
+void chain_scratch_free(struct chain_scratch *scratch) {
+    resize_plan_free (&scratch->resize);
+    clahe_plan_free (&scratch->clahe);
+    convolve_plan_free (&scratch->convolve);
+    canny_plan_free (&scratch->canny);
+    median_plan_free (&scratch->median);
+    free (scratch->derivative[0]);
+    free (scratch->derivative[1]);
+    scratch->derivative[0] = scratch->derivative[1] = NULL;
+    scratch->derivative_size = 0;
+    free (scratch->histograms);
+    scratch->histograms = NULL;
+    scratch->nhistograms = 0;
+}
+
+// Make room for a histogram per band of pool. Returns -1 if out of memory.
+int chain_scratch_histograms(struct chain_scratch *scratch, const struct thread_pool *pool) {
+    if (scratch->nhistograms >= pool->nthreads) return 0;
+    free (scratch->histograms);
+    scratch->histograms = malloc (sizeof(struct histogram) * pool->nthreads);
+    scratch->nhistograms = scratch->histograms ? pool->nthreads : 0;
+    return scratch->histograms ? 0 : -1;
+}
+
+// Make room for the derivatives of a width x height image. Returns -1 if out of memory.
+int chain_scratch_derivatives(struct chain_scratch *scratch, int width, int height) {
+    size_t size = (size_t) width * height;
+    int k;
+
+    if (scratch->derivative_size >= size) return 0;
+    for (k = 0; k < CONVOLVE_MAX_FILTERS; k++) {
+        free (scratch->derivative[k]);
+        scratch->derivative[k] = malloc (sizeof(int) * size);
+    }
+    scratch->derivative_size = (scratch->derivative[0] && scratch->derivative[1]) ? size : 0;
+    return scratch->derivative_size ? 0 : -1;
+}
+
+// Fill in an adaptive stage from the histogram in scratch, measured on its input: Otsu
+// and equalize go by the gray level, stretch by each channel of a colour image. Returns
+// the filled-in copy, which lives in scratch.
+const struct point_stage *chain_adapt(struct chain_scratch *scratch, const struct point_stage *stage, int gray,
+                                      int debug) {
+    const unsigned int *luma = scratch->counts[HISTOGRAM_LUMA];
+    int c;
+
+    scratch->stage = *stage;
+    scratch->stage.map = scratch->map;
+    switch (stage->op) {
+        case POINT_OTSU:
+            scratch->stage.threshold = histogram_otsu (luma);
+            if (debug) printf("OTSU: level %d\n", scratch->stage.threshold);
+            break;
+        case POINT_STRETCH:
+            for (c = 0; c < 3; c++)
+                histogram_stretch_map (gray ? luma : scratch->counts[c], stage->amount, scratch->map[c]);
+            break;
+        case POINT_EQUALIZE:
+            histogram_equalize_map (luma, scratch->map[0]);
+            memcpy (scratch->map[1], scratch->map[0], 256);
+            memcpy (scratch->map[2], scratch->map[0], 256);
+            break;
+        default:
+            break;
+    }
+    return &scratch->stage;
+}
+
+// Compile the fused run of stages headed by head, an adaptive stage or the first one
+// after a filter; stage is head, or its filled-in copy if it is adaptive. The program
+// of a run over a gray image starts with a grayscale, which leaves gray pixels as they
+// are, so that the whole run folds into a luma pass that reads and writes the one
+// plane.
+const struct point_program *chain_compile(struct chain_scratch *scratch, const struct chain *chain,
+                                          const struct point_stage *head, const struct point_stage *stage, int gray) {
+    int n = chain_segment_length (chain, head - chain->stages), count = 0;
+
+    if (gray) {
+        memset (&scratch->stages[0], 0, sizeof(struct point_stage));
+        scratch->stages[count++].op = POINT_GRAYSCALE;
+    }
+    scratch->stages[count++] = *stage;
+    memcpy (&scratch->stages[count], head + 1, sizeof(struct point_stage) * (n - 1));
+    point_program_compile (&scratch->program, scratch->stages, count + n - 1);
+    return &scratch->program;
+}
+
+// Resize rows [y0, y1) of the output; each band keeps its own ring of source rows
+struct resize_job {
+    struct thread_pool *pool;
+    const struct resize_plan *plan;
+    const struct image *src;
+    struct image *dst;
+    int failed;
+};
+
+void resize_band(void *arg, int y0, int y1) {
+    struct resize_job *job = (struct resize_job *) arg;
+    int band = thread_pool_band_index (job->pool, job->dst->height, y0);
+
+    if (resize_rows (job->plan, job->src, job->dst, y0, y1, job->plan->rings + job->plan->ring_size * band) < 0)
+        job->failed = 1;
+}
+
+// Resize img into dst, which already has the output size. The weights and the rings of
+// every band are kept in plan for the next image of the same size, so only a change of
+// size allocates. Returns -1 if out of memory.
+int run_resize(struct thread_pool *pool, struct resize_plan *plan, struct image *img, struct image *dst) {
+    struct resize_job resize;
+    int w = dst->width, h = dst->height;
+
+    if (resize_plan_init (plan, img->width, img->height, w, h, resize_filter_for (img->width, img->height, w, h)) < 0
+        || resize_plan_rings (plan, (img->layout == IMAGE_INTERLEAVED) ? 3 : 1, pool->nthreads) < 0)
+        return -1;
+    resize.pool = pool;
+    resize.plan = plan;
+    resize.src = img;
+    resize.dst = dst;
+    resize.failed = 0;
+    thread_pool_run (pool, h, resize_band, &resize);
+    return resize.failed ? -1 : 0;
+}
+
+// CLAHE in two sweeps: the tiles, in bands of tile rows, then every pixel, in bands of
+// image rows
+struct clahe_job {
+    struct thread_pool *pool;
+    struct clahe_plan *plan;
+    const struct image *src;
+    struct image *dst;
+    int clip;
+};
+
+void clahe_tile_band(void *arg, int t0, int t1) {
+    struct clahe_job *job = (struct clahe_job *) arg;
+
+    clahe_tile_rows (job->plan, job->src, job->dst, job->clip,
+                     thread_pool_band_index (job->pool, job->plan->tiles_y, t0), t0, t1);
+}
+
+void clahe_band(void *arg, int y0, int y1) {
+    struct clahe_job *job = (struct clahe_job *) arg;
+
+    // a colour input has already been made gray into dst
+    clahe_rows (job->plan, (job->src->layout == IMAGE_GRAY) ? job->src : job->dst, job->dst, y0, y1);
+}
+
+// A convolution, in bands of rows, each with a ring of its own
+struct convolve_job {
+    struct thread_pool *pool;
+    const struct convolve_plan *plan;
+    const struct image *src;
+    struct image *dst;
+    int *const *derivative;
+};
+
+void convolve_band(void *arg, int y0, int y1) {
+    struct convolve_job *job = (struct convolve_job *) arg;
+
+    convolve_rows (job->plan, job->src, job->dst, job->derivative, y0, y1,
+                   thread_pool_band_index (job->pool, job->src->height, y0));
+}
+
+// The median, in bands of rows, each with a ring and histograms of its own
+struct median_job {
+    struct thread_pool *pool;
+    const struct median_plan *plan;
+    const struct image *src;
+    struct image *dst;
+};
+
+void median_band(void *arg, int y0, int y1) {
+    struct median_job *job = (struct median_job *) arg;
+
+    median_rows (job->plan, job->src, job->dst, y0, y1, thread_pool_band_index (job->pool, job->src->height, y0));
+}
+
+// Run the filters set up in scratch's convolution plan over img into dst (see
+// convolve_rows). Returns -1 if out of memory.
+int run_convolve(struct thread_pool *pool, struct chain_scratch *scratch, const struct image *img, struct image *dst) {
+    struct convolve_job convolve;
+
+    if (convolve_plan_scratch (&scratch->convolve, img->width, pool->nthreads) < 0) return -1;
+    convolve.pool = pool;
+    convolve.plan = &scratch->convolve;
+    convolve.src = img;
+    convolve.dst = dst;
+    convolve.derivative = scratch->derivative;
+    thread_pool_run (pool, img->height, convolve_band, &convolve);
+    return 0;
+}
+
+// Run a filter stage over img into dst, a gray image of the same size. What it keeps
+// between images lives in scratch. Returns -1 if out of memory.
+int run_filter(struct thread_pool *pool, struct chain_scratch *scratch, const struct point_stage *stage,
+               struct image *img, struct image *dst) {
+    struct convolve_plan *plan = &scratch->convolve;
+    struct median_job median;
+    struct clahe_job clahe;
+
+    switch (stage->op) {
+        case POINT_CLAHE:
+            if (clahe_plan_init (&scratch->clahe, img->width, img->height, stage->size, pool->nthreads) < 0)
+                return -1;
+            clahe.pool = pool;
+            clahe.plan = &scratch->clahe;
+            clahe.src = img;
+            clahe.dst = dst;
+            clahe.clip = stage->amount;
+            thread_pool_run (pool, scratch->clahe.tiles_y, clahe_tile_band, &clahe);
+            thread_pool_run (pool, img->height, clahe_band, &clahe);
+            return 0;
+        case POINT_GAUSSIAN:
+        case POINT_BOX:
+        case POINT_SHARPEN:
+            convolve_filter_init (&plan->filter[0], (stage->op == POINT_BOX) ? CONVOLVE_BOX : CONVOLVE_GAUSSIAN,
+                                  stage->size);
+            plan->nfilters = 1;
+            plan->sharpen = (stage->op == POINT_SHARPEN) ? (stage->amount * 256 + 50) / 100 : 0;
+            break;
+        case POINT_SOBEL:
+            if (chain_scratch_derivatives (scratch, img->width, img->height) < 0) return -1;
+            plan->nfilters = 0;
+            if (stage->amount != 2)
+                convolve_filter_init (&plan->filter[plan->nfilters++], CONVOLVE_SOBEL_X, 1);
+            if (stage->amount != 1)
+                convolve_filter_init (&plan->filter[plan->nfilters++], CONVOLVE_SOBEL_Y, 1);
+            plan->sharpen = 0;
+            break;
+        case POINT_MEDIAN:
+            if (median_plan_init (&scratch->median, img->width, stage->size, pool->nthreads) < 0) return -1;
+            median.pool = pool;
+            median.plan = &scratch->median;
+            median.src = img;
+            median.dst = dst;
+            thread_pool_run (pool, img->height, median_band, &median);
+            return 0;
+        default:
+            return -1;
+    }
+    return run_convolve (pool, scratch, img, dst);
+}
+
+// Canny's suppression and hysteresis, in bands of rows
+struct canny_job {
+    struct thread_pool *pool;
+    struct canny_plan *plan;
+    const int *gx, *gy;
+    struct image *img;
+    int low, high;
+};
+
+void canny_suppress_band(void *arg, int y0, int y1) {
+    struct canny_job *job = (struct canny_job *) arg;
+
+    canny_suppress_rows (job->gx, job->gy, job->img, job->low, job->high, y0, y1);
+}
+
+void canny_trace_band(void *arg, int y0, int y1) {
+    struct canny_job *job = (struct canny_job *) arg;
+
+    canny_trace_rows (job->plan, job->img, y0, y1);
+}
+
+void canny_seed_band(void *arg, int y0, int y1) {
+    struct canny_job *job = (struct canny_job *) arg;
+
+    canny_seed_rows (job->plan, job->img, thread_pool_band_index (job->pool, job->img->height, y0), y0, y1);
+}
+
+void canny_grow_band(void *arg, int y0, int y1) {
+    struct canny_job *job = (struct canny_job *) arg;
+
+    canny_grow_rows (job->plan, job->img, thread_pool_band_index (job->pool, job->img->height, y0), y0, y1);
+}
+
+void canny_finish_band(void *arg, int y0, int y1) {
+    struct canny_job *job = (struct canny_job *) arg;
+
+    canny_finish_rows (job->img, y0, y1);
+}
+
+// Run one part of canny (a STEP_CANNY_ step): the blur of img into dst, or the rest in
+// place on dst. The derivatives and stacks live in scratch. Returns -1 if out of memory.
+int run_canny(struct thread_pool *pool, struct chain_scratch *scratch, const struct point_stage *stage, int part,
+              struct image *img, struct image *dst) {
+    struct convolve_plan *plan = &scratch->convolve;
+    struct canny_job canny;
+    int band, seeds;
+
+    canny.pool = pool;
+    canny.plan = &scratch->canny;
+    canny.gx = scratch->derivative[0];
+    canny.gy = scratch->derivative[1];
+    canny.img = dst;
+    canny.low = stage->threshold;
+    canny.high = stage->amount;
+    switch (part) {
+        case STEP_CANNY_BLUR:
+            convolve_filter_init (&plan->filter[0], CONVOLVE_GAUSSIAN, CANNY_BLUR_RADIUS);
+            plan->nfilters = 1;
+            plan->sharpen = 0;
+            return run_convolve (pool, scratch, img, dst);
+        case STEP_CANNY_GRADIENT:
+            if (chain_scratch_derivatives (scratch, img->width, img->height) < 0) return -1;
+            convolve_filter_init (&plan->filter[0], CONVOLVE_SOBEL_X, 1);
+            convolve_filter_init (&plan->filter[1], CONVOLVE_SOBEL_Y, 1);
+            plan->nfilters = 2;
+            plan->sharpen = 0;
+            return run_convolve (pool, scratch, img, NULL);
+        case STEP_CANNY_SUPPRESS:
+            thread_pool_run (pool, dst->height, canny_suppress_band, &canny);
+            return 0;
+        case STEP_CANNY_HYSTERESIS:
+            if (canny_plan_init (&scratch->canny, dst->width, dst->height, pool->nthreads) < 0) return -1;
+            thread_pool_run (pool, dst->height, canny_trace_band, &canny);
+            // the wavefront across the bands, until no band has anything left to grow from
+            for (;;) {
+                thread_pool_run (pool, dst->height, canny_seed_band, &canny);
+                for (seeds = 0, band = 0; band < thread_pool_bands (pool, dst->height); band++)
+                    seeds += scratch->canny.nseeds[band];
+                if (seeds == 0) break;
+                thread_pool_run (pool, dst->height, canny_grow_band, &canny);
+            }
+            thread_pool_run (pool, dst->height, canny_finish_band, &canny);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// What the canny steps are called in the timing report
+const char *const canny_parts[] = { "canny blur", "canny sobel", "canny nms", "canny hyst" };
+
+// Write the derivatives in scratch of an image the size of img for debug mode: both
+// (which 0), only x (1) or only y (2)
+void write_derivatives(byte *header, const struct chain_scratch *scratch, int which, const struct image *img) {
+    if (which != 2)
+        write_signed_bmp ("sobel_x.bmp", header, scratch->derivative[0], img->width, img->height);
+    if (which != 1)
+        write_signed_bmp ("sobel_y.bmp", header, scratch->derivative[which == 0], img->width, img->height);
+}
+
+// Run the planned chain over input, writing into the plan's buffers (from
+// pipeline_alloc), and return the image that holds the result, or NULL if out of
+// memory. Nothing is allocated unless a resize or filter meets a new size or a chain
+// first needs its histograms; all of them are kept in scratch. If debug_header is not
+// NULL, each stage's output is written out. Every step's time is added to its slot in
+// timing (which may be NULL).
+struct image *run_chain(struct thread_pool *pool, const struct chain *chain, const struct pipeline *pipe,
+                        struct image *input, struct image *buffers, struct chain_scratch *scratch, byte *debug_header,
+                        struct timing *timing) {
+    const struct pipeline_step *step;
+    const struct point_stage *head, *stage;
+    struct image *src, *dst;
+    struct sweep sweep;
+    const char *name;
+    long long start;
+    int i;
+
+    // the pool waits for every band before returning, which is the barrier between
+    // steps; a fused program folds a run of stages into one step, since point
+    // operations never look at other rows. A step followed by an adaptive stage counts
+    // its output as it writes it, so measuring the image costs no sweep of its own.
+    for (i = 0; i < pipe->nsteps; i++) {
+        step = &pipe->step[i];
+        src = pipeline_image (input, buffers, step->src);
+        dst = pipeline_image (input, buffers, step->dst);
+        start = timing_now ();
+        if (step->op == STEP_RESIZE) {
+            if (run_resize (pool, &scratch->resize, src, dst) < 0) return NULL;
+            name = "resize";
+        } else if (step->op == STEP_FILTER) {
+            stage = (const struct point_stage *) step->arg;
+            if (run_filter (pool, scratch, stage, src, dst) < 0) return NULL;
+            name = operations[stage->op].name;
+        } else if (step->op >= STEP_CANNY_BLUR && step->op <= STEP_CANNY_HYSTERESIS) {
+            if (run_canny (pool, scratch, (const struct point_stage *) step->arg, step->op, src, dst) < 0) return NULL;
+            name = canny_parts[step->op - STEP_CANNY_BLUR];
+        } else {
+            head = stage = (const struct point_stage *) step->arg;
+            if (stage && point_stage_is_adaptive (stage))
+                stage = chain_adapt (scratch, stage, src->layout == IMAGE_GRAY, debug_header != NULL);
+            sweep.image = src;
+            sweep.stage = (step->op == STEP_STAGE) ? stage : NULL;
+            sweep.program = NULL;
+            // only the first run of a chain is compiled before the image is seen
+            if (step->op == STEP_FUSED)
+                sweep.program = (head == chain->stages && stage == head)
+                                ? chain->program
+                                : chain_compile (scratch, chain, head, stage, src->layout == IMAGE_GRAY);
+            sweep.gray = step->in_place ? NULL : dst;
+            sweep.pool = pool;
+            sweep.histograms = NULL;
+            sweep.channels = 0;
+            if (i + 1 < pipe->nsteps && chain_step_adapts (&pipe->step[i + 1])) {
+                if (chain_scratch_histograms (scratch, pool) < 0) return NULL;
+                sweep.histograms = scratch->histograms;
+                sweep.channels = ((const struct point_stage *) pipe->step[i + 1].arg)->op == POINT_STRETCH;
+            }
+            thread_pool_run (pool, src->height, sweep_band, &sweep);
+            if (sweep.histograms)
+                histogram_merge (scratch->histograms, thread_pool_bands (pool, src->height), scratch->counts);
+            name = sweep.stage ? operations[sweep.stage->op].name : sweep.program ? "fused" : "histogram";
+        }
+        timing_add (timing, SLOT_CHAIN + i, name, timing_now () - start, (long long) src->width * src->height,
+                    image_bytes (src));
+        if (debug_header && (step->op == STEP_STAGE || step->op == STEP_FILTER || step->op == STEP_CANNY_HYSTERESIS))
+            write_bmp ((char *) operations[((const struct point_stage *) step->arg)->op].debug_name, debug_header, dst);
+        // and the derivatives of sobel or canny, x first when there are both
+        if (debug_header && step->op == STEP_FILTER && ((const struct point_stage *) step->arg)->op == POINT_SOBEL)
+            write_derivatives (debug_header, scratch, ((const struct point_stage *) step->arg)->amount, src);
+        if (debug_header && step->op == STEP_CANNY_GRADIENT)
+            write_derivatives (debug_header, scratch, 0, src);
+    }
+    return pipeline_image (input, buffers, pipe->result);
+}
+
+// Streaming mode: read the image strip_rows rows at a time, run the chain on each strip
+// and write it out before reading the next, so memory use grows with the strip rather
+// than the whole image. Every stage is a point operation that needs nothing but the
+// pixel (the ones that need the whole image are refused), so a strip never needs rows
+// from its neighbours and the output matches a whole-image run.
+// Returns -1 if a file cannot be opened or there is not enough memory for one strip.
+int run_strips(struct job *job, int strip_rows, enum image_layout layout, struct thread_pool *pool,
+               const struct chain *chain, struct timing *timing) {
+    struct image strip = { 0 }, work[PIPELINE_MAX_BUFFERS] = { { 0 } }, *result;
+    struct pipeline pipe;
+    byte *header = NULL, *row = NULL, *buffer;
+    size_t offset, stride;
+    FILE *in = NULL, *out = NULL;
+    char *tmp_name = NULL;
+    int y, y0, rows, ok, width, height, i, slot_write = SLOT_CHAIN + chain_sweeps (chain), out_fd = -1;
+    long long start;
+    int fd = open (job->in_name, O_RDONLY);
+
+    if (fd < 0) return -1;
+    ok = read_bmp_header (fd, &header, &offset, &job->width, &job->height) == 0;
+    width = job->width;
+    height = job->height;
+    // the input is read as the output is written, so the output cannot replace it
+    if (ok && same_file (fd, job->out_name)) {
+        printf("Error: -s cannot write over its input %s\n", job->in_name);
+        ok = 0;
+    }
+    if (ok) {
+        in = fdopen (fd, "rb");
+        out_fd = output_create (job->out_name, &tmp_name);
+        out = (out_fd >= 0) ? fdopen (out_fd, "wb") : NULL;
+        stride = bmp_row_size (width);
+        row = calloc (stride > 54 ? stride : 54, sizeof(byte));
+        if (strip_rows > height) strip_rows = height;
+        ok = in && out && row;
+    }
+    if (ok && layout == IMAGE_INTERLEAVED) {
+        // interleaved strips keep the file's row padding, so a strip is read and
+        // written with a single call
+        buffer = malloc (stride * strip_rows);
+        ok = buffer != NULL;
+        if (ok) {
+            image_borrow (&strip, width, strip_rows, buffer, stride);
+            strip.buffer = buffer;
+        }
+    } else if (ok) {
+        ok = image_alloc (&strip, width, strip_rows, layout) == 0;
+    }
+    if (ok)
+        ok = chain_plan (chain, &pipe, width, strip_rows, layout) == 0 && pipeline_alloc (&pipe, work, NULL) == 0;
+
+    if (ok) {
+        fseek (in, offset, SEEK_SET);
+        bmp_output_header (row, header, width, height);
+        fwrite (row, sizeof(byte), 54, out);
+        memset (row, 0, 54);
+        for (y0 = 0; y0 < height; y0 += rows) {
+            rows = (height - y0 < strip_rows) ? height - y0 : strip_rows;
+            strip.height = rows;
+            for (i = 0; i < pipe.nbuffers; i++)
+                work[i].height = rows;
+            start = timing_now ();
+            if (layout == IMAGE_INTERLEAVED) {
+                ok = fread (strip.plane[0], sizeof(byte), stride * rows, in) == stride * rows;
+            } else {
+                for (y = 0; y < rows && ok; y++) {
+                    ok = fread (row, sizeof(byte), stride, in) == stride;
+                    if (ok) bmp_load_row (&strip, y, row);
+                }
+            }
+            if (!ok) break;     // the file ends before the last row
+            timing_add (timing, SLOT_READ, "read", timing_now () - start, (long long) width * rows, stride * rows);
+            result = run_chain (pool, chain, &pipe, &strip, work, NULL, NULL, timing);
+            start = timing_now ();
+            if (result == &strip && layout == IMAGE_INTERLEAVED) {
+                fwrite (strip.plane[0], sizeof(byte), stride * rows, out);
+            } else {
+                for (y = 0; y < rows; y++) {
+                    bmp_store_row (result, y, row);
+                    fwrite (row, sizeof(byte), stride, out);
+                }
+            }
+            timing_add (timing, slot_write, "write", timing_now () - start, (long long) width * rows, stride * rows);
+        }
+    }
+
+    if (in) fclose (in);
+    else close (fd);
+    if (out) {
+        ok = ok && !ferror (out);
+        ok = (fclose (out) == 0) && ok;
+    } else if (out_fd >= 0) {
+        close (out_fd);
+    }
+    if (tmp_name) ok = output_finish (tmp_name, job->out_name, ok) == 0;
+    image_free (&strip);
+    for (i = 0; i < PIPELINE_MAX_BUFFERS; i++)
+        image_free (&work[i]);
+    free (row);
+    free (header);
+    return ok ? 0 : -1;
+}
+
+// Read the input of a job, plan the chain for its size and take every buffer the plan
+// needs. Returns -1 if the image cannot be read or there is not enough memory.
+int job_read(struct job *job, enum image_layout layout, const struct chain *chain) {
+    long long start = timing_now ();
+
+    job->result = NULL;
+    // Open input image file (24-bit bitmap image)
+    if (read_bmp (job->in_name, &job->header, &job->image, layout, job->buffers) < 0) {
+        printf("Failed to read BMP %s\n", job->in_name);
+        job->header = NULL;
+        return -1;
+    }
+    job->width = job->image.width;
+    job->height = job->image.height;
+    if (chain_plan (chain, &job->pipe, job->width, job->height, job->image.layout) < 0
+        || pipeline_alloc (&job->pipe, job->work, job->buffers) < 0) {
+        printf("Error: out of memory\n");
+        image_release (&job->image);
+        free (job->header);
+        job->header = NULL;
+        return -1;
+    }
+    job->read_ns = timing_now () - start;
+    return 0;
+}
+
+// Draw the input (unless screen is NULL) and run the chain, resizing the result if the
+// chain asks for it; scratch keeps the resize weights and histograms for the next image.
+// Returns -1 if there is not enough memory.
+int job_process(struct job *job, struct thread_pool *pool, const struct chain *chain, struct chain_scratch *scratch,
+                int debug, struct screen *screen, struct timing *timing) {
+    long long start, pixels = (long long) job->width * job->height;
+
+    if (screen) {
+        start = timing_now ();
+        draw_image (screen, &job->image);
+        timing_add (timing, SLOT_DISPLAY, "display", timing_now () - start, pixels, pixels * 3);
+    }
+    job->result = run_chain (pool, chain, &job->pipe, &job->image, job->work, scratch, debug ? job->header : NULL,
+                             timing);
+    if (!job->result) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    // only the result still has to be written; the other buffers can go to the next image
+    pipeline_release (&job->pipe, job->work, job->pipe.result);
+    if (job->result != &job->image) image_release (&job->image);
+    return 0;
+}
+
+void job_write(struct job *job) {
+    long long start = timing_now ();
+
+    write_bmp (job->out_name, job->header, job->result);
+    job->write_ns = timing_now () - start;
+}
+
+// Free the images and header of a job (not the job itself)
+void job_free(struct job *job) {
+    image_release (&job->image);
+    pipeline_release (&job->pipe, job->work, PIPELINE_INPUT);
+    free (job->header);
+    job->header = NULL;
+}
+
+// Read the whole image, run the chain over it and write the result. The image is drawn
+// on screen first unless screen is NULL. Returns -1 if the image cannot be read or there
+// is not enough memory.
+int run_image(struct job *job, enum image_layout layout, struct thread_pool *pool, const struct chain *chain,
+              struct chain_scratch *scratch, int debug, struct screen *screen, struct timing *timing) {
+    if (job_read (job, layout, chain) < 0) return -1;
+    timing_add (timing, SLOT_READ, "read", job->read_ns, (long long) job->width * job->height,
+                bmp_file_size (job->width, job->height));
+    if (job_process (job, pool, chain, scratch, debug, screen, timing) < 0) {
+        job_free (job);
+        return -1;
+    }
+    job_write (job);
+    timing_add (timing, SLOT_CHAIN + chain_sweeps (chain), "write", job->write_ns,
+                (long long) job->result->width * job->result->height,
+                bmp_file_size (job->result->width, job->result->height));
+    job_free (job);
+    return 0;
+}
+
+/********************************************
+*                  BATCH                    *
+********************************************/
+
+// Output file name for the index-th input: pattern with %n replaced by the input's name
+// without its directory and extension, %i by index and %% by %. Returns NULL if out of
+// memory.
+char *output_name(const char *pattern, const char *in_name, int index) {
+    const char *base = strrchr (in_name, '/'), *dot, *p;
+    size_t base_len, size = 1;
+    char *name, *out;
+
+    base = base ? base + 1 : in_name;
+    dot = strrchr (base, '.');
+    base_len = (dot && dot != base) ? (size_t) (dot - base) : strlen (base);
+    for (p = pattern; *p; p++)
+        size += (*p == '%') ? base_len + 12 : 1;
+    name = malloc (size);
+    if (!name) return NULL;
+    for (p = pattern, out = name; *p; p++) {
+        if (*p != '%' || (p[1] != 'n' && p[1] != 'i' && p[1] != '%')) {
+            *out++ = *p;
+            continue;
+        }
+        p++;
+        if (*p == 'n') {
+            memcpy (out, base, base_len);
+            out += base_len;
+        } else if (*p == 'i') {
+            out += sprintf (out, "%d", index);
+        } else {
+            *out++ = '%';
+        }
+    }
+    *out = '\0';
+    return name;
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+// Append name to a list that grows as needed. Returns -1 (and frees name) if name is
+// NULL or there is not enough memory.
+int add_input(char ***list, int *count, int *capacity, char *name) {
+    char **grown;
+
+    if (name && *count == *capacity) {
+        grown = realloc (*list, (*capacity ? 2 * *capacity : 16) * sizeof(char *));
+        if (grown) {
+            *list = grown;
+            *capacity = *capacity ? 2 * *capacity : 16;
+        }
+    }
+    if (!name || *count == *capacity) {
+        printf("Error: out of memory\n");
+        free (name);
+        return -1;
+    }
+    (*list)[(*count)++] = name;
+    return 0;
+}
+
+// Expand the command line arguments into a list of input files: a directory stands for
+// the .bmp files in it, in name order. Returns the number of files, or -1 if a directory
+// cannot be read or there is not enough memory.
+int list_inputs(char **args, int nargs, char ***names) {
+    char **list = NULL, *name;
+    int i, first, count = 0, capacity = 0, ok = 1;
+    struct stat st;
+    struct dirent *entry;
+    DIR *dir;
+    size_t len;
+
+    for (i = 0; i < nargs && ok; i++) {
+        if (stat (args[i], &st) != 0 || !S_ISDIR (st.st_mode)) {
+            ok = add_input (&list, &count, &capacity, strdup (args[i])) == 0;
+            continue;
+        }
+        dir = opendir (args[i]);
+        if (!dir) {
+            printf("Error: could not read directory %s\n", args[i]);
+            ok = 0;
+            break;
+        }
+        first = count;
+        while (ok && (entry = readdir (dir)) != NULL) {
+            len = strlen (entry->d_name);
+            if (len < 5 || strcasecmp (entry->d_name + len - 4, ".bmp") != 0) continue;
+            name = malloc (strlen (args[i]) + len + 2);
+            if (name) sprintf (name, "%s/%s", args[i], entry->d_name);
+            ok = add_input (&list, &count, &capacity, name) == 0;
+        }
+        closedir (dir);
+        if (count > first) qsort (list + first, count - first, sizeof(char *), compare_names);
+    }
+    if (!ok) {
+        while (count > 0)
+            free (list[--count]);
+        free (list);
+        return -1;
+    }
+    *names = list;
+    return count;
+}
+
+// Batch mode: a reader thread reads the next images while the calling thread runs the
+// chain over the current one (with the pool's workers) and a writer thread writes out
+// the ones before it. The stages are joined by bounded queues, so reading, processing
+// and writing overlap while at most BATCH_QUEUE_DEPTH images wait between two stages.
+#define BATCH_QUEUE_DEPTH 2
+
+// Most bytes of free image buffers kept for the next images (see image_pool.h)
+#define BUFFER_POOL_LIMIT ((size_t) 256 << 20)
+
+struct batch {
+    char **in_names;
+    int count;
+    const char *pattern;                    // output naming, see output_name
+    enum image_layout layout;
+    const struct chain *chain;
+    struct image_pool *buffers;             // shared by the images of every run
+    struct work_queue to_process, to_write;
+    // totals of one run, each kept by the one thread that updates it
+    long long read_ns, pixels, bytes;       // reader
+    long long write_ns, out_pixels, out_bytes;  // writer
+    int read_failed, process_failed;
+};
+
+void *batch_reader(void *arg) {
+    struct batch *batch = (struct batch *) arg;
+    struct job *job;
+    int i;
+
+    for (i = 0; i < batch->count; i++) {
+        job = calloc (1, sizeof(struct job));
+        if (job) {
+            job->in_name = batch->in_names[i];
+            job->buffers = batch->buffers;
+            job->out_name = output_name (batch->pattern, job->in_name, i);
+        }
+        if (!job || !job->out_name || job_read (job, batch->layout, batch->chain) < 0) {
+            if (!job || !job->out_name) printf("Error: out of memory\n");
+            if (job) free (job->out_name);
+            free (job);
+            batch->read_failed++;
+            continue;
+        }
+        batch->read_ns += job->read_ns;
+        batch->pixels += (long long) job->width * job->height;
+        batch->bytes += bmp_file_size (job->width, job->height);
+        work_queue_push (&batch->to_process, job);
+    }
+    work_queue_close (&batch->to_process);
+    return NULL;
+}
+
+// Free a job made by the reader, with everything it holds
+void batch_drop(struct job *job) {
+    job_free (job);
+    free (job->out_name);
+    free (job);
+}
+
+void batch_write(struct batch *batch, struct job *job) {
+    job_write (job);
+    batch->write_ns += job->write_ns;
+    batch->out_pixels += (long long) job->result->width * job->result->height;
+    batch->out_bytes += bmp_file_size (job->result->width, job->result->height);
+    batch_drop (job);
+}
+
+void *batch_writer(void *arg) {
+    struct batch *batch = (struct batch *) arg;
+    struct job *job;
+
+    while ((job = work_queue_pop (&batch->to_write)) != NULL)
+        batch_write (batch, job);
+    return NULL;
+}
+
+// Run the chain over every input of the batch. Returns -1 if any image failed; the others
+// are still processed.
+int run_batch(struct batch *batch, struct thread_pool *pool, struct chain_scratch *scratch, int debug,
+              struct screen *screen, struct timing *timing) {
+    pthread_t reader, writer;
+    struct job *job;
+    int have_writer;
+
+    batch->read_ns = batch->pixels = batch->bytes = 0;
+    batch->write_ns = batch->out_pixels = batch->out_bytes = 0;
+    batch->read_failed = batch->process_failed = 0;
+    if (work_queue_init (&batch->to_process, BATCH_QUEUE_DEPTH) < 0) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    if (work_queue_init (&batch->to_write, BATCH_QUEUE_DEPTH) < 0) {
+        printf("Error: out of memory\n");
+        work_queue_destroy (&batch->to_process);
+        return -1;
+    }
+    if (pthread_create (&reader, NULL, batch_reader, batch) != 0) {
+        printf("Error: could not start the reader thread\n");
+        work_queue_destroy (&batch->to_process);
+        work_queue_destroy (&batch->to_write);
+        return -1;
+    }
+    // without a writer thread this thread writes each image itself
+    have_writer = pthread_create (&writer, NULL, batch_writer, batch) == 0;
+
+    while ((job = work_queue_pop (&batch->to_process)) != NULL) {
+        if (job_process (job, pool, batch->chain, scratch, debug, screen, timing) < 0) {
+            batch_drop (job);
+            batch->process_failed++;
+        } else if (have_writer) {
+            work_queue_push (&batch->to_write, job);
+        } else {
+            batch_write (batch, job);
+        }
+    }
+    work_queue_close (&batch->to_write);
+    pthread_join (reader, NULL);
+    if (have_writer) pthread_join (writer, NULL);
+    work_queue_destroy (&batch->to_process);
+    work_queue_destroy (&batch->to_write);
+
+    // the reader and writer were busy at the same time as the chain, so these add up to
+    // more than the wall time of the batch
+    timing_add (timing, SLOT_READ, "read", batch->read_ns, batch->pixels, batch->bytes);
+    timing_add (timing, SLOT_CHAIN + chain_sweeps (batch->chain), "write", batch->write_ns, batch->out_pixels,
+                batch->out_bytes);
+    return (batch->read_failed || batch->process_failed) ? -1 : 0;
+}
+
+/********************************************
+*               PIPELINE SPEC               *
+********************************************/
+
+// The chain can be given at run time (-p) as stages separated by commas, e.g.
+// gray,invert,brightness:+10,threshold:80, each written as in the operations table:
+// brightness adds (+) or subtracts (-) its amount, contrast adds its amount to pixels
+// brighter than level (+) or subtracts it from pixels darker than level (-), and
+// threshold turns pixels darker than level black and the others white. otsu thresholds
+// at the level that best separates the dark pixels from the bright ones, stretch:<percent>
+// maps the levels between the percent darkest and the percent brightest pixels (1 if
+// left out) onto the whole range, and equalize spreads the levels evenly over it.
+// clahe:<tiles>:<clip> equalizes each of tiles x tiles tiles (8 if left out) by its own
+// histogram, clipped at clip times its mean bin count (2 if left out, 0 for no limit),
+// and leaves a gray image. gaussian:<radius> and box:<radius> blur over radius pixels
+// on every side (1 if left out), sharpen:<percent>:<radius> adds percent of the
+// difference from that Gaussian blur back to the image (100 and 1 if left out), and
+// sobel:<x|y> leaves the gradient magnitude, or the absolute x or y derivative alone.
+// canny:<low>:<high> leaves the edges of a blur of the image: the pixels whose gradient
+// magnitude (up to 2040) peaks above low and that connect to one above high (40 and 100
+// if left out). median:<radius> replaces each pixel by the median of the pixels within
+// radius of it (1 if left out). All of them leave a gray image too. A last stage of
+// resize:<width>x<height> does the same as -r. "@file" reads the stages from a file,
+// where newlines separate stages as well and a # starts a comment.
+
+// Parse a size such as 160x120. Returns -1 if text is not one.
+int parse_size(const char *text, int *width, int *height) {
+    char end;
+
+    return (sscanf (text, "%dx%d%c", width, height, &end) == 2 && *width > 0 && *height > 0) ? 0 : -1;
+}
+
+// Parse a level or amount from 0 to 255. If sign is not NULL the value may start with +
+// (sign 1, the default) or - (sign 0). Returns -1 if text is not one.
+int parse_level(const char *text, int *value, int *sign) {
+    if (sign) {
+        *sign = (*text != '-');
+        if (*text == '+' || *text == '-') text++;
+    }
+    return parse_number (text, value, 255);
+}
+
+// Parse one stage such as "brightness:+10" (item is split up in place). Returns -1
+// after printing what is wrong with it.
+int parse_stage(char *item, struct point_stage *stage) {
+    char *arg[2] = { NULL, NULL }, *p = item;
+    int nargs = 0, op, ok = 0;
+
+    while ((p = strchr (p, ':')) != NULL) {
+        *p++ = '\0';
+        if (nargs < 2) arg[nargs] = p;
+        nargs++;
+    }
+    for (op = 0; op < NOPERATIONS && strcmp (item, operations[op].name) != 0; op++);
+    if (strcmp (item, "gray") == 0) op = POINT_GRAYSCALE;
+    if (op == NOPERATIONS) {
+        printf("Error: unknown stage %s\n", item);
+        return -1;
+    }
+    memset (stage, 0, sizeof(struct point_stage));
+    stage->op = op;
+    switch (stage->op) {
+        case POINT_GRAYSCALE:
+        case POINT_INVERT:
+        case POINT_OTSU:
+        case POINT_EQUALIZE:
+            ok = nargs == 0;
+            break;
+        case POINT_STRETCH:
+            stage->amount = 1;
+            ok = nargs == 0 || (nargs == 1 && parse_level (arg[0], &stage->amount, NULL) == 0 && stage->amount < 50);
+            break;
+        case POINT_BRIGHTNESS:
+            ok = nargs == 1 && parse_level (arg[0], &stage->amount, &stage->sign) == 0;
+            break;
+        case POINT_CONTRAST:
+            ok = nargs == 2 && parse_level (arg[0], &stage->threshold, NULL) == 0
+                 && parse_level (arg[1], &stage->amount, &stage->sign) == 0;
+            break;
+        case POINT_THRESHOLD:
+            ok = nargs == 1 && parse_level (arg[0], &stage->threshold, NULL) == 0;
+            break;
+        case POINT_CLAHE:
+            stage->size = 8;
+            stage->amount = 2;
+            ok = nargs <= 2 && (nargs < 1 || parse_level (arg[0], &stage->size, NULL) == 0)
+                 && (nargs < 2 || parse_level (arg[1], &stage->amount, NULL) == 0)
+                 && stage->size >= 1 && stage->size <= CLAHE_MAX_TILES;
+            break;
+        case POINT_GAUSSIAN:
+        case POINT_BOX:
+            stage->size = 1;
+            ok = nargs <= 1 && (nargs < 1 || parse_level (arg[0], &stage->size, NULL) == 0)
+                 && stage->size >= 1 && stage->size <= CONVOLVE_MAX_RADIUS;
+            break;
+        case POINT_SHARPEN:
+            stage->amount = 100;
+            stage->size = 1;
+            ok = nargs <= 2 && (nargs < 1 || parse_level (arg[0], &stage->amount, NULL) == 0)
+                 && (nargs < 2 || parse_level (arg[1], &stage->size, NULL) == 0)
+                 && stage->size >= 1 && stage->size <= CONVOLVE_MAX_RADIUS;
+            break;
+        case POINT_SOBEL:
+            ok = nargs == 0 || (nargs == 1 && (strcmp (arg[0], "x") == 0 || strcmp (arg[0], "y") == 0));
+            if (ok && nargs == 1) stage->amount = (arg[0][0] == 'x') ? 1 : 2;
+            break;
+        case POINT_CANNY:
+            stage->threshold = CANNY_LOW;
+            stage->amount = CANNY_HIGH;
+            ok = nargs <= 2 && (nargs < 1 || parse_number (arg[0], &stage->threshold, CANNY_MAX_LEVEL) == 0)
+                 && (nargs < 2 || parse_number (arg[1], &stage->amount, CANNY_MAX_LEVEL) == 0)
+                 && stage->threshold <= stage->amount;
+            break;
+        case POINT_MEDIAN:
+            stage->size = 1;
+            ok = nargs <= 1 && (nargs < 1 || parse_level (arg[0], &stage->size, NULL) == 0)
+                 && stage->size >= 1 && stage->size <= MEDIAN_MAX_RADIUS;
+            break;
+    }
+    if (!ok) {
+        printf("Error: %s is written %s", item, operations[op].spec);
+        if (op == POINT_STRETCH)
+            printf(", with a percent from 0 to 49");
+        else if (op == POINT_CLAHE)
+            printf(", with 1 to %d tiles and a clip from 0 to 255", CLAHE_MAX_TILES);
+        else if (op == POINT_GAUSSIAN || op == POINT_BOX)
+            printf(", with a radius from 1 to %d", CONVOLVE_MAX_RADIUS);
+        else if (op == POINT_SHARPEN)
+            printf(", with a percent from 0 to 255 and a radius from 1 to %d", CONVOLVE_MAX_RADIUS);
+        else if (op == POINT_CANNY)
+            printf(", with thresholds from 0 to %d, low no higher than high", CANNY_MAX_LEVEL);
+        else if (op == POINT_MEDIAN)
+            printf(", with a radius from 1 to %d", MEDIAN_MAX_RADIUS);
+        else if (op != POINT_SOBEL && strchr (operations[op].spec, ':'))
+            printf(", with levels and amounts from 0 to 255");
+        printf("\n");
+    }
+    return ok ? 0 : -1;
+}
+
+// Parse a pipeline spec (split up in place) into stages, which has room for
+// POINT_MAX_STAGES, and the chain's output size. Returns the number of stages, or -1
+// after printing what is wrong, which includes a chain too long for one plan.
+int parse_pipeline(char *spec, struct point_stage *stages, struct chain *chain) {
+    char *item, *next, *p;
+    int n = 0, resized = 0;
+    size_t len;
+    struct chain plan;
+    struct pipeline pipe;
+
+    for (p = spec; (p = strchr (p, '#')) != NULL; )
+        while (*p && *p != '\n')
+            *p++ = ' ';
+    for (item = spec; item; item = next) {
+        next = strpbrk (item, ",\n");
+        if (next) *next++ = '\0';
+        item += strspn (item, " \t\r");
+        for (len = strlen (item); len > 0 && strchr (" \t\r", item[len - 1]); len--)
+            item[len - 1] = '\0';
+        if (*item == '\0') continue;
+        if (resized) {
+            printf("Error: resize must be the last stage\n");
+            return -1;
+        }
+        if (strncmp (item, "resize:", 7) == 0) {
+            if (parse_size (item + 7, &chain->resize_width, &chain->resize_height) < 0) {
+                printf("Error: resize is written resize:<width>x<height>\n");
+                return -1;
+            }
+            resized = 1;
+            continue;
+        }
+        if (n == POINT_MAX_STAGES) {
+            printf("Error: a pipeline has at most %d stages\n", POINT_MAX_STAGES);
+            return -1;
+        }
+        if (parse_stage (item, &stages[n]) < 0) return -1;
+        n++;
+    }
+    if (n == 0 && !resized) {
+        printf("Error: the pipeline has no stages\n");
+        return -1;
+    }
+    // unfused, which never takes fewer steps than fused
+    plan = *chain;
+    plan.stages = stages;
+    plan.nstages = n;
+    plan.fused = 0;
+    if (chain_plan (&plan, &pipe, 1, 1, IMAGE_INTERLEAVED) < 0) {
+        printf("Error: too many stages, which run as more than %d steps (canny takes 4)\n", PIPELINE_MAX_STEPS);
+        return -1;
+    }
+    return n;
+}
+
+// Read a whole text file into a string. Returns NULL if it cannot be read.
+char *read_text_file(const char *filename) {
+    FILE *file = fopen (filename, "rb");
+    char *text = NULL;
+    long size;
+
+    if (file && fseek (file, 0, SEEK_END) == 0 && (size = ftell (file)) >= 0 && fseek (file, 0, SEEK_SET) == 0) {
+        text = malloc (size + 1);
+        if (text && fread (text, 1, size, file) == (size_t) size) {
+            text[size] = '\0';
+        } else {
+            free (text);
+            text = NULL;
+        }
+    }
+    if (file) fclose (file);
+    if (!text) printf("Error: could not read %s\n", filename);
+    return text;
+}
+
+void print_usage(void) {
+    printf("Usage: part1 [-d] [-v] [-u] [-k variant] [-w weights] [-j threads] [-l layout] [-s rows] [-p pipeline] [-r size] [-o pattern] [-H] [-n iterations] [-t format] <BMP file or directory>...\n");
+    printf("-d: produces debug output for each stage\n");
+    printf("-v: draws the input and output images on a video-out display\n");
+    printf("-u: runs each stage as a separate sweep instead of one fused lookup-table pass\n");
+    printf("-k: forces a kernel variant (avx512bw, avx2, sse2, neon or scalar) instead of the best one for this CPU\n");
+    printf("-w: channel weights of the gray level: average (default), bt601 or bt709\n");
+    printf("-j: number of threads, each processing a band of rows (default: one per CPU)\n");
+    printf("-l: works on interleaved or planar pixels (default: whichever the stages prefer)\n");
+    printf("-s: streams the image through in strips of this many rows instead of loading it whole\n");
+    printf("-p: the stages to run, e.g. gray,invert,brightness:+10,threshold:80 (default: gray,invert),\n");
+    printf("    or @file to read them from a file; also contrast:<level>:<+|-amount> and resize:<width>x<height>,\n");
+    printf("    and otsu, stretch[:<percent>] and equalize, which take their levels from the image,\n");
+    printf("    and clahe[:<tiles>[:<clip>]], which equalizes each tile of the image on its own,\n");
+    printf("    and gaussian[:<radius>], box[:<radius>], sharpen[:<percent>[:<radius>]], sobel[:x|y]\n");
+    printf("    and canny[:<low>[:<high>]], an edge map from gradient magnitudes over low linked to those over high,\n");
+    printf("    and median[:<radius>], which removes impulse noise\n");
+    printf("-r: writes the output resized to this size, e.g. 160x120 for a thumbnail\n");
+    printf("-o: output file name; %%n stands for the input name without extension, %%i for its number in the batch\n");
+    printf("    (default: edges.bmp, or edges_%%n.bmp for several inputs or a directory, which are processed as a batch)\n");
+    printf("-H: backs the image buffers with huge pages\n");
+    printf("-n: repeats the whole run (read, stages, write) and reports min, median and 99th percentile times\n");
+    printf("-t: prints the timing report as a table (default) or as json\n");
+}
+
+// Parse the number of option opt, from min to max. Returns -1 after printing what is
+// wrong and the usage.
+int parse_option(int opt, const char *text, int min, int max, int *value) {
+    if (parse_number (text, value, max) == 0 && *value >= min) return 0;
+    printf("Error: -%c takes a number from %d to %d\n", opt, min, max);
+    print_usage ();
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    //signed int *G_x, *G_y;
+    char *kernel_variant = NULL, *pattern = NULL, *spec = NULL, *text, **inputs;
+    int debug = 0, video = 0, unfused = 0, nthreads = thread_pool_cpus (), strip_rows = 0;
+    int iterations = 1, json = 0, iteration, status = 0, ninputs, batch_mode, i, huge = 0;
+    int ok, processed = 0, out_of_memory = 0, ready;
+    long long start, pixels, bytes;
+    int layout = -1;
+    struct timing timing = { 0 };
+    static struct point_program program;
+    static struct screen screen;
+    static struct chain_scratch scratch;
+    static struct job job;
+    static struct batch batch;
+    static struct image_pool buffers;
+    struct thread_pool *pool;
+    struct chain chain;
+
+    /********************************************
+    *          IMAGE PROCESSING STAGES          *
+    ********************************************/
+    // the default chain; -p replaces it
+    struct point_stage stages[POINT_MAX_STAGES] = {
+        { .op = POINT_GRAYSCALE },
+        { .op = POINT_INVERT },
+    };
+    int nstages = 2;
+    chain.stages = stages;
+    chain.fused = 0;
+    chain.program = NULL;
+    chain.resize_width = 0;
+    chain.resize_height = 0;
+    
+    // Check inputs
+    if (argc < 2) {
+        print_usage ();
+        return 0;
+    }
+    int opt;
+    while ((opt = getopt (argc, argv, "dvuk:w:j:l:s:p:r:o:Hn:t:")) != -1) {
+        switch (opt) {
+            case 'd':  
+                debug = 1;
+                break;  
+            case 'v':  
+                video = 1;
+                break;  
+            case 'u':
+                unfused = 1;
+                break;
+            case 'k':
+                kernel_variant = optarg;
+                break;
+            case 'w':
+                if (luma_select (optarg) < 0)
+                    return -1;
+                break;
+            case 'j':
+                if (parse_option (opt, optarg, 1, THREAD_POOL_MAX_THREADS, &nthreads) < 0)
+                    return -1;
+                break;
+            case 'l':
+                if (strcmp (optarg, "interleaved") != 0 && strcmp (optarg, "planar") != 0) {
+                    printf("Error: -l takes interleaved or planar\n");
+                    print_usage ();
+                    return -1;
+                }
+                layout = (strcmp (optarg, "planar") == 0) ? IMAGE_PLANAR : IMAGE_INTERLEAVED;
+                break;
+            case 's':
+                if (parse_option (opt, optarg, 1, INT_MAX, &strip_rows) < 0)
+                    return -1;
+                break;
+            case 'p':
+                spec = optarg;
+                break;
+            case 'r':
+                if (parse_size (optarg, &chain.resize_width, &chain.resize_height) < 0) {
+                    printf("Error: -r takes a size such as 160x120\n");
+                    return -1;
+                }
+                break;
+            case 'o':
+                pattern = optarg;
+                break;
+            case 'H':
+                huge = 1;
+                break;
+            case 'n':
+                if (parse_option (opt, optarg, 1, TIMING_MAX_ITERATIONS, &iterations) < 0)
+                    return -1;
+                break;
+            case 't':
+                if (strcmp (optarg, "table") != 0 && strcmp (optarg, "json") != 0) {
+                    printf("Error: -t takes table or json\n");
+                    print_usage ();
+                    return -1;
+                }
+                json = (strcmp (optarg, "json") == 0);
+                break;
+            case '?':  
+                printf("unknown option: %c\n", optopt); 
+                break;  
+        }  
+    }  
+    if (spec) {
+        text = (spec[0] == '@') ? read_text_file (spec + 1) : strdup (spec);
+        if (!text) return -1;
+        nstages = parse_pipeline (text, stages, &chain);
+        free (text);
+        if (nstages < 0) return -1;
+    }
+    chain.nstages = nstages;
+
+    // several files or a directory make a batch
+    if (optind >= argc) {
+        printf("Error: no input image\n");
+        return -1;
+    }
+    ninputs = list_inputs (argv + optind, argc - optind, &inputs);
+    if (ninputs < 0)
+        return -1;
+    if (ninputs == 0) {
+        printf("Error: no BMP files in %s\n", argv[optind]);
+        return -1;
+    }
+    batch_mode = ninputs > 1 || strcmp (inputs[0], argv[optind]) != 0;
+    if (!pattern) pattern = batch_mode ? "edges_%n.bmp" : "edges.bmp";
+
+    // the whole image is never in memory in strip mode, so there is nothing to debug,
+    // display, resize or measure
+    if (strip_rows > 0 && (debug || video || chain.resize_width > 0)) {
+        printf("Error: -s cannot be combined with -d, -v or -r\n");
+        status = -1;
+    }
+    for (i = 0; strip_rows > 0 && i < nstages && status == 0; i++) {
+        if (operations[stages[i].op].whole_image) {
+            printf("Error: -s cannot be combined with %s, which needs the whole image\n", operations[stages[i].op].name);
+            status = -1;
+        }
+    }
+    // Pick the kernels for this CPU (or the ones forced with -k)
+    if (status == 0 && kernel_dispatch_init (kernel_variant) < 0)
+        status = -1;
+    if (status < 0) {
+        for (i = 0; i < ninputs; i++)
+            free (inputs[i]);
+        free (inputs);
+        return -1;
+    }
+    if (debug) printf("KERNELS: %s\n", kernels->name);
+    if (debug) printf("LUMA: %s\n", luma->name);
+    // Start the worker threads once; every sweep below reuses them. From here on a
+    // failure skips the run and goes through the cleanup at the end.
+    pool = thread_pool_create (nthreads);
+    if (!pool) {
+        printf("Error: could not start worker threads\n");
+        status = -1;
+    }
+    if (layout < 0)
+        layout = choose_layout (stages, nstages, !(debug || unfused));
+    if (debug) printf("LAYOUT: %s\n", (layout == IMAGE_PLANAR) ? "planar" : "interleaved");
+    if (!(debug || unfused)) {
+        // the runs after an adaptive stage or a filter are compiled as they run
+        point_program_compile (&program, stages,
+                               (nstages > 0 && !point_stage_is_adaptive (&stages[0]) && !point_stage_is_filter (&stages[0]))
+                               ? chain_segment_length (&chain, 0) : 0);
+        chain.fused = 1;
+        chain.program = &program;
+    }
+    // video stays set only while the device is open
+    if (video && status == 0) {
+        if (!video_open ())
+        {
+            printf ("Error: could not open video device\n");
+            status = -1;
+            video = 0;
+        }
+        else
+            video_read (&screen.width, &screen.height, &screen.char_width, &screen.char_height);   // get VGA screen size
+    } else {
+        video = 0;
+    }
+    if (status == 0 && timing_init (&timing, iterations, NSLOTS) < 0) {
+        printf("Error: out of memory\n");
+        status = -1;
+    }
+    ready = status == 0;
+
+    // the buffers of every image are reused by the next one, across iterations too
+    image_pool_init (&buffers, BUFFER_POOL_LIMIT, huge);
+    job.buffers = &buffers;
+    batch.buffers = &buffers;
+    batch.in_names = inputs;
+    batch.count = ninputs;
+    batch.pattern = pattern;
+    batch.layout = layout;
+    batch.chain = &chain;
+    // an image that fails is reported and skipped; the run still fails at the end
+    for (iteration = 0; ready && iteration < timing.iterations && !out_of_memory; iteration++) {
+        start = timing_now ();
+        if (batch_mode && strip_rows == 0) {
+            if (run_batch (&batch, pool, &scratch, debug, video ? &screen : NULL, &timing) < 0) status = -1;
+            processed = ninputs - batch.read_failed - batch.process_failed;
+            pixels = batch.pixels;
+            bytes = batch.bytes;
+        } else {
+            // one image, or a batch of images too large to hold more than a strip of
+            processed = 0;
+            pixels = 0;
+            bytes = 0;
+            for (i = 0; i < ninputs; i++) {
+                job.in_name = inputs[i];
+                job.out_name = output_name (pattern, inputs[i], i);
+                if (!job.out_name) {
+                    printf("Error: out of memory\n");
+                    out_of_memory = 1;
+                    break;
+                }
+                if (strip_rows > 0) {
+                    ok = run_strips (&job, strip_rows, layout, pool, &chain, &timing) == 0;
+                    if (!ok) printf("Failed to process BMP %s\n", job.in_name);
+                } else {
+                    ok = run_image (&job, layout, pool, &chain, &scratch, debug, video ? &screen : NULL,
+                                    &timing) == 0;
+                }
+                free (job.out_name);
+                if (!ok) {
+                    status = -1;
+                    continue;
+                }
+                processed++;
+                pixels += (long long) job.width * job.height;
+                bytes += bmp_file_size (job.width, job.height);
+            }
+        }
+        timing_add (&timing, SLOT_CHAIN + chain_sweeps (&chain) + 1, "total", timing_now () - start, pixels, bytes);
+        timing_next (&timing);
+    }
+    if (out_of_memory) status = -1;
+    // the report covers the images that went through
+    if (!out_of_memory && processed > 0 && timing_report (&timing, stdout, json) < 0) printf("Error: out of memory\n");
+    if (debug) printf("buffers: %lld reused, %lld mapped\n", buffers.hits, buffers.misses);
+    image_pool_destroy (&buffers);
+    timing_free (&timing);
+    thread_pool_destroy (pool);
+    chain_scratch_free (&scratch);
+    for (i = 0; i < ninputs; i++)
+        free (inputs[i]);
+    free (inputs);
+    resize_plan_free (&screen.plan);
+    if (video) video_close ( );
+    
+    // if (video) {
+        // getchar ();
+        // draw_image (&image);
+        // video_close ( );
+    // }
+    return (status < 0) ? 1 : 0;
+}
+
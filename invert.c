@@ -4,7 +4,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef VIDEO_SW
+#include "video_sw.h"
+#else
 #include <intelfpgaup/video.h>
+#endif
+#include "cpu_dispatch.h"
 #define PI 3.141592654
 
 typedef unsigned char byte;
@@ -49,19 +54,8 @@ int read_bmp(char *filename, byte **header, struct pixel **data) {
 
 // Invert operation. Operate on the .r, .g, and .b fields of the pixels.
 void invert_operation(struct pixel **data) {
-    int x, y;
-
-    // Declare image as a 2-D array so that we can use the syntax image[row][column]
-    struct pixel (*image)[width] = (struct pixel (*)[width])*data;
-
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width; x++) {
-            // Subtract each channel's value from the maximum channel value (255) to invert the image
-            image[y][x].r = 255 - image[y][x].r;
-            image[y][x].g = 255 - image[y][x].g;
-            image[y][x].b = 255 - image[y][x].b;
-        }
-    }
+    // Subtract each channel's value from the maximum channel value (255) to invert the image
+    kernels->invert ((unsigned char *) *data, (size_t) width * height * 3);
 }
 
 // Write the grayscale image to disk. The 8-bit grayscale values should be inside the
@@ -136,18 +130,20 @@ int main(int argc, char *argv[]) {
     struct pixel *image;
     //signed int *G_x, *G_y;
     byte *header;
+    char *kernel_variant = NULL;
     int debug = 0, video = 0;
     time_t start, end;
     
     // Check inputs
     if (argc < 2) {
-        printf("Usage: part1 [-d] [-v] <BMP filename>\n");
+        printf("Usage: part1 [-d] [-v] [-k variant] <BMP filename>\n");
         printf("-d: produces debug output for each stage\n");
         printf("-v: draws the input and output images on a video-out display\n");
+        printf("-k: forces a kernel variant (avx512bw, avx2, sse2, neon or scalar) instead of the best one for this CPU\n");
         return 0;
     }
     int opt;
-    while ((opt = getopt (argc, argv, "dv")) != -1) {
+    while ((opt = getopt (argc, argv, "dvk:")) != -1) {
         switch (opt) {
             case 'd':  
                 debug = 1;
@@ -155,11 +151,18 @@ int main(int argc, char *argv[]) {
             case 'v':  
                 video = 1;
                 break;  
+            case 'k':
+                kernel_variant = optarg;
+                break;
             case '?':  
                 printf("unknown option: %c\n", optopt); 
                 break;  
         }  
     }  
+    // Pick the kernels for this CPU (or the ones forced with -k)
+    if (kernel_dispatch_init (kernel_variant) < 0)
+        return -1;
+    if (debug) printf("KERNELS: %s\n", kernels->name);
     // Open input image file (24-bit bitmap image)
     if (read_bmp (argv[optind], &header, &image) < 0) {
         printf("Failed to read BMP\n");
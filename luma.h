@@ -0,0 +1,92 @@
+// Fixed-point luminance of b, g, r pixels.
+//
+// Grayscale, contrast and threshold all need the gray level of a colour pixel. It is a
+// weighted sum of the channels, brought back to 0..255 with a multiply and a shift
+// rather than a divide (the Cortex-A9 has no divide instruction, so every / 3 was a
+// library call):
+//   sum   = wb * b + wg * g + wr * r
+//   gray  = ((sum + add) * mul) >> LUMA_SHIFT
+// Three sets of weights:
+//   average  (b + g + r) / 3, exactly: 0xaaab / 2^17 is close enough to 1/3 that the
+//            result is the truncated average for every sum up to 765
+//   bt601    0.114 b + 0.587 g + 0.299 r (SDTV), rounded, weights in 1/256ths
+//   bt709    0.0722 b + 0.7152 g + 0.2126 r (HDTV), likewise
+// Every sum fits in 16 bits, so the vector kernels keep it in 16-bit lanes, where the
+// multiply is a high-half multiply and a shift by LUMA_SHIFT - 16. Tests against a gray
+// level do not normalize at all: they compare the sum with the bound from luma_bound.
+//
+// The weights in use are global, like the kernel set: luma_select picks them once at
+// startup and every kernel reads them.
+#ifndef LUMA_H
+#define LUMA_H
+
+#include <stdio.h>
+#include <string.h>
+
+#define LUMA_SHIFT 17
+
+struct luma_weights {
+    const char *name;
+    int wb, wg, wr;
+    int add, mul;
+};
+
+static const struct luma_weights luma_weight_sets[] = {
+    { "average",  1,   1,  1,   0, 0xaaab },
+    { "bt601",   29, 150, 77, 128,    512 },
+    { "bt709",   19, 183, 54, 128,    512 },
+};
+
+#define LUMA_WEIGHT_SET_COUNT ((int) (sizeof(luma_weight_sets) / sizeof(luma_weight_sets[0])))
+
+// The weights in use; the plain average until luma_select is called
+static const struct luma_weights *luma = &luma_weight_sets[0];
+
+// Select the weights by name. Returns -1 if there is no such set.
+static inline int luma_select(const char *name) {
+    int i;
+
+    for (i = 0; i < LUMA_WEIGHT_SET_COUNT; i++) {
+        if (strcmp (name, luma_weight_sets[i].name) == 0) {
+            luma = &luma_weight_sets[i];
+            return 0;
+        }
+    }
+    printf ("Error: unknown luma weights %s (available:", name);
+    for (i = 0; i < LUMA_WEIGHT_SET_COUNT; i++)
+        printf (" %s", luma_weight_sets[i].name);
+    printf (")\n");
+    return -1;
+}
+
+// Largest weighted sum of 8-bit channels
+static inline int luma_sum_max(const struct luma_weights *l) {
+    return 255 * (l->wb + l->wg + l->wr);
+}
+
+// Are all the weights one? The sums are then plain channel sums, with no multiplies.
+static inline int luma_unit(const struct luma_weights *l) {
+    return l->wb == 1 && l->wg == 1 && l->wr == 1;
+}
+
+static inline int luma_sum(const struct luma_weights *l, int b, int g, int r) {
+    return l->wb * b + l->wg * g + l->wr * r;
+}
+
+// Gray level of a weighted sum
+static inline int luma_gray(const struct luma_weights *l, int sum) {
+    return ((sum + l->add) * l->mul) >> LUMA_SHIFT;
+}
+
+// Smallest sum whose gray level is at least level, so that gray >= level exactly when
+// sum >= luma_bound (level). luma_sum_max + 1 if no sum gets there.
+static inline int luma_bound(const struct luma_weights *l, int level) {
+    int bound;
+
+    if (level <= 0) return 0;
+    if (level > 255) return luma_sum_max(l) + 1;
+    bound = (int) ((((long long) level << LUMA_SHIFT) + l->mul - 1) / l->mul) - l->add;
+    return (bound < 0) ? 0 : bound;
+}
+
+#endif
@@ -0,0 +1,178 @@
+// Median filter, for impulse (salt-and-pepper) noise.
+//
+// Every output pixel is the median gray level of the (2 * radius + 1)^2 pixels around
+// it, with the rows and columns past the edges repeating the edge pixels. The cost per
+// pixel does not grow with the radius:
+//   radius 1    a network of min/max operations over the 3 x 3 window (median3 in
+//               simd_kernels.h), a whole vector of pixels at a time.
+//   radius > 1  Perreault and Hebert's sliding histograms. Every column keeps the
+//               histogram of its 2 * radius + 1 pixels in the window's rows, updated by
+//               one pixel out and one in as the window moves down a row, and the window's
+//               own histogram moves along the row by adding the column entering it and
+//               subtracting the one leaving. Each histogram is kept at two levels, 16
+//               coarse bins of 16 levels over 256 fine ones: the coarse window histogram
+//               is updated at every step and finds the 16 levels the median is among,
+//               and only those 16 fine bins are then brought up to date, from where
+//               they were last used. Updating them costs no more than recounting them,
+//               so every step is a fixed number of 16-bin operations.
+// Both read gray rows, padded at either end, from a ring of rows per band of the
+// thread pool, each made gray (if it is colour) and padded once. A band starts its
+// column histograms from the rows above its first one, so the bands share nothing.
+// The output is a gray image.
+#ifndef MEDIAN_H
+#define MEDIAN_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "cpu_dispatch.h"
+#include "image.h"
+#include "convolve.h"
+
+#define MEDIAN_MAX_RADIUS 127   // the window count, (2 * radius + 1)^2, must fit 16 bits
+
+struct median_plan {
+    int radius;
+    int width;
+    byte *lines;                // per band: a ring of 2 * radius + 2 padded rows
+    unsigned short *columns;    // per band (radius > 1): coarse, then fine column histograms
+    size_t lines_size, columns_size;    // bytes and shorts per band
+    int nbands;
+};
+
+static inline void median_plan_free(struct median_plan *plan) {
+    free (plan->lines);
+    free (plan->columns);
+    memset (plan, 0, sizeof(struct median_plan));
+}
+
+// Bytes of one padded row of the ring
+static inline size_t median_line_size(int width, int radius) {
+    return ((size_t) width + 2 * radius + 63) / 64 * 64;
+}
+
+// Plan for width-pixel rows with a window of the given radius and room for nbands
+// bands. The plan must start out zeroed; it is kept if it already fits. Returns -1 if
+// out of memory.
+static inline int median_plan_init(struct median_plan *plan, int width, int radius, int nbands) {
+    size_t padded = (size_t) width + 2 * radius;
+
+    if (plan->lines && plan->width == width && plan->radius == radius && plan->nbands >= nbands) return 0;
+    median_plan_free (plan);
+    plan->radius = radius;
+    plan->width = width;
+    plan->nbands = nbands;
+    plan->lines_size = median_line_size (width, radius) * (2 * radius + 2);
+    plan->columns_size = (radius > 1) ? padded * 16 + padded * 256 : 0;
+    plan->lines = malloc (plan->lines_size * nbands);
+    plan->columns = (radius > 1) ? malloc (sizeof(unsigned short) * plan->columns_size * nbands) : NULL;
+    if (!plan->lines || (radius > 1 && !plan->columns)) {
+        median_plan_free (plan);
+        return -1;
+    }
+    return 0;
+}
+
+// Padded gray row s (clamped to the image) of src, from the ring of band, loading it if
+// it is not there yet. held[] records which row each slot holds; rows needed at the same
+// time never share a slot, since at most 2 * radius + 2 consecutive rows are.
+static inline const byte *median_line(const struct median_plan *plan, const struct image *src, int *held, int band,
+                                      int s) {
+    int slots = 2 * plan->radius + 2, slot;
+    byte *line;
+
+    s = (s < 0) ? 0 : ((s >= src->height) ? src->height - 1 : s);
+    slot = s % slots;
+    line = plan->lines + plan->lines_size * band + median_line_size (src->width, plan->radius) * slot;
+    if (held[slot] != s) {
+        convolve_load (line, src, s, plan->radius);
+        held[slot] = s;
+    }
+    return line;
+}
+
+// Add (sign 1) or remove (sign -1) a padded row of pixels to the column histograms:
+// coarse is 16 bins per column, fine 16 bins per column for each coarse bin in turn,
+// so that one coarse bin of consecutive columns is contiguous
+static inline void median_count(unsigned short *coarse, unsigned short *fine, size_t padded, const byte *line,
+                                int sign) {
+    size_t c;
+
+    for (c = 0; c < padded; c++) {
+        coarse[c * 16 + (line[c] >> 4)] += sign;
+        fine[((line[c] >> 4) * padded + c) * 16 + (line[c] & 15)] += sign;
+    }
+}
+
+// Medians of row y from the column histograms, which hold the window's rows
+static inline void median_row(const unsigned short *coarse, const unsigned short *fine, size_t padded, int radius,
+                              byte *out, int width) {
+    const int taps = 2 * radius + 1, rank = taps * taps / 2;
+    const unsigned short *column;
+    unsigned short window[16], bins[16][16];
+    int last[16], x, c, k, v, below;
+
+    memset (window, 0, sizeof(window));
+    for (c = 0; c < taps; c++)
+        for (v = 0; v < 16; v++)
+            window[v] += coarse[c * 16 + v];
+    for (k = 0; k < 16; k++)
+        last[k] = -taps - 1;
+    for (x = 0; x < width; x++) {
+        for (k = 0, below = 0; below + window[k] <= rank; k++)
+            below += window[k];
+        // bring the fine bins of coarse bin k from column last[k] to x, or recount them
+        // if that is less work
+        column = fine + (size_t) k * padded * 16;
+        if (x - last[k] > taps) {
+            memset (bins[k], 0, sizeof(bins[k]));
+            for (c = x; c < x + taps; c++)
+                for (v = 0; v < 16; v++)
+                    bins[k][v] += column[c * 16 + v];
+        } else {
+            for (c = last[k]; c < x; c++)
+                for (v = 0; v < 16; v++)
+                    bins[k][v] += column[(c + taps) * 16 + v] - column[c * 16 + v];
+        }
+        last[k] = x;
+        for (v = 0; below + bins[k][v] <= rank; v++)
+            below += bins[k][v];
+        out[x] = (byte) (k * 16 + v);
+        if (x + 1 < width)
+            for (v = 0; v < 16; v++)
+                window[v] += coarse[(x + taps) * 16 + v] - coarse[x * 16 + v];
+    }
+}
+
+// Filter rows [y0, y1) of src into the rows of dst, a gray image of the same size, with
+// the ring and histograms of band
+static inline void median_rows(const struct median_plan *plan, const struct image *src, struct image *dst, int y0,
+                               int y1, int band) {
+    int radius = plan->radius, held[2 * MEDIAN_MAX_RADIUS + 2], y, s;
+    size_t padded = (size_t) src->width + 2 * radius;
+    unsigned short *coarse, *fine;
+    const byte *rows[3];
+
+    for (s = 0; s < 2 * radius + 2; s++)
+        held[s] = -1;
+    if (radius == 1) {
+        for (y = y0; y < y1; y++) {
+            for (s = 0; s < 3; s++)
+                rows[s] = median_line (plan, src, held, band, y + s - 1);
+            kernels->median3 (rows, image_row (dst, 0, y), src->width);
+        }
+        return;
+    }
+    // the column histograms of the window of the row above the band, then move down
+    coarse = plan->columns + plan->columns_size * band;
+    fine = coarse + padded * 16;
+    memset (coarse, 0, sizeof(unsigned short) * plan->columns_size);
+    for (s = y0 - 1 - radius; s < y0 + radius; s++)
+        median_count (coarse, fine, padded, median_line (plan, src, held, band, s), 1);
+    for (y = y0; y < y1; y++) {
+        median_count (coarse, fine, padded, median_line (plan, src, held, band, y - 1 - radius), -1);
+        median_count (coarse, fine, padded, median_line (plan, src, held, band, y + radius), 1);
+        median_row (coarse, fine, padded, radius, image_row (dst, 0, y), src->width);
+    }
+}
+
+#endif
@@ -0,0 +1,21 @@
+// Parsing of the numbers given on the command line, shared by the program and the
+// benchmark so that both take the same forms: plain decimal digits, no sign, nothing
+// after them.
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdlib.h>
+
+// Parse a number from 0 to max. Returns -1 if text is not one.
+static inline int parse_number(const char *text, int *value, int max) {
+    char *end;
+    long v;
+
+    if (*text < '0' || *text > '9') return -1;
+    v = strtol (text, &end, 10);
+    if (*end != '\0' || v > max) return -1;
+    *value = (int) v;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,138 @@
+// Buffer planning for a chain of stages.
+//
+// Every stage either works in place, rewriting the image it is given (the point
+// operations), or needs an image of its own to write into: grayscale writes a gray
+// plane, a resize an image of another size, and a neighbourhood filter cannot
+// overwrite rows it still has to read. A plan walks the stages once per input size,
+// tracking the size and layout of the image after each one, and gives every
+// out-of-place stage an output buffer.
+//
+// The chain is a straight line, so the only image still needed at any point is the one
+// the next stage reads; any buffer of the right size and layout that is not that image
+// can be written over. Out-of-place stages of one shape in a row therefore ping-pong
+// between two buffers, the input image being one of them, however long the chain is.
+//
+// The plan lives in the caller's memory and making it allocates nothing. The buffers it
+// asks for are all taken at once, before the first stage runs (pipeline_alloc), so the
+// chain itself runs without allocating.
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string.h>
+#include "image.h"
+#include "image_pool.h"
+
+#define PIPELINE_INPUT -1       // buffer number of the input image
+#define PIPELINE_MAX_STEPS 32
+#define PIPELINE_MAX_BUFFERS 8
+
+struct pipeline_shape {
+    int width, height;
+    enum image_layout layout;
+};
+
+struct pipeline_step {
+    int op;                     // what the stage does, up to the caller that runs it
+    const void *arg;            // and its parameters
+    int in_place;
+    int src, dst;               // buffers read and written (equal if in place)
+    struct pipeline_shape out;  // size and layout of the output
+};
+
+struct pipeline {
+    struct pipeline_shape input;
+    struct pipeline_step step[PIPELINE_MAX_STEPS];
+    int nsteps;
+    struct pipeline_shape buffer[PIPELINE_MAX_BUFFERS];
+    int nbuffers;
+    int result;                 // buffer holding the output of the last step
+};
+
+static int pipeline_shape_equal(const struct pipeline_shape *a, const struct pipeline_shape *b) {
+    return a->width == b->width && a->height == b->height && a->layout == b->layout;
+}
+
+// Start a plan for an input of width x height pixels in layout
+static void pipeline_begin(struct pipeline *p, int width, int height, enum image_layout layout) {
+    memset (p, 0, sizeof(struct pipeline));
+    p->input.width = width;
+    p->input.height = height;
+    p->input.layout = layout;
+    p->result = PIPELINE_INPUT;
+}
+
+// Size and layout of the image the next step will read
+static const struct pipeline_shape *pipeline_current(const struct pipeline *p) {
+    return (p->result == PIPELINE_INPUT) ? &p->input : &p->buffer[p->result];
+}
+
+// Append a step. An in-place step keeps the current size and layout; the others write
+// a width x height image in layout. Returns -1 if the chain is too long or needs more
+// than PIPELINE_MAX_BUFFERS buffers.
+static int pipeline_add(struct pipeline *p, int op, const void *arg, int in_place, int width, int height,
+                        enum image_layout layout) {
+    struct pipeline_step *step;
+    struct pipeline_shape out;
+    int b;
+
+    if (p->nsteps == PIPELINE_MAX_STEPS) return -1;
+    if (in_place) {
+        out = *pipeline_current (p);
+    } else {
+        out.width = width;
+        out.height = height;
+        out.layout = layout;
+    }
+    step = &p->step[p->nsteps];
+    step->op = op;
+    step->arg = arg;
+    step->in_place = in_place;
+    step->src = p->result;
+    step->out = out;
+    if (in_place) {
+        step->dst = step->src;
+    } else {
+        // any buffer of the same shape except the one being read
+        step->dst = p->nbuffers;
+        if (step->src != PIPELINE_INPUT && pipeline_shape_equal (&p->input, &out)) step->dst = PIPELINE_INPUT;
+        for (b = 0; b < p->nbuffers && step->dst == p->nbuffers; b++)
+            if (b != step->src && pipeline_shape_equal (&p->buffer[b], &out)) step->dst = b;
+        if (step->dst == p->nbuffers) {
+            if (p->nbuffers == PIPELINE_MAX_BUFFERS) return -1;
+            p->buffer[p->nbuffers++] = out;
+        }
+    }
+    p->result = step->dst;
+    p->nsteps++;
+    return 0;
+}
+
+// The image behind buffer number b, given the input and the buffers from pipeline_alloc
+static struct image *pipeline_image(struct image *input, struct image *buffers, int b) {
+    return (b == PIPELINE_INPUT) ? input : &buffers[b];
+}
+
+// Give back the buffers of a plan (from pipeline_alloc), except buffer number keep
+static void pipeline_release(const struct pipeline *p, struct image *buffers, int keep) {
+    int b;
+
+    for (b = 0; b < p->nbuffers; b++)
+        if (b != keep) image_release (&buffers[b]);
+}
+
+// Take every buffer of the plan, from pool (malloc if NULL). Returns -1 if out of memory,
+// having given back the ones it got.
+static int pipeline_alloc(const struct pipeline *p, struct image *buffers, struct image_pool *pool) {
+    int b;
+
+    memset (buffers, 0, sizeof(struct image) * PIPELINE_MAX_BUFFERS);
+    for (b = 0; b < p->nbuffers; b++) {
+        if (image_pool_alloc (pool, &buffers[b], p->buffer[b].width, p->buffer[b].height, p->buffer[b].layout) < 0) {
+            pipeline_release (p, buffers, PIPELINE_INPUT);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#endif
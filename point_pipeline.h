@@ -0,0 +1,394 @@
+// Point-operation pipeline compiler.
+//
+// Grayscale, invert, brightness, contrast and threshold only ever look at one pixel,
+// so any chain of them can be folded into lookup tables and applied in a single
+// sweep over the image instead of one sweep per stage.
+//
+// A chain compiles into one or more passes. Most chains need exactly one:
+//   PASS_CHANNEL  out[c] = pre[c][in[c]]      (invert, brightness, stretch, equalize)
+//   PASS_LUMA     out[*] = post[gray(sum[b][b] + sum[g][g] + sum[r][r])]
+//                 (grayscale, threshold, otsu and everything after them; sum[] holds the
+//                 channel maps times the luma weights, and gray() is the multiply and
+//                 shift of luma.h; for the plain average the sums are small enough to
+//                 index post[] directly, with the normalization folded into the table)
+//   PASS_SPLIT    out[c] = mask[gray] ? hi[c][in[c]] : lo[c][in[c]]
+//                 (contrast on a colour image, where the decision depends on the
+//                 pixel's gray level but the adjustment is applied per channel)
+// A new pass is only started when a stage cannot be folded into the current one,
+// e.g. a contrast or threshold following a contrast on a colour image.
+// A program whose last pass is a luma pass produces a gray image, so it can write a
+// single gray plane instead of the same value three times.
+//
+// Otsu, stretch and equalize are point operations as well, but their threshold or maps
+// come from the histogram of the image they are applied to (histogram.h). Such an
+// adaptive stage can only be compiled once its parameters have been filled in, so the
+// caller splits the chain in front of it and compiles the rest of the chain after
+// measuring the image.
+//
+// A chain may also hold neighbourhood stages such as CLAHE or a blur, which look at
+// other pixels than the one they write. Those cannot be folded at all: the caller runs
+// each of them as a step of its own and splits the chain around it, so they never reach
+// the compiler.
+#ifndef POINT_PIPELINE_H
+#define POINT_PIPELINE_H
+
+#include <stddef.h>
+#include <string.h>
+#include "luma.h"
+
+#define POINT_MAX_STAGES 16
+#define POINT_SUM_INDEX_MAX 765     // largest sum that indexes post[] and mask[] directly
+
+enum point_op {
+    POINT_GRAYSCALE,
+    POINT_INVERT,
+    POINT_BRIGHTNESS,
+    POINT_CONTRAST,
+    POINT_THRESHOLD,
+    POINT_OTSU,         // threshold at the level that best splits the gray levels in two
+    POINT_STRETCH,      // stretch the levels between two percentiles over the whole range
+    POINT_EQUALIZE,     // spread the gray levels evenly over the whole range
+    POINT_CLAHE,        // equalize each tile of the image by its own histogram (clahe.h)
+    POINT_GAUSSIAN,     // the convolutions of convolve.h
+    POINT_BOX,
+    POINT_SHARPEN,
+    POINT_SOBEL,
+    POINT_CANNY,        // edges from the sobel derivatives of a blur (canny.h)
+    POINT_MEDIAN        // the median of each pixel's neighbourhood (median.h)
+};
+
+// One stage of a chain. Unused fields are ignored by the stage.
+struct point_stage {
+    enum point_op op;
+    int threshold;  // contrast, threshold, otsu: grayscale level to compare against; canny: low gradient threshold
+    int amount;     // brightness, contrast: value added or subtracted; stretch: percent clipped at each end;
+                    // clahe: clip limit, in multiples of the mean bin count; sharpen: percent of the
+                    // difference from the blur added; sobel: 0 for both derivatives, 1 for x, 2 for y;
+                    // canny: high gradient threshold
+    int sign;       // brightness, contrast: 1 = add (above threshold), 0 = subtract (below)
+    int size;       // clahe: tiles across and down; gaussian, box, sharpen, median: radius
+    const unsigned char (*map)[256];    // stretch, equalize: the b, g and r maps
+};
+
+enum point_pass_kind {
+    PASS_CHANNEL,
+    PASS_LUMA,
+    PASS_SPLIT
+};
+
+struct point_pass {
+    enum point_pass_kind kind;
+    unsigned char pre[3][256];              // channel maps indexed by b, g, r input values
+    const struct luma_weights *luma;        // PASS_LUMA, PASS_SPLIT: weights of the gray level
+    unsigned short sum[3][256];             // PASS_LUMA, PASS_SPLIT: pre[] times the channel weights
+    int by_sum;                             // post[] and mask[] are indexed by sum, not gray level
+    unsigned char post[POINT_SUM_INDEX_MAX + 1];    // PASS_LUMA: gray output
+    unsigned char mask[POINT_SUM_INDEX_MAX + 1];    // PASS_SPLIT: 1 where hi[] applies
+    unsigned char hi[3][256];               // PASS_SPLIT: channel maps when mask is set
+    unsigned char lo[3][256];               // PASS_SPLIT: channel maps when mask is clear
+};
+
+struct point_program {
+    int npasses;
+    struct point_pass pass[POINT_MAX_STAGES + 1];
+};
+
+static inline int point_clamp(int v) {
+    return (v < 0) ? 0 : ((v > 255) ? 255 : v);
+}
+
+// Does the stage take its parameters from the image's histogram?
+static inline int point_stage_is_adaptive(const struct point_stage *s) {
+    return s->op == POINT_OTSU || s->op == POINT_STRETCH || s->op == POINT_EQUALIZE;
+}
+
+// Does the stage look at neighbouring pixels, so that it cannot be folded?
+static inline int point_stage_is_filter(const struct point_stage *s) {
+    return s->op == POINT_CLAHE || s->op == POINT_GAUSSIAN || s->op == POINT_BOX || s->op == POINT_SHARPEN
+           || s->op == POINT_SOBEL || s->op == POINT_CANNY || s->op == POINT_MEDIAN;
+}
+
+// Value of channel c (0 = b, 1 = g, 2 = r) after an invert, brightness, contrast,
+// stretch or equalize adjustment
+static inline int point_channel_eval(const struct point_stage *s, int c, int v) {
+    switch (s->op) {
+        case POINT_INVERT:
+            return 255 - v;
+        case POINT_BRIGHTNESS:
+        case POINT_CONTRAST:
+            return point_clamp(s->sign == 1 ? v + s->amount : v - s->amount);
+        case POINT_STRETCH:
+        case POINT_EQUALIZE:
+            return s->map[c][v];
+        default:
+            return v;
+    }
+}
+
+// Does contrast apply to a pixel whose gray level is gray?
+static inline int point_contrast_selects(const struct point_stage *s, int gray) {
+    return (s->sign == 1) ? (gray > s->threshold) : (gray < s->threshold);
+}
+
+// Value of a gray pixel (all channels equal) after the stage. The maps of a stage
+// measured on a gray image are all the same, so the b map stands for the three.
+static inline int point_gray_eval(const struct point_stage *s, int v) {
+    switch (s->op) {
+        case POINT_GRAYSCALE:
+            return v;
+        case POINT_THRESHOLD:
+        case POINT_OTSU:
+            return (v < s->threshold) ? 0 : 255;
+        case POINT_CONTRAST:
+            return point_contrast_selects(s, v) ? point_channel_eval(s, 0, v) : v;
+        default:
+            return point_channel_eval(s, 0, v);
+    }
+}
+
+// Does a program of these stages leave a gray image behind? The same answer as
+// point_program_is_gray gives for the compiled program: once a pass turns luma it
+// takes every later stage, and only a gray-making stage starts one.
+static inline int point_stages_make_gray(const struct point_stage *stages, int nstages) {
+    int i;
+
+    for (i = 0; i < nstages; i++)
+        if (stages[i].op == POINT_GRAYSCALE || stages[i].op == POINT_THRESHOLD || stages[i].op == POINT_OTSU)
+            return 1;
+    return 0;
+}
+
+static void point_pass_reset(struct point_pass *p) {
+    int c, v;
+
+    p->kind = PASS_CHANNEL;
+    p->luma = luma;
+    p->by_sum = 0;
+    for (c = 0; c < 3; c++)
+        for (v = 0; v < 256; v++)
+            p->pre[c][v] = v;
+}
+
+// Entries of post[] and mask[] in use
+static inline int point_pass_entries(const struct point_pass *p) {
+    return p->by_sum ? luma_sum_max(p->luma) + 1 : 256;
+}
+
+// Gray level of entry i of post[] and mask[]
+static inline int point_pass_level(const struct point_pass *p, int i) {
+    return p->by_sum ? luma_gray(p->luma, i) : i;
+}
+
+// Weigh the current channel maps with the pass's luma weights, for a pass that needs
+// the gray level
+static void point_pass_weigh(struct point_pass *p) {
+    int v;
+
+    p->by_sum = luma_sum_max(p->luma) <= POINT_SUM_INDEX_MAX;
+    for (v = 0; v < 256; v++) {
+        p->sum[0][v] = p->luma->wb * p->pre[0][v];
+        p->sum[1][v] = p->luma->wg * p->pre[1][v];
+        p->sum[2][v] = p->luma->wr * p->pre[2][v];
+    }
+}
+
+// Turn a channel pass into a luma pass: the current channel maps feed the gray level
+static void point_pass_to_luma(struct point_pass *p) {
+    int i;
+
+    p->kind = PASS_LUMA;
+    point_pass_weigh(p);
+    for (i = 0; i < point_pass_entries(p); i++)
+        p->post[i] = point_pass_level(p, i);
+}
+
+// Fold one stage into the current pass. Returns 0 if the stage needs a fresh pass.
+static int point_pass_fold(struct point_pass *p, const struct point_stage *s) {
+    int c, v, i;
+
+    if (p->kind == PASS_CHANNEL) {
+        switch (s->op) {
+            case POINT_INVERT:
+            case POINT_BRIGHTNESS:
+            case POINT_STRETCH:
+            case POINT_EQUALIZE:
+                for (c = 0; c < 3; c++)
+                    for (v = 0; v < 256; v++)
+                        p->pre[c][v] = point_channel_eval(s, c, p->pre[c][v]);
+                return 1;
+            case POINT_GRAYSCALE:
+            case POINT_THRESHOLD:
+            case POINT_OTSU:
+                point_pass_to_luma(p);
+                return point_pass_fold(p, s);
+            case POINT_CONTRAST:
+                p->kind = PASS_SPLIT;
+                point_pass_weigh(p);
+                for (i = 0; i < point_pass_entries(p); i++)
+                    p->mask[i] = point_contrast_selects(s, point_pass_level(p, i));
+                for (c = 0; c < 3; c++) {
+                    for (v = 0; v < 256; v++) {
+                        p->lo[c][v] = p->pre[c][v];
+                        p->hi[c][v] = point_channel_eval(s, c, p->pre[c][v]);
+                    }
+                }
+                return 1;
+            default:
+                return 1;   // filters are run by the caller, never folded
+        }
+    }
+    if (p->kind == PASS_LUMA) {
+        // every channel holds the same gray value, so each stage is a map of that value
+        for (i = 0; i < point_pass_entries(p); i++)
+            p->post[i] = point_gray_eval(s, p->post[i]);
+        return 1;
+    }
+    // PASS_SPLIT: only channel-wise stages can be composed onto both sides of the split
+    if (s->op != POINT_INVERT && s->op != POINT_BRIGHTNESS && s->op != POINT_STRETCH && s->op != POINT_EQUALIZE)
+        return 0;
+    for (c = 0; c < 3; c++) {
+        for (v = 0; v < 256; v++) {
+            p->hi[c][v] = point_channel_eval(s, c, p->hi[c][v]);
+            p->lo[c][v] = point_channel_eval(s, c, p->lo[c][v]);
+        }
+    }
+    return 1;
+}
+
+// Compile a chain of stages into as few passes as possible.
+// Returns the number of passes, or -1 if the chain is too long.
+static int point_program_compile(struct point_program *prog, const struct point_stage *stages, int nstages) {
+    int i;
+    struct point_pass *p;
+
+    if (nstages > POINT_MAX_STAGES) return -1;
+    prog->npasses = 1;
+    p = &prog->pass[0];
+    point_pass_reset(p);
+    for (i = 0; i < nstages; i++) {
+        if (point_pass_fold(p, &stages[i])) continue;
+        // a split pass leaves a colour image behind, so start over from a channel pass
+        p = &prog->pass[prog->npasses++];
+        point_pass_reset(p);
+        point_pass_fold(p, &stages[i]);
+    }
+    return prog->npasses;
+}
+
+// The pass loops are generated once for each pixel step, 3 for interleaved pixels and
+// 1 for separate planes, so the stride is a constant the compiler can fold into the
+// addressing, and once for each way of indexing post[] and mask[] (INDEX turns a sum
+// into an index). A split pass picks its table set from the mask rather than branching
+// on it: which side a pixel falls on follows the image content and predicts badly.
+#define POINT_BY_SUM(l, sum) ((void) (l), (sum))
+#define POINT_BY_GRAY(l, sum) luma_gray(l, sum)
+
+#define POINT_PASS_KERNELS(suffix, STEP, INDEX)                                             \
+static void point_pass_apply_##suffix(const struct point_pass *p, unsigned char *b, unsigned char *g,  \
+                                      unsigned char *r, size_t npixels) {                   \
+    const struct luma_weights l = *p->luma;                                                 \
+    const unsigned char (*map)[256];                                                        \
+    size_t i, end = npixels * (STEP);                                                       \
+    unsigned char out;                                                                      \
+                                                                                            \
+    switch (p->kind) {                                                                      \
+        case PASS_CHANNEL:                                                                  \
+            for (i = 0; i < end; i += (STEP)) {                                             \
+                b[i] = p->pre[0][b[i]];                                                     \
+                g[i] = p->pre[1][g[i]];                                                     \
+                r[i] = p->pre[2][r[i]];                                                     \
+            }                                                                               \
+            break;                                                                          \
+        case PASS_LUMA:                                                                     \
+            for (i = 0; i < end; i += (STEP)) {                                             \
+                out = p->post[INDEX(&l, p->sum[0][b[i]] + p->sum[1][g[i]] + p->sum[2][r[i]])];  \
+                b[i] = out;                                                                 \
+                g[i] = out;                                                                 \
+                r[i] = out;                                                                 \
+            }                                                                               \
+            break;                                                                          \
+        case PASS_SPLIT:                                                                    \
+            for (i = 0; i < end; i += (STEP)) {                                             \
+                map = p->mask[INDEX(&l, p->sum[0][b[i]] + p->sum[1][g[i]] + p->sum[2][r[i]])]  \
+                      ? p->hi : p->lo;                                                      \
+                b[i] = map[0][b[i]];                                                        \
+                g[i] = map[1][g[i]];                                                        \
+                r[i] = map[2][r[i]];                                                        \
+            }                                                                               \
+            break;                                                                          \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+static void point_pass_apply_gray_##suffix(const struct point_pass *p, const unsigned char *b,  \
+                                           const unsigned char *g, const unsigned char *r,  \
+                                           size_t npixels, unsigned char *gray) {           \
+    const struct luma_weights l = *p->luma;                                                 \
+    size_t i;                                                                               \
+                                                                                            \
+    for (i = 0; i < npixels; i++, b += (STEP), g += (STEP), r += (STEP))                    \
+        gray[i] = p->post[INDEX(&l, p->sum[0][*b] + p->sum[1][*g] + p->sum[2][*r])];        \
+}
+
+POINT_PASS_KERNELS(interleaved_by_sum, 3, POINT_BY_SUM)
+POINT_PASS_KERNELS(planar_by_sum, 1, POINT_BY_SUM)
+POINT_PASS_KERNELS(interleaved_by_gray, 3, POINT_BY_GRAY)
+POINT_PASS_KERNELS(planar_by_gray, 1, POINT_BY_GRAY)
+
+// Apply one pass to npixels pixels. b, g and r point at the first pixel's channels and
+// step is the distance between pixels: 3 for interleaved pixels, 1 for separate planes.
+static void point_pass_apply(const struct point_pass *p, unsigned char *b, unsigned char *g, unsigned char *r,
+                             size_t step, size_t npixels) {
+    if (step == 3 && p->by_sum)
+        point_pass_apply_interleaved_by_sum(p, b, g, r, npixels);
+    else if (step == 3)
+        point_pass_apply_interleaved_by_gray(p, b, g, r, npixels);
+    else if (p->by_sum)
+        point_pass_apply_planar_by_sum(p, b, g, r, npixels);
+    else
+        point_pass_apply_planar_by_gray(p, b, g, r, npixels);
+}
+
+// Apply a luma pass and store the result in a separate gray plane
+static void point_pass_apply_gray(const struct point_pass *p, const unsigned char *b, const unsigned char *g,
+                                  const unsigned char *r, size_t step, size_t npixels, unsigned char *gray) {
+    if (step == 3 && p->by_sum)
+        point_pass_apply_gray_interleaved_by_sum(p, b, g, r, npixels, gray);
+    else if (step == 3)
+        point_pass_apply_gray_interleaved_by_gray(p, b, g, r, npixels, gray);
+    else if (p->by_sum)
+        point_pass_apply_gray_planar_by_sum(p, b, g, r, npixels, gray);
+    else
+        point_pass_apply_gray_planar_by_gray(p, b, g, r, npixels, gray);
+}
+
+// Does the program leave a gray image behind?
+static inline int point_program_is_gray(const struct point_program *prog) {
+    return prog->pass[prog->npasses - 1].kind == PASS_LUMA;
+}
+
+// Pixels per block when a program has more than one pass; small enough that the block
+// stays in L1 between passes, so the image is still read and written only once.
+#define POINT_BLOCK_PIXELS 4096
+
+// Run a compiled program over npixels pixels in one sweep (channel pointers and step
+// as for point_pass_apply). If gray is not NULL the program must be a gray one; its
+// last pass then writes gray instead of b, g and r.
+static void point_program_apply(const struct point_program *prog, unsigned char *b, unsigned char *g, unsigned char *r,
+                                size_t step, size_t npixels, unsigned char *gray) {
+    size_t start, n, offset;
+    int i, last = prog->npasses - 1;
+
+    for (start = 0; start < npixels; start += n) {
+        n = npixels - start;
+        if (n > POINT_BLOCK_PIXELS && prog->npasses > 1) n = POINT_BLOCK_PIXELS;
+        offset = start * step;
+        for (i = 0; i < last; i++)
+            point_pass_apply(&prog->pass[i], b + offset, g + offset, r + offset, step, n);
+        if (gray)
+            point_pass_apply_gray(&prog->pass[last], b + offset, g + offset, r + offset, step, n, gray + start);
+        else
+            point_pass_apply(&prog->pass[last], b + offset, g + offset, r + offset, step, n);
+    }
+}
+
+#endif
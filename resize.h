@@ -0,0 +1,220 @@
+// Arbitrary-ratio image resizing.
+//
+// The resize is separable. Every source row is first resized horizontally into a row
+// of 16-bit samples; each output row is then a weighted sum of a few of those rows
+// (the vertical pass, vectorized in simd_kernels.h). Two filters:
+//   RESIZE_AREA      each output pixel is the average of the source area it covers,
+//                    with pixels on the edge of that area weighted by how much of them
+//                    it covers; the right choice for shrinking
+//   RESIZE_BILINEAR  linear interpolation between the two nearest source pixels on each
+//                    axis, sampled at pixel centres; the right choice for enlarging
+// The weights of every output column and row depend only on the sizes, so they are
+// computed once into a plan and reused for every image of those sizes. Horizontally
+// resized rows are kept in a small ring, so each source row is resized only once however
+// many output rows it contributes to. The plan can also hold the rings, one per band
+// resized at the same time, so resizing image after image allocates nothing.
+#ifndef RESIZE_H
+#define RESIZE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "cpu_dispatch.h"
+#include "image.h"
+
+enum resize_filter {
+    RESIZE_AREA,
+    RESIZE_BILINEAR
+};
+
+// Weights along one axis
+struct resize_axis {
+    int in, out;
+    int taps;           // most source samples any output uses
+    int *start;         // first source sample of each output
+    int *count;         // source samples each output uses, at most taps
+    short *weight;      // taps weights per output, RESIZE_WEIGHT_BITS fraction bits, adding up to one
+};
+
+struct resize_plan {
+    enum resize_filter filter;
+    struct resize_axis x, y;
+    short *rings;       // scratch for resize_rows, see resize_plan_rings
+    size_t ring_size;   // shorts in each ring
+    int nrings;
+};
+
+// Area for shrinking, bilinear as soon as either axis grows
+static inline enum resize_filter resize_filter_for(int in_width, int in_height, int out_width, int out_height) {
+    return (out_width <= in_width && out_height <= in_height) ? RESIZE_AREA : RESIZE_BILINEAR;
+}
+
+static inline void resize_axis_free(struct resize_axis *ax) {
+    free (ax->start);
+    free (ax->count);
+    free (ax->weight);
+    memset (ax, 0, sizeof(struct resize_axis));
+}
+
+// Returns -1 if out of memory
+static inline int resize_axis_init(struct resize_axis *ax, int in, int out, enum resize_filter filter) {
+    double scale = (double) in / out, lo, hi, centre, w;
+    double acc[(filter == RESIZE_AREA) ? (in + out - 1) / out + 1 : 2];
+    int o, s, k, first, base, last, lead, sum, largest, one = 1 << RESIZE_WEIGHT_BITS;
+    short *q;
+
+    memset (ax, 0, sizeof(struct resize_axis));
+    ax->in = in;
+    ax->out = out;
+    ax->taps = sizeof(acc) / sizeof(acc[0]);
+    ax->start = malloc (sizeof(int) * out);
+    ax->count = malloc (sizeof(int) * out);
+    ax->weight = calloc ((size_t) out * ax->taps, sizeof(short));
+    if (!ax->start || !ax->count || !ax->weight) {
+        resize_axis_free (ax);
+        return -1;
+    }
+    for (o = 0; o < out; o++) {
+        memset (acc, 0, sizeof(acc));
+        // source samples and their weights; samples off either end are clamped to the
+        // edge, which is where their weight is added
+        if (filter == RESIZE_AREA) {
+            lo = o * scale;
+            hi = (o + 1) * scale;
+            first = (int) lo;
+            base = (first < in) ? first : in - 1;
+            for (s = first; s < hi && s - first < ax->taps; s++) {
+                w = (((hi < s + 1) ? hi : s + 1) - ((lo > s) ? lo : s)) / scale;
+                acc[((s < in) ? s : in - 1) - base] += w;
+            }
+        } else {
+            centre = (o + 0.5) * scale - 0.5;
+            first = (int) (centre + 1) - 1;     // floor, since centre >= -0.5
+            w = centre - first;
+            base = (first < 0) ? 0 : ((first < in) ? first : in - 1);
+            acc[0] += 1 - w;
+            acc[((first + 1 < in) ? first + 1 : in - 1) - base] += w;
+        }
+        // round to fixed point, then give the rounding error to the largest weight so
+        // the weights add up to exactly one and flat areas stay flat
+        q = ax->weight + (size_t) o * ax->taps;
+        sum = 0;
+        largest = 0;
+        for (k = 0; k < ax->taps; k++) {
+            q[k] = (short) (acc[k] * one + 0.5);
+            sum += q[k];
+            if (q[k] > q[largest]) largest = k;
+        }
+        q[largest] += one - sum;
+        // drop the zero weights at either end
+        for (lead = 0; lead < ax->taps - 1 && q[lead] == 0; lead++);
+        for (last = ax->taps - 1; last > lead && q[last] == 0; last--);
+        memmove (q, q + lead, (last - lead + 1) * sizeof(short));
+        memset (q + last - lead + 1, 0, (ax->taps - (last - lead + 1)) * sizeof(short));
+        ax->start[o] = base + lead;
+        ax->count[o] = last - lead + 1;
+    }
+    return 0;
+}
+
+static inline void resize_plan_free(struct resize_plan *plan) {
+    resize_axis_free (&plan->x);
+    resize_axis_free (&plan->y);
+    free (plan->rings);
+    plan->rings = NULL;
+    plan->ring_size = 0;
+    plan->nrings = 0;
+}
+
+// Shorts of ring resize_rows needs for images of channels bytes per pixel
+static inline size_t resize_ring_size(const struct resize_plan *plan, int channels) {
+    return (size_t) plan->x.out * channels * plan->y.taps;
+}
+
+// Make room in the plan for nrings rings for images of channels bytes per pixel; they
+// are kept until the plan changes. Returns -1 if out of memory.
+static inline int resize_plan_rings(struct resize_plan *plan, int channels, int nrings) {
+    size_t size = resize_ring_size (plan, channels);
+
+    if (plan->rings && plan->ring_size >= size && plan->nrings >= nrings) return 0;
+    free (plan->rings);
+    plan->rings = malloc (sizeof(short) * size * nrings);
+    plan->ring_size = plan->rings ? size : 0;
+    plan->nrings = plan->rings ? nrings : 0;
+    return plan->rings ? 0 : -1;
+}
+
+// Compute the weights for resizing in_width x in_height to out_width x out_height. The
+// plan must start out zeroed; if it already holds the weights for the same sizes and
+// filter they are kept. Returns -1 if out of memory.
+static inline int resize_plan_init(struct resize_plan *plan, int in_width, int in_height, int out_width, int out_height,
+                                   enum resize_filter filter) {
+    if (plan->x.start && plan->filter == filter && plan->x.in == in_width && plan->x.out == out_width
+        && plan->y.in == in_height && plan->y.out == out_height)
+        return 0;
+    resize_plan_free (plan);
+    plan->filter = filter;
+    if (resize_axis_init (&plan->x, in_width, out_width, filter) < 0
+        || resize_axis_init (&plan->y, in_height, out_height, filter) < 0) {
+        resize_plan_free (plan);
+        return -1;
+    }
+    return 0;
+}
+
+// Horizontal pass over one row of channels-byte pixels, into RESIZE_ROW_BITS fixed point
+static inline void resize_horizontal(const struct resize_axis *ax, int channels, const byte *src, short *dst) {
+    const short *w;
+    const byte *s;
+    int x, c, t, sum;
+
+    for (x = 0; x < ax->out; x++) {
+        w = ax->weight + (size_t) x * ax->taps;
+        s = src + (size_t) ax->start[x] * channels;
+        for (c = 0; c < channels; c++) {
+            sum = 1 << (RESIZE_WEIGHT_BITS - RESIZE_ROW_BITS - 1);
+            for (t = 0; t < ax->count[x]; t++)
+                sum += w[t] * s[t * channels + c];
+            *dst++ = sum >> (RESIZE_WEIGHT_BITS - RESIZE_ROW_BITS);
+        }
+    }
+}
+
+// Resize rows [y0, y1) of dst from src. dst must have the plan's output size and the
+// same layout as src. ring is scratch of resize_ring_size shorts, e.g. one of the plan's
+// rings, or NULL to allocate it for this call. Returns -1 if out of memory.
+static inline int resize_rows(const struct resize_plan *plan, const struct image *src, struct image *dst, int y0, int y1,
+                              short *ring) {
+    int channels = (src->layout == IMAGE_INTERLEAVED) ? 3 : 1, slots = plan->y.taps;
+    size_t len = (size_t) plan->x.out * channels;
+    const short *rows[slots];
+    short *owned = NULL;
+    int held[slots], plane, y, t, s, slot;
+
+    if (!ring) {
+        ring = owned = malloc (sizeof(short) * len * slots);
+        if (!ring) return -1;
+    }
+    for (plane = 0; plane < src->nplanes; plane++) {
+        for (slot = 0; slot < slots; slot++)
+            held[slot] = -1;
+        for (y = y0; y < y1; y++) {
+            // the rows an output row needs only ever move down, so a ring of taps rows
+            // always holds the ones still needed
+            for (t = 0; t < plan->y.count[y]; t++) {
+                s = plan->y.start[y] + t;
+                slot = s % slots;
+                if (held[slot] != s) {
+                    resize_horizontal (&plan->x, channels, image_row (src, plane, s), ring + len * slot);
+                    held[slot] = s;
+                }
+                rows[t] = ring + len * slot;
+            }
+            kernels->resize_vertical (rows, plan->y.weight + (size_t) y * plan->y.taps, plan->y.count[y],
+                                      image_row (dst, plane, y), len);
+        }
+    }
+    free (owned);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,2049 @@
+// Vectorized kernels for the brightness, invert, contrast and threshold operations.
+//
+// Every kernel works directly on interleaved b, g, r bytes. Brightness and invert do not
+// care about pixel boundaries and run on 16 (SSE2, NEON), 32 (AVX2) or 64 (AVX-512BW)
+// bytes at a time with one saturating add/subtract or xor per vector. Contrast and
+// threshold depend on the pixel's gray level, so they split 16, 32 or 64 pixels into b,
+// g and r vectors, compare the weighted channel sum (luma.h) against a bound and blend
+// the result back into place. The grayscale kernels finish the same sum into the gray
+// level with a high-half multiply and a shift.
+//
+// Planar images (separate b, g and r planes) get their own contrast and threshold
+// kernels, which load each channel directly, plus the interleave and deinterleave
+// kernels used to convert between the two layouts. Gray images (one byte per pixel)
+// compare every byte against the threshold directly, with no channel sum at all.
+// The vertical pass of the resize engine is a weighted sum of 16-bit rows, done with
+// multiply-adds on two rows at a time. The convolution engine (convolve.h) uses the same
+// multiply-adds for its horizontal pass, over neighbouring bytes of one row, and for a
+// vertical pass that keeps the signed 32-bit sums (image derivatives). The 3 x 3 median
+// (median.h) is a network of byte min/max operations, so it takes one min and one max
+// per compare-exchange on a whole vector of pixels.
+//
+// The scalar versions are the reference: every vector version produces bit-identical
+// output. The x86 versions are compiled with per-function target attributes so one
+// binary carries all of them; cpu_dispatch.h picks one at startup. NEON code needs
+// the compiler to target NEON (-mfpu=neon on the HPS).
+#ifndef SIMD_KERNELS_H
+#define SIMD_KERNELS_H
+
+#include <stddef.h>
+#include <string.h>
+#include "luma.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_HAVE_X86 1
+#define SIMD_TARGET_SSE2 __attribute__((target("sse2")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512BW __attribute__((target("avx512f,avx512bw")))
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_HAVE_NEON 1
+#endif
+
+// Gray levels are always within 0..255, so clamping a threshold to -1..256 never
+// changes a comparison with one, and keeps t + 1 and the bounds derived from it small
+static inline int kernel_clamp_threshold(int t) {
+    return (t < -1) ? -1 : ((t > 256) ? 256 : t);
+}
+
+// Threshold comparisons on colour pixels are done on the weighted channel sum instead
+// of the gray level (see luma_bound): contrast selects the sums in [lo, hi), i.e.
+//   sign 1:  gray > t  <=>  sum >= luma_bound (t + 1)
+//   sign 0:  gray < t  <=>  sum <  luma_bound (t)
+// and threshold turns white the sums from luma_bound (t) up.
+static inline int kernel_contrast_lo(const struct luma_weights *l, int threshold, int sign) {
+    return (sign == 1) ? luma_bound(l, kernel_clamp_threshold(threshold) + 1) : 0;
+}
+
+static inline int kernel_contrast_hi(const struct luma_weights *l, int threshold, int sign) {
+    return (sign == 1) ? luma_sum_max(l) + 1 : luma_bound(l, kernel_clamp_threshold(threshold));
+}
+
+// Fixed-point formats of the resize engine (resize.h): filter weights and the
+// intermediate rows left by its horizontal pass
+#define RESIZE_WEIGHT_BITS 14
+#define RESIZE_ROW_BITS 7
+#define RESIZE_SHIFT (RESIZE_WEIGHT_BITS + RESIZE_ROW_BITS)
+
+static inline int kernel_clamp(int v) {
+    return (v < 0) ? 0 : ((v > 255) ? 255 : v);
+}
+
+// Adding a positive amount can only overflow, subtracting one only underflow
+static inline int kernel_clamp_high(int v) {
+    return (v > 255) ? 255 : v;
+}
+
+static inline int kernel_clamp_low(int v) {
+    return (v < 0) ? 0 : v;
+}
+
+// Signed amount added to each channel by brightness or contrast
+static inline int kernel_delta(int amount, int sign) {
+    int delta = (sign == 1) ? amount : -amount;
+    return (delta < -255) ? -255 : ((delta > 255) ? 255 : delta);
+}
+
+// Which bytes of a gray plane a contrast test (sign 1: v > t, sign 0: v < t) selects.
+// Settling the all and none cases up front leaves the vector loops with a single
+// unsigned byte compare against bound, which always lies in 1..255.
+enum gray_select {
+    GRAY_NONE,
+    GRAY_ALL,
+    GRAY_AT_LEAST,  // v >= bound
+    GRAY_BELOW      // v < bound
+};
+
+static inline enum gray_select kernel_gray_select(int threshold, int sign, int *bound) {
+    int t = kernel_clamp_threshold(threshold);
+
+    *bound = 0;
+    if (sign == 1) {
+        if (t < 0) return GRAY_ALL;
+        if (t >= 255) return GRAY_NONE;
+        *bound = t + 1;
+        return GRAY_AT_LEAST;
+    }
+    if (t <= 0) return GRAY_NONE;
+    if (t > 255) return GRAY_ALL;
+    *bound = t;
+    return GRAY_BELOW;
+}
+
+// Threshold keeps v >= t, which is the contrast test v > t - 1
+static inline enum gray_select kernel_gray_white(int threshold, int *bound) {
+    return kernel_gray_select(kernel_clamp_threshold(threshold) - 1, 1, bound);
+}
+
+/********************************************
+*              SCALAR REFERENCE             *
+********************************************/
+
+static void grayscale_kernel_scalar(unsigned char *bgr, size_t npixels) {
+    const struct luma_weights l = *luma;
+    size_t i;
+
+    for (i = 0; i < npixels; i++, bgr += 3) {
+        bgr[2] = luma_gray(&l, luma_sum(&l, bgr[0], bgr[1], bgr[2]));
+        bgr[1] = bgr[2];
+        bgr[0] = bgr[2];
+    }
+}
+
+static void invert_kernel_scalar(unsigned char *p, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        p[i] = 255 - p[i];
+}
+
+// The loops of brightness, contrast and threshold are generated once per direction by
+// the macros below, so that nothing inside them depends on the sign: brightness gets a
+// one-sided clamp, and contrast compares the weighted channel sum (or gray value)
+// against a bound worked out before the loop, which replaces both the sign test and
+// the normalization (see kernel_contrast_lo). The pixels contrast leaves alone are kept
+// with a mask rather than a branch, which the pixel data would make unpredictable.
+// The direction is the only parameter fixed at build time: the levels and amounts come
+// from -p when the program runs, so they are folded into bound and delta once per call
+// instead, which leaves the loops just as free of tests.
+#define KERNEL_AT_LEAST(x, bound) ((x) >= (bound))
+#define KERNEL_BELOW(x, bound) ((x) < (bound))
+
+// Replace v by adjusted where on is 1, keep it where on is 0
+#define KERNEL_SELECT(on, v, adjusted) ((v) + (((adjusted) - (v)) & -(on)))
+
+#define BRIGHTNESS_SCALAR_KERNEL(suffix, CLAMP)                                             \
+static void brightness_##suffix##_scalar(unsigned char *p, size_t n, int delta) {          \
+    size_t i;                                                                               \
+                                                                                            \
+    for (i = 0; i < n; i++)                                                                 \
+        p[i] = CLAMP(p[i] + delta);                                                         \
+}
+
+#define CONTRAST_SCALAR_KERNELS(suffix, TEST)                                               \
+static void contrast_##suffix##_scalar(unsigned char *bgr, size_t npixels, const struct luma_weights *weights,  \
+                                       int bound, int delta) {                              \
+    const struct luma_weights l = *weights;                                                 \
+    size_t i;                                                                               \
+    int on;                                                                                 \
+                                                                                            \
+    for (i = 0; i < npixels; i++, bgr += 3) {                                               \
+        on = TEST(luma_sum(&l, bgr[0], bgr[1], bgr[2]), bound);                              \
+        bgr[0] = KERNEL_SELECT(on, bgr[0], kernel_clamp(bgr[0] + delta));                   \
+        bgr[1] = KERNEL_SELECT(on, bgr[1], kernel_clamp(bgr[1] + delta));                   \
+        bgr[2] = KERNEL_SELECT(on, bgr[2], kernel_clamp(bgr[2] + delta));                   \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+static void contrast_planar_##suffix##_scalar(unsigned char *b, unsigned char *g, unsigned char *r,  \
+                                              size_t n, const struct luma_weights *weights, \
+                                              int bound, int delta) {                       \
+    const struct luma_weights l = *weights;                                                 \
+    size_t i;                                                                               \
+    int on, vb, vg, vr;                                                                     \
+                                                                                            \
+    for (i = 0; i < n; i++) {                                                               \
+        vb = b[i];                                                                          \
+        vg = g[i];                                                                          \
+        vr = r[i];                                                                          \
+        on = TEST(luma_sum(&l, vb, vg, vr), bound);                                          \
+        b[i] = KERNEL_SELECT(on, vb, kernel_clamp(vb + delta));                             \
+        g[i] = KERNEL_SELECT(on, vg, kernel_clamp(vg + delta));                             \
+        r[i] = KERNEL_SELECT(on, vr, kernel_clamp(vr + delta));                             \
+    }                                                                                       \
+}                                                                                           \
+                                                                                            \
+static void contrast_gray_##suffix##_scalar(unsigned char *p, size_t n, int bound, int delta) {  \
+    size_t i;                                                                               \
+                                                                                            \
+    for (i = 0; i < n; i++)                                                                 \
+        p[i] = KERNEL_SELECT(TEST(p[i], bound), p[i], kernel_clamp(p[i] + delta));          \
+}
+
+BRIGHTNESS_SCALAR_KERNEL(up, kernel_clamp_high)
+BRIGHTNESS_SCALAR_KERNEL(down, kernel_clamp_low)
+CONTRAST_SCALAR_KERNELS(above, KERNEL_AT_LEAST)
+CONTRAST_SCALAR_KERNELS(below, KERNEL_BELOW)
+
+static void brightness_kernel_scalar(unsigned char *p, size_t n, int brightness, int sign) {
+    int delta = kernel_delta(brightness, sign);
+
+    if (delta >= 0)
+        brightness_up_scalar(p, n, delta);
+    else
+        brightness_down_scalar(p, n, delta);
+}
+
+static void contrast_kernel_scalar(unsigned char *bgr, size_t npixels, int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+
+    if (sign == 1)
+        contrast_above_scalar(bgr, npixels, luma, kernel_contrast_lo(luma, threshold, sign), delta);
+    else
+        contrast_below_scalar(bgr, npixels, luma, kernel_contrast_hi(luma, threshold, sign), delta);
+}
+
+// The threshold comparison is 0 or 1, and its negation as a byte 0 or 255
+static void threshold_kernel_scalar(unsigned char *bgr, size_t npixels, int threshold) {
+    const struct luma_weights l = *luma;
+    size_t i;
+    int bound = luma_bound(&l, threshold);
+    unsigned char v;
+
+    for (i = 0; i < npixels; i++, bgr += 3) {
+        v = (unsigned char) -(luma_sum(&l, bgr[0], bgr[1], bgr[2]) >= bound);
+        bgr[0] = v;
+        bgr[1] = v;
+        bgr[2] = v;
+    }
+}
+
+static void contrast_planar_kernel_scalar(unsigned char *b, unsigned char *g, unsigned char *r, size_t n,
+                                          int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+
+    if (sign == 1)
+        contrast_planar_above_scalar(b, g, r, n, luma, kernel_contrast_lo(luma, threshold, sign), delta);
+    else
+        contrast_planar_below_scalar(b, g, r, n, luma, kernel_contrast_hi(luma, threshold, sign), delta);
+}
+
+static void threshold_planar_kernel_scalar(unsigned char *b, unsigned char *g, unsigned char *r, size_t n, int threshold) {
+    const struct luma_weights l = *luma;
+    size_t i;
+    int bound = luma_bound(&l, threshold);
+
+    for (i = 0; i < n; i++) {
+        r[i] = (unsigned char) -(luma_sum(&l, b[i], g[i], r[i]) >= bound);
+        g[i] = r[i];
+        b[i] = r[i];
+    }
+}
+
+// Gray levels of interleaved or planar pixels, into a gray plane
+static void gray_from_bgr_kernel_scalar(const unsigned char *bgr, unsigned char *gray, size_t npixels) {
+    const struct luma_weights l = *luma;
+    size_t i;
+
+    for (i = 0; i < npixels; i++, bgr += 3)
+        gray[i] = luma_gray(&l, luma_sum(&l, bgr[0], bgr[1], bgr[2]));
+}
+
+static void gray_from_planar_kernel_scalar(const unsigned char *b, const unsigned char *g, const unsigned char *r,
+                                           unsigned char *gray, size_t n) {
+    const struct luma_weights l = *luma;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        gray[i] = luma_gray(&l, luma_sum(&l, b[i], g[i], r[i]));
+}
+
+// On a gray plane the value itself is compared: v > t is v >= t + 1
+static void contrast_gray_kernel_scalar(unsigned char *p, size_t n, int threshold, int contrast_factor, int sign) {
+    int t = kernel_clamp_threshold(threshold), delta = kernel_delta(contrast_factor, sign);
+
+    if (sign == 1)
+        contrast_gray_above_scalar(p, n, t + 1, delta);
+    else
+        contrast_gray_below_scalar(p, n, t, delta);
+}
+
+static void threshold_gray_kernel_scalar(unsigned char *p, size_t n, int threshold) {
+    size_t i;
+    int t = kernel_clamp_threshold(threshold);
+
+    for (i = 0; i < n; i++)
+        p[i] = (unsigned char) -(p[i] >= t);
+}
+
+static void deinterleave_kernel_scalar(const unsigned char *bgr, unsigned char *b, unsigned char *g, unsigned char *r, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++, bgr += 3) {
+        b[i] = bgr[0];
+        g[i] = bgr[1];
+        r[i] = bgr[2];
+    }
+}
+
+static void interleave_kernel_scalar(const unsigned char *b, const unsigned char *g, const unsigned char *r, unsigned char *bgr, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++, bgr += 3) {
+        bgr[0] = b[i];
+        bgr[1] = g[i];
+        bgr[2] = r[i];
+    }
+}
+
+// Vertical pass of the resize engine: out[i] is the weighted sum of rows[0..taps)[i],
+// rounded and scaled back to 8 bits. The rows hold horizontally resized samples with
+// RESIZE_ROW_BITS fraction bits and the weights RESIZE_WEIGHT_BITS; since the weights
+// add up to one, the sum fits in 32 bits.
+static inline void resize_vertical_range(const short *const *rows, const short *weights, int taps, unsigned char *out,
+                                         size_t i, size_t n) {
+    int t, sum;
+
+    for (; i < n; i++) {
+        sum = 1 << (RESIZE_SHIFT - 1);
+        for (t = 0; t < taps; t++)
+            sum += weights[t] * rows[t][i];
+        out[i] = sum >> RESIZE_SHIFT;
+    }
+}
+
+// Weights t and t + 1 as the two 16-bit halves of one 32-bit lane, for the vector
+// versions that multiply-add two rows at a time (an odd last tap pairs with zero)
+static inline int resize_weight_pair(const short *weights, int t, int taps) {
+    return (weights[t] & 0xffff) | (((t + 1 < taps) ? weights[t + 1] : 0) << 16);
+}
+
+static void resize_vertical_kernel_scalar(const short *const *rows, const short *weights, int taps, unsigned char *out, size_t n) {
+    resize_vertical_range(rows, weights, taps, out, 0, n);
+}
+
+// Horizontal pass of the convolution engine: out[i] is the weighted sum of src[i] to
+// src[i + taps - 1], rounded and shifted right by shift. src holds n + taps - 1 bytes,
+// the row padded at either end, and the weights are chosen so the result fits in 16
+// bits.
+static inline void convolve_horizontal_range(const unsigned char *src, const short *weights, int taps, int shift,
+                                             short *out, size_t i, size_t n) {
+    int t, sum, round = shift ? 1 << (shift - 1) : 0;
+
+    for (; i < n; i++) {
+        sum = round;
+        for (t = 0; t < taps; t++)
+            sum += weights[t] * src[i + t];
+        out[i] = (short) (sum >> shift);
+    }
+}
+
+static void convolve_horizontal_kernel_scalar(const unsigned char *src, const short *weights, int taps, int shift,
+                                              short *out, size_t n) {
+    convolve_horizontal_range(src, weights, taps, shift, out, 0, n);
+}
+
+// Vertical pass of the convolution engine for signed results: out[i] is the plain
+// weighted sum of rows[0..taps)[i]
+static inline void convolve_vertical_signed_range(const short *const *rows, const short *weights, int taps, int *out,
+                                                  size_t i, size_t n) {
+    int t, sum;
+
+    for (; i < n; i++) {
+        sum = 0;
+        for (t = 0; t < taps; t++)
+            sum += weights[t] * rows[t][i];
+        out[i] = sum;
+    }
+}
+
+static void convolve_vertical_signed_kernel_scalar(const short *const *rows, const short *weights, int taps, int *out,
+                                                   size_t n) {
+    convolve_vertical_signed_range(rows, weights, taps, out, 0, n);
+}
+
+// 3 x 3 median: out[i] is the median of rows[0..3)[i..i + 2], the rows padded by one
+// byte at either end. Each column of three is sorted, and the median of the nine is
+// the median of the largest low, the median middle and the smallest high.
+static inline int kernel_median3(int a, int b, int c) {
+    int lo = (a < b) ? a : b, hi = (a < b) ? b : a;
+
+    hi = (hi < c) ? hi : c;
+    return (lo > hi) ? lo : hi;
+}
+
+static inline void kernel_sort2(int *a, int *b) {
+    int t = (*a < *b) ? *a : *b;
+
+    *b = (*a < *b) ? *b : *a;
+    *a = t;
+}
+
+static inline void median3_range(const unsigned char *const *rows, unsigned char *out, size_t i, size_t n) {
+    int lo[3], mid[3], hi[3], j, low, high;
+
+    for (; i < n; i++) {
+        for (j = 0; j < 3; j++) {
+            lo[j] = rows[0][i + j];
+            mid[j] = rows[1][i + j];
+            hi[j] = rows[2][i + j];
+            kernel_sort2(&lo[j], &mid[j]);
+            kernel_sort2(&mid[j], &hi[j]);
+            kernel_sort2(&lo[j], &mid[j]);
+        }
+        low = (lo[0] > lo[1]) ? lo[0] : lo[1];
+        low = (low > lo[2]) ? low : lo[2];
+        high = (hi[0] < hi[1]) ? hi[0] : hi[1];
+        high = (high < hi[2]) ? high : hi[2];
+        out[i] = (unsigned char) kernel_median3(low, kernel_median3(mid[0], mid[1], mid[2]), high);
+    }
+}
+
+static void median3_kernel_scalar(const unsigned char *const *rows, unsigned char *out, size_t n) {
+    median3_range(rows, out, 0, n);
+}
+
+/********************************************
+*                   SSE2                    *
+********************************************/
+#if defined(SIMD_HAVE_X86)
+
+// Split 16 interleaved pixels into b, g and r vectors. Each round interleaves the low
+// half of one vector with the high half of the next; four rounds sort 48 bytes by channel.
+static inline SIMD_TARGET_SSE2 void sse2_deinterleave3(const unsigned char *p, __m128i *c0, __m128i *c1, __m128i *c2) {
+    __m128i t0 = _mm_loadu_si128((const __m128i *) p);
+    __m128i t1 = _mm_loadu_si128((const __m128i *) (p + 16));
+    __m128i t2 = _mm_loadu_si128((const __m128i *) (p + 32));
+    __m128i u0, u1, u2;
+    int round;
+
+    for (round = 0; round < 4; round++) {
+        u0 = _mm_unpacklo_epi8(t0, _mm_unpackhi_epi64(t1, t1));
+        u1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t0, t0), t2);
+        u2 = _mm_unpacklo_epi8(t1, _mm_unpackhi_epi64(t2, t2));
+        t0 = u0; t1 = u1; t2 = u2;
+    }
+    *c0 = t0; *c1 = t1; *c2 = t2;
+}
+
+// Inverse of sse2_deinterleave3: each round separates even and odd bytes again
+static inline SIMD_TARGET_SSE2 void sse2_interleave3(unsigned char *p, __m128i c0, __m128i c1, __m128i c2) {
+    const __m128i even = _mm_set1_epi16(0x00ff);
+    __m128i u0, u1, u2;
+    int round;
+
+    for (round = 0; round < 4; round++) {
+        u0 = _mm_packus_epi16(_mm_and_si128(c0, even), _mm_and_si128(c1, even));
+        u1 = _mm_packus_epi16(_mm_and_si128(c2, even), _mm_srli_epi16(c0, 8));
+        u2 = _mm_packus_epi16(_mm_srli_epi16(c1, 8), _mm_srli_epi16(c2, 8));
+        c0 = u0; c1 = u1; c2 = u2;
+    }
+    _mm_storeu_si128((__m128i *) p, c0);
+    _mm_storeu_si128((__m128i *) (p + 16), c1);
+    _mm_storeu_si128((__m128i *) (p + 32), c2);
+}
+
+// Luma weights (luma.h) in every 16-bit lane
+struct sse2_luma {
+    __m128i wb, wg, wr, add, mul;
+    int unit;                   // all weights one, see luma_unit
+};
+
+static inline SIMD_TARGET_SSE2 struct sse2_luma sse2_luma_weights(const struct luma_weights *l) {
+    struct sse2_luma w;
+
+    w.wb = _mm_set1_epi16((short) l->wb);
+    w.wg = _mm_set1_epi16((short) l->wg);
+    w.wr = _mm_set1_epi16((short) l->wr);
+    w.add = _mm_set1_epi16((short) l->add);
+    w.mul = _mm_set1_epi16((short) l->mul);
+    w.unit = luma_unit(l);
+    return w;
+}
+
+// Weighted sums of 8 pixels whose channels are widened to 16 bits
+static inline SIMD_TARGET_SSE2 __m128i sse2_luma_sum(const struct sse2_luma *w, __m128i b, __m128i g, __m128i r) {
+    if (w->unit) return _mm_add_epi16(_mm_add_epi16(b, g), r);
+    return _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(b, w->wb), _mm_mullo_epi16(g, w->wg)), _mm_mullo_epi16(r, w->wr));
+}
+
+// 0xffff for each sum in [lo, hi). The sums use all 16 bits but the compares are
+// signed, so sums and bounds are all offset by 0x8000 (vlo and vhi already are).
+static inline SIMD_TARGET_SSE2 __m128i sse2_in_range_epu16(__m128i sum, __m128i vlo, __m128i vhi) {
+    sum = _mm_xor_si128(sum, _mm_set1_epi16((short) 0x8000));
+    return _mm_andnot_si128(_mm_cmpgt_epi16(vlo, sum), _mm_cmpgt_epi16(vhi, sum));
+}
+
+// 0xff for each of 16 pixels whose luma sum lies in [lo, hi)
+static inline SIMD_TARGET_SSE2 __m128i sse2_luma_in_range(const struct sse2_luma *w, __m128i b, __m128i g, __m128i r,
+                                                          int lo, int hi) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vlo = _mm_set1_epi16((short) (lo ^ 0x8000)), vhi = _mm_set1_epi16((short) (hi ^ 0x8000));
+    __m128i sum_lo = sse2_luma_sum(w, _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(g, zero), _mm_unpacklo_epi8(r, zero));
+    __m128i sum_hi = sse2_luma_sum(w, _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(r, zero));
+    return _mm_packs_epi16(sse2_in_range_epu16(sum_lo, vlo, vhi), sse2_in_range_epu16(sum_hi, vlo, vhi));
+}
+
+// Gray levels of 16 pixels
+static inline SIMD_TARGET_SSE2 __m128i sse2_luma(const struct sse2_luma *w, __m128i b, __m128i g, __m128i r) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum_lo = sse2_luma_sum(w, _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(g, zero), _mm_unpacklo_epi8(r, zero));
+    __m128i sum_hi = sse2_luma_sum(w, _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(r, zero));
+    sum_lo = _mm_srli_epi16(_mm_mulhi_epu16(_mm_add_epi16(sum_lo, w->add), w->mul), LUMA_SHIFT - 16);
+    sum_hi = _mm_srli_epi16(_mm_mulhi_epu16(_mm_add_epi16(sum_hi, w->add), w->mul), LUMA_SHIFT - 16);
+    return _mm_packus_epi16(sum_lo, sum_hi);
+}
+
+static SIMD_TARGET_SSE2 void invert_kernel_sse2(unsigned char *p, size_t n) {
+    const __m128i ones = _mm_set1_epi8(-1);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i *) (p + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *) (p + i)), ones));
+    invert_kernel_scalar(p + i, n - i);
+}
+
+static SIMD_TARGET_SSE2 void brightness_kernel_sse2(unsigned char *p, size_t n, int brightness, int sign) {
+    int delta = kernel_delta(brightness, sign);
+    const __m128i amount = _mm_set1_epi8((char) (delta < 0 ? -delta : delta));
+    __m128i v;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (p + i));
+        v = (delta < 0) ? _mm_subs_epu8(v, amount) : _mm_adds_epu8(v, amount);
+        _mm_storeu_si128((__m128i *) (p + i), v);
+    }
+    brightness_kernel_scalar(p + i, n - i, brightness, sign);
+}
+
+static SIMD_TARGET_SSE2 void contrast_kernel_sse2(unsigned char *bgr, size_t npixels, int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+    int lo = kernel_contrast_lo(luma, threshold, sign), hi = kernel_contrast_hi(luma, threshold, sign);
+    const struct sse2_luma w = sse2_luma_weights(luma);
+    const __m128i up = _mm_set1_epi8((char) (delta > 0 ? delta : 0));
+    const __m128i down = _mm_set1_epi8((char) (delta < 0 ? -delta : 0));
+    __m128i b, g, r, m;
+    size_t i;
+
+    for (i = 0; i + 16 <= npixels; i += 16, bgr += 48) {
+        sse2_deinterleave3(bgr, &b, &g, &r);
+        m = sse2_luma_in_range(&w, b, g, r, lo, hi);
+        b = _mm_subs_epu8(_mm_adds_epu8(b, _mm_and_si128(up, m)), _mm_and_si128(down, m));
+        g = _mm_subs_epu8(_mm_adds_epu8(g, _mm_and_si128(up, m)), _mm_and_si128(down, m));
+        r = _mm_subs_epu8(_mm_adds_epu8(r, _mm_and_si128(up, m)), _mm_and_si128(down, m));
+        sse2_interleave3(bgr, b, g, r);
+    }
+    contrast_kernel_scalar(bgr, npixels - i, threshold, contrast_factor, sign);
+}
+
+static SIMD_TARGET_SSE2 void threshold_kernel_sse2(unsigned char *bgr, size_t npixels, int threshold) {
+    int lo = luma_bound(luma, threshold), hi = luma_sum_max(luma) + 1;
+    const struct sse2_luma w = sse2_luma_weights(luma);
+    __m128i b, g, r, white;
+    size_t i;
+
+    for (i = 0; i + 16 <= npixels; i += 16, bgr += 48) {
+        sse2_deinterleave3(bgr, &b, &g, &r);
+        white = sse2_luma_in_range(&w, b, g, r, lo, hi);
+        sse2_interleave3(bgr, white, white, white);
+    }
+    threshold_kernel_scalar(bgr, npixels - i, threshold);
+}
+
+static SIMD_TARGET_SSE2 void contrast_planar_kernel_sse2(unsigned char *b, unsigned char *g, unsigned char *r, size_t n,
+                                                         int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+    int lo = kernel_contrast_lo(luma, threshold, sign), hi = kernel_contrast_hi(luma, threshold, sign);
+    const struct sse2_luma w = sse2_luma_weights(luma);
+    const __m128i up = _mm_set1_epi8((char) (delta > 0 ? delta : 0));
+    const __m128i down = _mm_set1_epi8((char) (delta < 0 ? -delta : 0));
+    __m128i vb, vg, vr, m;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        vb = _mm_loadu_si128((const __m128i *) (b + i));
+        vg = _mm_loadu_si128((const __m128i *) (g + i));
+        vr = _mm_loadu_si128((const __m128i *) (r + i));
+        m = sse2_luma_in_range(&w, vb, vg, vr, lo, hi);
+        _mm_storeu_si128((__m128i *) (b + i), _mm_subs_epu8(_mm_adds_epu8(vb, _mm_and_si128(up, m)), _mm_and_si128(down, m)));
+        _mm_storeu_si128((__m128i *) (g + i), _mm_subs_epu8(_mm_adds_epu8(vg, _mm_and_si128(up, m)), _mm_and_si128(down, m)));
+        _mm_storeu_si128((__m128i *) (r + i), _mm_subs_epu8(_mm_adds_epu8(vr, _mm_and_si128(up, m)), _mm_and_si128(down, m)));
+    }
+    contrast_planar_kernel_scalar(b + i, g + i, r + i, n - i, threshold, contrast_factor, sign);
+}
+
+static SIMD_TARGET_SSE2 void threshold_planar_kernel_sse2(unsigned char *b, unsigned char *g, unsigned char *r, size_t n, int threshold) {
+    int lo = luma_bound(luma, threshold), hi = luma_sum_max(luma) + 1;
+    const struct sse2_luma w = sse2_luma_weights(luma);
+    __m128i white;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        white = sse2_luma_in_range(&w, _mm_loadu_si128((const __m128i *) (b + i)), _mm_loadu_si128((const __m128i *) (g + i)),
+                                   _mm_loadu_si128((const __m128i *) (r + i)), lo, hi);
+        _mm_storeu_si128((__m128i *) (b + i), white);
+        _mm_storeu_si128((__m128i *) (g + i), white);
+        _mm_storeu_si128((__m128i *) (r + i), white);
+    }
+    threshold_planar_kernel_scalar(b + i, g + i, r + i, n - i, threshold);
+}
+
+static SIMD_TARGET_SSE2 void contrast_gray_kernel_sse2(unsigned char *p, size_t n, int threshold, int contrast_factor, int sign) {
+    int bound, delta = kernel_delta(contrast_factor, sign);
+    enum gray_select select = kernel_gray_select(threshold, sign, &bound);
+    const __m128i vbound = _mm_set1_epi8((char) bound), flip = _mm_set1_epi8(select == GRAY_BELOW ? -1 : 0);
+    const __m128i up = _mm_set1_epi8((char) (delta > 0 ? delta : 0));
+    const __m128i down = _mm_set1_epi8((char) (delta < 0 ? -delta : 0));
+    __m128i v, m;
+    size_t i;
+
+    if (select == GRAY_NONE) return;
+    if (select == GRAY_ALL) {
+        brightness_kernel_sse2(p, n, contrast_factor, sign);
+        return;
+    }
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (p + i));
+        // max(v, bound) == v exactly when v >= bound
+        m = _mm_xor_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, vbound), v), flip);
+        _mm_storeu_si128((__m128i *) (p + i), _mm_subs_epu8(_mm_adds_epu8(v, _mm_and_si128(up, m)), _mm_and_si128(down, m)));
+    }
+    contrast_gray_kernel_scalar(p + i, n - i, threshold, contrast_factor, sign);
+}
+
+static SIMD_TARGET_SSE2 void threshold_gray_kernel_sse2(unsigned char *p, size_t n, int threshold) {
+    int bound;
+    enum gray_select select = kernel_gray_white(threshold, &bound);
+    const __m128i vbound = _mm_set1_epi8((char) bound);
+    __m128i v;
+    size_t i;
+
+    if (select != GRAY_AT_LEAST) {
+        memset (p, (select == GRAY_ALL) ? 255 : 0, n);
+        return;
+    }
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (p + i));
+        _mm_storeu_si128((__m128i *) (p + i), _mm_cmpeq_epi8(_mm_max_epu8(v, vbound), v));
+    }
+    threshold_gray_kernel_scalar(p + i, n - i, threshold);
+}
+
+static SIMD_TARGET_SSE2 void grayscale_kernel_sse2(unsigned char *bgr, size_t npixels) {
+    const struct sse2_luma w = sse2_luma_weights(luma);
+    __m128i b, g, r, v;
+    size_t i;
+
+    for (i = 0; i + 16 <= npixels; i += 16, bgr += 48) {
+        sse2_deinterleave3(bgr, &b, &g, &r);
+        v = sse2_luma(&w, b, g, r);
+        sse2_interleave3(bgr, v, v, v);
+    }
+    grayscale_kernel_scalar(bgr, npixels - i);
+}
+
+static SIMD_TARGET_SSE2 void gray_from_bgr_kernel_sse2(const unsigned char *bgr, unsigned char *gray, size_t npixels) {
+    const struct sse2_luma w = sse2_luma_weights(luma);
+    __m128i b, g, r;
+    size_t i;
+
+    for (i = 0; i + 16 <= npixels; i += 16, bgr += 48) {
+        sse2_deinterleave3(bgr, &b, &g, &r);
+        _mm_storeu_si128((__m128i *) (gray + i), sse2_luma(&w, b, g, r));
+    }
+    gray_from_bgr_kernel_scalar(bgr, gray + i, npixels - i);
+}
+
+static SIMD_TARGET_SSE2 void gray_from_planar_kernel_sse2(const unsigned char *b, const unsigned char *g, const unsigned char *r,
+                                                          unsigned char *gray, size_t n) {
+    const struct sse2_luma w = sse2_luma_weights(luma);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i *) (gray + i),
+                         sse2_luma(&w, _mm_loadu_si128((const __m128i *) (b + i)), _mm_loadu_si128((const __m128i *) (g + i)),
+                                   _mm_loadu_si128((const __m128i *) (r + i))));
+    gray_from_planar_kernel_scalar(b + i, g + i, r + i, gray + i, n - i);
+}
+
+static SIMD_TARGET_SSE2 void deinterleave_kernel_sse2(const unsigned char *bgr, unsigned char *b, unsigned char *g, unsigned char *r, size_t n) {
+    __m128i vb, vg, vr;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        sse2_deinterleave3(bgr + 3 * i, &vb, &vg, &vr);
+        _mm_storeu_si128((__m128i *) (b + i), vb);
+        _mm_storeu_si128((__m128i *) (g + i), vg);
+        _mm_storeu_si128((__m128i *) (r + i), vr);
+    }
+    deinterleave_kernel_scalar(bgr + 3 * i, b + i, g + i, r + i, n - i);
+}
+
+static SIMD_TARGET_SSE2 void interleave_kernel_sse2(const unsigned char *b, const unsigned char *g, const unsigned char *r, unsigned char *bgr, size_t n) {
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+        sse2_interleave3(bgr + 3 * i, _mm_loadu_si128((const __m128i *) (b + i)), _mm_loadu_si128((const __m128i *) (g + i)),
+                         _mm_loadu_si128((const __m128i *) (r + i)));
+    interleave_kernel_scalar(b + i, g + i, r + i, bgr + 3 * i, n - i);
+}
+
+// Two taps per multiply-add: the rows are interleaved in pairs and _mm_madd_epi16 sums
+// row[t] * w[t] + row[t + 1] * w[t + 1] into 32-bit lanes
+static SIMD_TARGET_SSE2 void resize_vertical_kernel_sse2(const short *const *rows, const short *weights, int taps, unsigned char *out, size_t n) {
+    const __m128i round = _mm_set1_epi32(1 << (RESIZE_SHIFT - 1));
+    __m128i lo, hi, a, b, w;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        lo = round;
+        hi = round;
+        for (t = 0; t < taps; t += 2) {
+            a = _mm_loadu_si128((const __m128i *) (rows[t] + i));
+            b = (t + 1 < taps) ? _mm_loadu_si128((const __m128i *) (rows[t + 1] + i)) : _mm_setzero_si128();
+            w = _mm_set1_epi32(resize_weight_pair(weights, t, taps));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        a = _mm_packs_epi32(_mm_srai_epi32(lo, RESIZE_SHIFT), _mm_srai_epi32(hi, RESIZE_SHIFT));
+        _mm_storel_epi64((__m128i *) (out + i), _mm_packus_epi16(a, a));
+    }
+    resize_vertical_range(rows, weights, taps, out, i, n);
+}
+
+// The horizontal pass pairs neighbouring bytes the way the vertical pass pairs rows:
+// src[i + t] and src[i + t + 1], widened to 16 bits and interleaved, meet the weight
+// pair in one _mm_madd_epi16
+static SIMD_TARGET_SSE2 void convolve_horizontal_kernel_sse2(const unsigned char *src, const short *weights, int taps,
+                                                             int shift, short *out, size_t n) {
+    const __m128i zero = _mm_setzero_si128(), count = _mm_cvtsi32_si128(shift);
+    const __m128i round = _mm_set1_epi32(shift ? 1 << (shift - 1) : 0);
+    __m128i lo, hi, a, b, w;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        lo = round;
+        hi = round;
+        for (t = 0; t < taps; t += 2) {
+            a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (src + i + t)), zero);
+            b = (t + 1 < taps) ? _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (src + i + t + 1)), zero) : zero;
+            w = _mm_set1_epi32(resize_weight_pair(weights, t, taps));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi32(_mm_sra_epi32(lo, count), _mm_sra_epi32(hi, count)));
+    }
+    convolve_horizontal_range(src, weights, taps, shift, out, i, n);
+}
+
+static SIMD_TARGET_SSE2 void convolve_vertical_signed_kernel_sse2(const short *const *rows, const short *weights, int taps,
+                                                                  int *out, size_t n) {
+    __m128i lo, hi, a, b, w;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        lo = _mm_setzero_si128();
+        hi = _mm_setzero_si128();
+        for (t = 0; t < taps; t += 2) {
+            a = _mm_loadu_si128((const __m128i *) (rows[t] + i));
+            b = (t + 1 < taps) ? _mm_loadu_si128((const __m128i *) (rows[t + 1] + i)) : _mm_setzero_si128();
+            w = _mm_set1_epi32(resize_weight_pair(weights, t, taps));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        _mm_storeu_si128((__m128i *) (out + i), lo);
+        _mm_storeu_si128((__m128i *) (out + i + 4), hi);
+    }
+    convolve_vertical_signed_range(rows, weights, taps, out, i, n);
+}
+
+static inline SIMD_TARGET_SSE2 void sse2_sort2(__m128i *a, __m128i *b) {
+    __m128i t = _mm_min_epu8(*a, *b);
+
+    *b = _mm_max_epu8(*a, *b);
+    *a = t;
+}
+
+static inline SIMD_TARGET_SSE2 __m128i sse2_median3(__m128i a, __m128i b, __m128i c) {
+    return _mm_max_epu8(_mm_min_epu8(a, b), _mm_min_epu8(_mm_max_epu8(a, b), c));
+}
+
+static SIMD_TARGET_SSE2 void median3_kernel_sse2(const unsigned char *const *rows, unsigned char *out, size_t n) {
+    __m128i lo[3], mid[3], hi[3], low, high;
+    size_t i;
+    int j;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        for (j = 0; j < 3; j++) {
+            lo[j] = _mm_loadu_si128((const __m128i *) (rows[0] + i + j));
+            mid[j] = _mm_loadu_si128((const __m128i *) (rows[1] + i + j));
+            hi[j] = _mm_loadu_si128((const __m128i *) (rows[2] + i + j));
+            sse2_sort2(&lo[j], &mid[j]);
+            sse2_sort2(&mid[j], &hi[j]);
+            sse2_sort2(&lo[j], &mid[j]);
+        }
+        low = _mm_max_epu8(_mm_max_epu8(lo[0], lo[1]), lo[2]);
+        high = _mm_min_epu8(_mm_min_epu8(hi[0], hi[1]), hi[2]);
+        _mm_storeu_si128((__m128i *) (out + i), sse2_median3(low, sse2_median3(mid[0], mid[1], mid[2]), high));
+    }
+    median3_range(rows, out, i, n);
+}
+
+#endif
+
+/********************************************
+*                   AVX2                    *
+********************************************/
+#if defined(SIMD_HAVE_X86)
+
+// Byte shuffles that gather channel c of 16 pixels from the three 16-byte pieces they span
+static const signed char avx2_gather3_shuffle[3][3][16] = {
+    {{   0,    3,    6,    9,   12,   15, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128},
+     {-128, -128, -128, -128, -128, -128,    2,    5,    8,   11,   14, -128, -128, -128, -128, -128},
+     {-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128,    1,    4,    7,   10,   13}},
+    {{   1,    4,    7,   10,   13, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128},
+     {-128, -128, -128, -128, -128,    0,    3,    6,    9,   12,   15, -128, -128, -128, -128, -128},
+     {-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128,    2,    5,    8,   11,   14}},
+    {{   2,    5,    8,   11,   14, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128},
+     {-128, -128, -128, -128, -128,    1,    4,    7,   10,   13, -128, -128, -128, -128, -128, -128},
+     {-128, -128, -128, -128, -128, -128, -128, -128, -128, -128,    0,    3,    6,    9,   12,   15}},
+};
+
+// Byte shuffles that repeat each of 16 per-pixel values three times, one 16-byte piece each
+static const signed char avx2_spread3_shuffle[3][16] = {
+    { 0,  0,  0,  1,  1,  1,  2,  2,  2,  3,  3,  3,  4,  4,  4,  5},
+    { 5,  5,  6,  6,  6,  7,  7,  7,  8,  8,  8,  9,  9,  9, 10, 10},
+    {10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15},
+};
+
+// Byte shuffles that place channel c of 16 pixels into each 16-byte piece of their
+// interleaved form (the inverse of avx2_gather3_shuffle)
+static const signed char avx2_scatter3_shuffle[3][3][16] = {
+    {{   0, -128, -128,    1, -128, -128,    2, -128, -128,    3, -128, -128,    4, -128, -128,    5},
+     {-128, -128,    6, -128, -128,    7, -128, -128,    8, -128, -128,    9, -128, -128,   10, -128},
+     {-128,   11, -128, -128,   12, -128, -128,   13, -128, -128,   14, -128, -128,   15, -128, -128}},
+    {{-128,    0, -128, -128,    1, -128, -128,    2, -128, -128,    3, -128, -128,    4, -128, -128},
+     {   5, -128, -128,    6, -128, -128,    7, -128, -128,    8, -128, -128,    9, -128, -128,   10},
+     {-128, -128,   11, -128, -128,   12, -128, -128,   13, -128, -128,   14, -128, -128,   15, -128}},
+    {{-128, -128,    0, -128, -128,    1, -128, -128,    2, -128, -128,    3, -128, -128,    4, -128},
+     {-128,    5, -128, -128,    6, -128, -128,    7, -128, -128,    8, -128, -128,    9, -128, -128},
+     {  10, -128, -128,   11, -128, -128,   12, -128, -128,   13, -128, -128,   14, -128, -128,   15}},
+};
+
+static inline SIMD_TARGET_AVX2 __m256i avx2_table(const signed char *t) {
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) t));
+}
+
+// vpshufb only shuffles within 128-bit lanes, so 32 pixels are loaded as two runs of
+// 16: the low lane holds pixels 0-15 and the high lane pixels 16-31.
+static inline SIMD_TARGET_AVX2 __m256i avx2_load_split(const unsigned char *p) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) p)),
+                                   _mm_loadu_si128((const __m128i *) (p + 48)), 1);
+}
+
+static inline SIMD_TARGET_AVX2 void avx2_store_split(unsigned char *p, __m256i v) {
+    _mm_storeu_si128((__m128i *) p, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *) (p + 48), _mm256_extracti128_si256(v, 1));
+}
+
+static inline SIMD_TARGET_AVX2 __m256i avx2_gather3(__m256i v0, __m256i v1, __m256i v2, int c) {
+    return _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, avx2_table(avx2_gather3_shuffle[c][0])),
+                                           _mm256_shuffle_epi8(v1, avx2_table(avx2_gather3_shuffle[c][1]))),
+                           _mm256_shuffle_epi8(v2, avx2_table(avx2_gather3_shuffle[c][2])));
+}
+
+static inline SIMD_TARGET_AVX2 __m256i avx2_scatter3(__m256i b, __m256i g, __m256i r, int piece) {
+    return _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(b, avx2_table(avx2_scatter3_shuffle[0][piece])),
+                                           _mm256_shuffle_epi8(g, avx2_table(avx2_scatter3_shuffle[1][piece]))),
+                           _mm256_shuffle_epi8(r, avx2_table(avx2_scatter3_shuffle[2][piece])));
+}
+
+struct avx2_luma {
+    __m256i wb, wg, wr, add, mul;
+    int unit;                   // all weights one, see luma_unit
+};
+
+static inline SIMD_TARGET_AVX2 struct avx2_luma avx2_luma_weights(const struct luma_weights *l) {
+    struct avx2_luma w;
+
+    w.wb = _mm256_set1_epi16((short) l->wb);
+    w.wg = _mm256_set1_epi16((short) l->wg);
+    w.wr = _mm256_set1_epi16((short) l->wr);
+    w.add = _mm256_set1_epi16((short) l->add);
+    w.mul = _mm256_set1_epi16((short) l->mul);
+    w.unit = luma_unit(l);
+    return w;
+}
+
+static inline SIMD_TARGET_AVX2 __m256i avx2_luma_sum(const struct avx2_luma *w, __m256i b, __m256i g, __m256i r) {
+    if (w->unit) return _mm256_add_epi16(_mm256_add_epi16(b, g), r);
+    return _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(b, w->wb), _mm256_mullo_epi16(g, w->wg)),
+                            _mm256_mullo_epi16(r, w->wr));
+}
+
+// Unsigned range test with offset bounds, as sse2_in_range_epu16
+static inline SIMD_TARGET_AVX2 __m256i avx2_in_range_epu16(__m256i sum, __m256i vlo, __m256i vhi) {
+    sum = _mm256_xor_si256(sum, _mm256_set1_epi16((short) 0x8000));
+    return _mm256_andnot_si256(_mm256_cmpgt_epi16(vlo, sum), _mm256_cmpgt_epi16(vhi, sum));
+}
+
+// 0xff for each of 32 pixels whose luma sum lies in [lo, hi)
+static inline SIMD_TARGET_AVX2 __m256i avx2_luma_in_range(const struct avx2_luma *w, __m256i b, __m256i g, __m256i r,
+                                                          int lo, int hi) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i vlo = _mm256_set1_epi16((short) (lo ^ 0x8000)), vhi = _mm256_set1_epi16((short) (hi ^ 0x8000));
+    __m256i sum_lo = avx2_luma_sum(w, _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(g, zero),
+                                   _mm256_unpacklo_epi8(r, zero));
+    __m256i sum_hi = avx2_luma_sum(w, _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(g, zero),
+                                   _mm256_unpackhi_epi8(r, zero));
+    return _mm256_packs_epi16(avx2_in_range_epu16(sum_lo, vlo, vhi), avx2_in_range_epu16(sum_hi, vlo, vhi));
+}
+
+// Gray levels of 32 pixels; unpacking and packing both stay within 128-bit lanes, so
+// they come out in order
+static inline SIMD_TARGET_AVX2 __m256i avx2_luma(const struct avx2_luma *w, __m256i b, __m256i g, __m256i r) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum_lo = avx2_luma_sum(w, _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(g, zero),
+                                   _mm256_unpacklo_epi8(r, zero));
+    __m256i sum_hi = avx2_luma_sum(w, _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(g, zero),
+                                   _mm256_unpackhi_epi8(r, zero));
+    sum_lo = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(sum_lo, w->add), w->mul), LUMA_SHIFT - 16);
+    sum_hi = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(sum_hi, w->add), w->mul), LUMA_SHIFT - 16);
+    return _mm256_packus_epi16(sum_lo, sum_hi);
+}
+
+static inline SIMD_TARGET_AVX2 __m256i avx2_spread3(__m256i m, int piece) {
+    return _mm256_shuffle_epi8(m, avx2_table(avx2_spread3_shuffle[piece]));
+}
+
+static SIMD_TARGET_AVX2 void invert_kernel_avx2(unsigned char *p, size_t n) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32)
+        _mm256_storeu_si256((__m256i *) (p + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (p + i)), ones));
+    invert_kernel_scalar(p + i, n - i);
+}
+
+static SIMD_TARGET_AVX2 void brightness_kernel_avx2(unsigned char *p, size_t n, int brightness, int sign) {
+    int delta = kernel_delta(brightness, sign);
+    const __m256i amount = _mm256_set1_epi8((char) (delta < 0 ? -delta : delta));
+    __m256i v;
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (p + i));
+        v = (delta < 0) ? _mm256_subs_epu8(v, amount) : _mm256_adds_epu8(v, amount);
+        _mm256_storeu_si256((__m256i *) (p + i), v);
+    }
+    brightness_kernel_scalar(p + i, n - i, brightness, sign);
+}
+
+static SIMD_TARGET_AVX2 void contrast_kernel_avx2(unsigned char *bgr, size_t npixels, int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+    int lo = kernel_contrast_lo(luma, threshold, sign), hi = kernel_contrast_hi(luma, threshold, sign);
+    const struct avx2_luma w = avx2_luma_weights(luma);
+    const __m256i up = _mm256_set1_epi8((char) (delta > 0 ? delta : 0));
+    const __m256i down = _mm256_set1_epi8((char) (delta < 0 ? -delta : 0));
+    __m256i v[3], m, mp;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 32 <= npixels; i += 32, bgr += 96) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx2_load_split(bgr + 16 * k);
+        m = avx2_luma_in_range(&w, avx2_gather3(v[0], v[1], v[2], 0), avx2_gather3(v[0], v[1], v[2], 1),
+                               avx2_gather3(v[0], v[1], v[2], 2), lo, hi);
+        for (k = 0; k < 3; k++) {
+            // every byte of a selected pixel gets the same saturating adjustment
+            mp = avx2_spread3(m, k);
+            v[k] = _mm256_subs_epu8(_mm256_adds_epu8(v[k], _mm256_and_si256(up, mp)), _mm256_and_si256(down, mp));
+            avx2_store_split(bgr + 16 * k, v[k]);
+        }
+    }
+    contrast_kernel_scalar(bgr, npixels - i, threshold, contrast_factor, sign);
+}
+
+static SIMD_TARGET_AVX2 void threshold_kernel_avx2(unsigned char *bgr, size_t npixels, int threshold) {
+    int lo = luma_bound(luma, threshold), hi = luma_sum_max(luma) + 1;
+    const struct avx2_luma w = avx2_luma_weights(luma);
+    __m256i v[3], white;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 32 <= npixels; i += 32, bgr += 96) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx2_load_split(bgr + 16 * k);
+        white = avx2_luma_in_range(&w, avx2_gather3(v[0], v[1], v[2], 0), avx2_gather3(v[0], v[1], v[2], 1),
+                                   avx2_gather3(v[0], v[1], v[2], 2), lo, hi);
+        for (k = 0; k < 3; k++)
+            avx2_store_split(bgr + 16 * k, avx2_spread3(white, k));
+    }
+    threshold_kernel_scalar(bgr, npixels - i, threshold);
+}
+
+static SIMD_TARGET_AVX2 void contrast_planar_kernel_avx2(unsigned char *b, unsigned char *g, unsigned char *r, size_t n,
+                                                         int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+    int lo = kernel_contrast_lo(luma, threshold, sign), hi = kernel_contrast_hi(luma, threshold, sign);
+    const struct avx2_luma w = avx2_luma_weights(luma);
+    const __m256i up = _mm256_set1_epi8((char) (delta > 0 ? delta : 0));
+    const __m256i down = _mm256_set1_epi8((char) (delta < 0 ? -delta : 0));
+    unsigned char *plane[3] = { b, g, r };
+    __m256i v[3], m;
+    size_t i;
+    int c;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        for (c = 0; c < 3; c++)
+            v[c] = _mm256_loadu_si256((const __m256i *) (plane[c] + i));
+        m = avx2_luma_in_range(&w, v[0], v[1], v[2], lo, hi);
+        for (c = 0; c < 3; c++)
+            _mm256_storeu_si256((__m256i *) (plane[c] + i),
+                                _mm256_subs_epu8(_mm256_adds_epu8(v[c], _mm256_and_si256(up, m)), _mm256_and_si256(down, m)));
+    }
+    contrast_planar_kernel_scalar(b + i, g + i, r + i, n - i, threshold, contrast_factor, sign);
+}
+
+static SIMD_TARGET_AVX2 void threshold_planar_kernel_avx2(unsigned char *b, unsigned char *g, unsigned char *r, size_t n, int threshold) {
+    int lo = luma_bound(luma, threshold), hi = luma_sum_max(luma) + 1;
+    const struct avx2_luma w = avx2_luma_weights(luma);
+    __m256i white;
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        white = avx2_luma_in_range(&w, _mm256_loadu_si256((const __m256i *) (b + i)), _mm256_loadu_si256((const __m256i *) (g + i)),
+                                   _mm256_loadu_si256((const __m256i *) (r + i)), lo, hi);
+        _mm256_storeu_si256((__m256i *) (b + i), white);
+        _mm256_storeu_si256((__m256i *) (g + i), white);
+        _mm256_storeu_si256((__m256i *) (r + i), white);
+    }
+    threshold_planar_kernel_scalar(b + i, g + i, r + i, n - i, threshold);
+}
+
+static SIMD_TARGET_AVX2 void contrast_gray_kernel_avx2(unsigned char *p, size_t n, int threshold, int contrast_factor, int sign) {
+    int bound, delta = kernel_delta(contrast_factor, sign);
+    enum gray_select select = kernel_gray_select(threshold, sign, &bound);
+    const __m256i vbound = _mm256_set1_epi8((char) bound), flip = _mm256_set1_epi8(select == GRAY_BELOW ? -1 : 0);
+    const __m256i up = _mm256_set1_epi8((char) (delta > 0 ? delta : 0));
+    const __m256i down = _mm256_set1_epi8((char) (delta < 0 ? -delta : 0));
+    __m256i v, m;
+    size_t i;
+
+    if (select == GRAY_NONE) return;
+    if (select == GRAY_ALL) {
+        brightness_kernel_avx2(p, n, contrast_factor, sign);
+        return;
+    }
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (p + i));
+        m = _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, vbound), v), flip);
+        _mm256_storeu_si256((__m256i *) (p + i),
+                            _mm256_subs_epu8(_mm256_adds_epu8(v, _mm256_and_si256(up, m)), _mm256_and_si256(down, m)));
+    }
+    contrast_gray_kernel_scalar(p + i, n - i, threshold, contrast_factor, sign);
+}
+
+static SIMD_TARGET_AVX2 void threshold_gray_kernel_avx2(unsigned char *p, size_t n, int threshold) {
+    int bound;
+    enum gray_select select = kernel_gray_white(threshold, &bound);
+    const __m256i vbound = _mm256_set1_epi8((char) bound);
+    __m256i v;
+    size_t i;
+
+    if (select != GRAY_AT_LEAST) {
+        memset (p, (select == GRAY_ALL) ? 255 : 0, n);
+        return;
+    }
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (p + i));
+        _mm256_storeu_si256((__m256i *) (p + i), _mm256_cmpeq_epi8(_mm256_max_epu8(v, vbound), v));
+    }
+    threshold_gray_kernel_scalar(p + i, n - i, threshold);
+}
+
+static SIMD_TARGET_AVX2 void grayscale_kernel_avx2(unsigned char *bgr, size_t npixels) {
+    const struct avx2_luma w = avx2_luma_weights(luma);
+    __m256i v[3], gray;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 32 <= npixels; i += 32, bgr += 96) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx2_load_split(bgr + 16 * k);
+        gray = avx2_luma(&w, avx2_gather3(v[0], v[1], v[2], 0), avx2_gather3(v[0], v[1], v[2], 1),
+                         avx2_gather3(v[0], v[1], v[2], 2));
+        for (k = 0; k < 3; k++)
+            avx2_store_split(bgr + 16 * k, avx2_spread3(gray, k));
+    }
+    grayscale_kernel_scalar(bgr, npixels - i);
+}
+
+static SIMD_TARGET_AVX2 void gray_from_bgr_kernel_avx2(const unsigned char *bgr, unsigned char *gray, size_t npixels) {
+    const struct avx2_luma w = avx2_luma_weights(luma);
+    __m256i v[3];
+    size_t i;
+    int k;
+
+    for (i = 0; i + 32 <= npixels; i += 32, bgr += 96) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx2_load_split(bgr + 16 * k);
+        _mm256_storeu_si256((__m256i *) (gray + i),
+                            avx2_luma(&w, avx2_gather3(v[0], v[1], v[2], 0), avx2_gather3(v[0], v[1], v[2], 1),
+                                      avx2_gather3(v[0], v[1], v[2], 2)));
+    }
+    gray_from_bgr_kernel_scalar(bgr, gray + i, npixels - i);
+}
+
+static SIMD_TARGET_AVX2 void gray_from_planar_kernel_avx2(const unsigned char *b, const unsigned char *g, const unsigned char *r,
+                                                          unsigned char *gray, size_t n) {
+    const struct avx2_luma w = avx2_luma_weights(luma);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32)
+        _mm256_storeu_si256((__m256i *) (gray + i),
+                            avx2_luma(&w, _mm256_loadu_si256((const __m256i *) (b + i)), _mm256_loadu_si256((const __m256i *) (g + i)),
+                                      _mm256_loadu_si256((const __m256i *) (r + i))));
+    gray_from_planar_kernel_scalar(b + i, g + i, r + i, gray + i, n - i);
+}
+
+static SIMD_TARGET_AVX2 void deinterleave_kernel_avx2(const unsigned char *bgr, unsigned char *b, unsigned char *g, unsigned char *r, size_t n) {
+    __m256i v[3];
+    size_t i;
+    int k;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx2_load_split(bgr + 3 * i + 16 * k);
+        _mm256_storeu_si256((__m256i *) (b + i), avx2_gather3(v[0], v[1], v[2], 0));
+        _mm256_storeu_si256((__m256i *) (g + i), avx2_gather3(v[0], v[1], v[2], 1));
+        _mm256_storeu_si256((__m256i *) (r + i), avx2_gather3(v[0], v[1], v[2], 2));
+    }
+    deinterleave_kernel_scalar(bgr + 3 * i, b + i, g + i, r + i, n - i);
+}
+
+static SIMD_TARGET_AVX2 void interleave_kernel_avx2(const unsigned char *b, const unsigned char *g, const unsigned char *r, unsigned char *bgr, size_t n) {
+    __m256i vb, vg, vr;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        vg = _mm256_loadu_si256((const __m256i *) (g + i));
+        vr = _mm256_loadu_si256((const __m256i *) (r + i));
+        for (k = 0; k < 3; k++)
+            avx2_store_split(bgr + 3 * i + 16 * k, avx2_scatter3(vb, vg, vr, k));
+    }
+    interleave_kernel_scalar(b + i, g + i, r + i, bgr + 3 * i, n - i);
+}
+
+// Same pairing as SSE2. Unpacking and packing both work within 128-bit lanes, so
+// after the pack the 16 results are back in order.
+static SIMD_TARGET_AVX2 void resize_vertical_kernel_avx2(const short *const *rows, const short *weights, int taps, unsigned char *out, size_t n) {
+    const __m256i round = _mm256_set1_epi32(1 << (RESIZE_SHIFT - 1));
+    __m256i lo, hi, a, b, w;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        lo = round;
+        hi = round;
+        for (t = 0; t < taps; t += 2) {
+            a = _mm256_loadu_si256((const __m256i *) (rows[t] + i));
+            b = (t + 1 < taps) ? _mm256_loadu_si256((const __m256i *) (rows[t + 1] + i)) : _mm256_setzero_si256();
+            w = _mm256_set1_epi32(resize_weight_pair(weights, t, taps));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        a = _mm256_packs_epi32(_mm256_srai_epi32(lo, RESIZE_SHIFT), _mm256_srai_epi32(hi, RESIZE_SHIFT));
+        // bytes 0-7 end up in the first quarter and 8-15 in the third
+        a = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, a), 0x08);
+        _mm_storeu_si128((__m128i *) (out + i), _mm256_castsi256_si128(a));
+    }
+    resize_vertical_range(rows, weights, taps, out, i, n);
+}
+
+// 16 bytes widened with _mm256_cvtepu8_epi16 keep their order; unpacking and packing
+// within the 128-bit lanes then cancel out, so the results come back in order too
+static SIMD_TARGET_AVX2 void convolve_horizontal_kernel_avx2(const unsigned char *src, const short *weights, int taps,
+                                                             int shift, short *out, size_t n) {
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m256i round = _mm256_set1_epi32(shift ? 1 << (shift - 1) : 0);
+    __m256i lo, hi, a, b, w;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        lo = round;
+        hi = round;
+        for (t = 0; t < taps; t += 2) {
+            a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (src + i + t)));
+            b = (t + 1 < taps) ? _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (src + i + t + 1)))
+                               : _mm256_setzero_si256();
+            w = _mm256_set1_epi32(resize_weight_pair(weights, t, taps));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        _mm256_storeu_si256((__m256i *) (out + i),
+                            _mm256_packs_epi32(_mm256_sra_epi32(lo, count), _mm256_sra_epi32(hi, count)));
+    }
+    convolve_horizontal_range(src, weights, taps, shift, out, i, n);
+}
+
+// lo holds results 0-3 and 8-11, hi 4-7 and 12-15
+static SIMD_TARGET_AVX2 void convolve_vertical_signed_kernel_avx2(const short *const *rows, const short *weights, int taps,
+                                                                  int *out, size_t n) {
+    __m256i lo, hi, a, b, w;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        lo = _mm256_setzero_si256();
+        hi = _mm256_setzero_si256();
+        for (t = 0; t < taps; t += 2) {
+            a = _mm256_loadu_si256((const __m256i *) (rows[t] + i));
+            b = (t + 1 < taps) ? _mm256_loadu_si256((const __m256i *) (rows[t + 1] + i)) : _mm256_setzero_si256();
+            w = _mm256_set1_epi32(resize_weight_pair(weights, t, taps));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (out + i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    convolve_vertical_signed_range(rows, weights, taps, out, i, n);
+}
+
+static inline SIMD_TARGET_AVX2 void avx2_sort2(__m256i *a, __m256i *b) {
+    __m256i t = _mm256_min_epu8(*a, *b);
+
+    *b = _mm256_max_epu8(*a, *b);
+    *a = t;
+}
+
+static inline SIMD_TARGET_AVX2 __m256i avx2_median3(__m256i a, __m256i b, __m256i c) {
+    return _mm256_max_epu8(_mm256_min_epu8(a, b), _mm256_min_epu8(_mm256_max_epu8(a, b), c));
+}
+
+static SIMD_TARGET_AVX2 void median3_kernel_avx2(const unsigned char *const *rows, unsigned char *out, size_t n) {
+    __m256i lo[3], mid[3], hi[3], low, high;
+    size_t i;
+    int j;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        for (j = 0; j < 3; j++) {
+            lo[j] = _mm256_loadu_si256((const __m256i *) (rows[0] + i + j));
+            mid[j] = _mm256_loadu_si256((const __m256i *) (rows[1] + i + j));
+            hi[j] = _mm256_loadu_si256((const __m256i *) (rows[2] + i + j));
+            avx2_sort2(&lo[j], &mid[j]);
+            avx2_sort2(&mid[j], &hi[j]);
+            avx2_sort2(&lo[j], &mid[j]);
+        }
+        low = _mm256_max_epu8(_mm256_max_epu8(lo[0], lo[1]), lo[2]);
+        high = _mm256_min_epu8(_mm256_min_epu8(hi[0], hi[1]), hi[2]);
+        _mm256_storeu_si256((__m256i *) (out + i), avx2_median3(low, avx2_median3(mid[0], mid[1], mid[2]), high));
+    }
+    median3_range(rows, out, i, n);
+}
+
+#endif
+
+/********************************************
+*                 AVX-512BW                 *
+********************************************/
+#if defined(SIMD_HAVE_X86)
+
+// Same layout trick as AVX2 with four lanes: lane k holds pixels 16k to 16k + 15
+static inline SIMD_TARGET_AVX512BW __m512i avx512_table(const signed char *t) {
+    return _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) t));
+}
+
+static inline SIMD_TARGET_AVX512BW __m512i avx512_load_split(const unsigned char *p) {
+    __m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *) p));
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *) (p + 48)), 1);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *) (p + 96)), 2);
+    return _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *) (p + 144)), 3);
+}
+
+static inline SIMD_TARGET_AVX512BW void avx512_store_split(unsigned char *p, __m512i v) {
+    _mm_storeu_si128((__m128i *) p, _mm512_castsi512_si128(v));
+    _mm_storeu_si128((__m128i *) (p + 48), _mm512_extracti32x4_epi32(v, 1));
+    _mm_storeu_si128((__m128i *) (p + 96), _mm512_extracti32x4_epi32(v, 2));
+    _mm_storeu_si128((__m128i *) (p + 144), _mm512_extracti32x4_epi32(v, 3));
+}
+
+static inline SIMD_TARGET_AVX512BW __m512i avx512_gather3(__m512i v0, __m512i v1, __m512i v2, int c) {
+    return _mm512_or_si512(_mm512_or_si512(_mm512_shuffle_epi8(v0, avx512_table(avx2_gather3_shuffle[c][0])),
+                                           _mm512_shuffle_epi8(v1, avx512_table(avx2_gather3_shuffle[c][1]))),
+                           _mm512_shuffle_epi8(v2, avx512_table(avx2_gather3_shuffle[c][2])));
+}
+
+static inline SIMD_TARGET_AVX512BW __m512i avx512_scatter3(__m512i b, __m512i g, __m512i r, int piece) {
+    return _mm512_or_si512(_mm512_or_si512(_mm512_shuffle_epi8(b, avx512_table(avx2_scatter3_shuffle[0][piece])),
+                                           _mm512_shuffle_epi8(g, avx512_table(avx2_scatter3_shuffle[1][piece]))),
+                           _mm512_shuffle_epi8(r, avx512_table(avx2_scatter3_shuffle[2][piece])));
+}
+
+struct avx512_luma {
+    __m512i wb, wg, wr, add, mul;
+    int unit;                   // all weights one, see luma_unit
+};
+
+static inline SIMD_TARGET_AVX512BW struct avx512_luma avx512_luma_weights(const struct luma_weights *l) {
+    struct avx512_luma w;
+
+    w.wb = _mm512_set1_epi16((short) l->wb);
+    w.wg = _mm512_set1_epi16((short) l->wg);
+    w.wr = _mm512_set1_epi16((short) l->wr);
+    w.add = _mm512_set1_epi16((short) l->add);
+    w.mul = _mm512_set1_epi16((short) l->mul);
+    w.unit = luma_unit(l);
+    return w;
+}
+
+static inline SIMD_TARGET_AVX512BW __m512i avx512_luma_sum(const struct avx512_luma *w, __m512i b, __m512i g, __m512i r) {
+    if (w->unit) return _mm512_add_epi16(_mm512_add_epi16(b, g), r);
+    return _mm512_add_epi16(_mm512_add_epi16(_mm512_mullo_epi16(b, w->wb), _mm512_mullo_epi16(g, w->wg)),
+                            _mm512_mullo_epi16(r, w->wr));
+}
+
+// 0xff for each of 64 pixels whose luma sum lies in [lo, hi)
+static inline SIMD_TARGET_AVX512BW __m512i avx512_luma_in_range(const struct avx512_luma *w, __m512i b, __m512i g, __m512i r,
+                                                                int lo, int hi) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i vlo = _mm512_set1_epi16((short) lo), vhi = _mm512_set1_epi16((short) hi);
+    __m512i sum_lo = avx512_luma_sum(w, _mm512_unpacklo_epi8(b, zero), _mm512_unpacklo_epi8(g, zero),
+                                     _mm512_unpacklo_epi8(r, zero));
+    __m512i sum_hi = avx512_luma_sum(w, _mm512_unpackhi_epi8(b, zero), _mm512_unpackhi_epi8(g, zero),
+                                     _mm512_unpackhi_epi8(r, zero));
+    __mmask32 in_lo = _mm512_cmpge_epu16_mask(sum_lo, vlo) & _mm512_cmplt_epu16_mask(sum_lo, vhi);
+    __mmask32 in_hi = _mm512_cmpge_epu16_mask(sum_hi, vlo) & _mm512_cmplt_epu16_mask(sum_hi, vhi);
+    return _mm512_packs_epi16(_mm512_movm_epi16(in_lo), _mm512_movm_epi16(in_hi));
+}
+
+// Gray levels of 64 pixels, in order as with AVX2
+static inline SIMD_TARGET_AVX512BW __m512i avx512_luma(const struct avx512_luma *w, __m512i b, __m512i g, __m512i r) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i sum_lo = avx512_luma_sum(w, _mm512_unpacklo_epi8(b, zero), _mm512_unpacklo_epi8(g, zero),
+                                     _mm512_unpacklo_epi8(r, zero));
+    __m512i sum_hi = avx512_luma_sum(w, _mm512_unpackhi_epi8(b, zero), _mm512_unpackhi_epi8(g, zero),
+                                     _mm512_unpackhi_epi8(r, zero));
+    sum_lo = _mm512_srli_epi16(_mm512_mulhi_epu16(_mm512_add_epi16(sum_lo, w->add), w->mul), LUMA_SHIFT - 16);
+    sum_hi = _mm512_srli_epi16(_mm512_mulhi_epu16(_mm512_add_epi16(sum_hi, w->add), w->mul), LUMA_SHIFT - 16);
+    return _mm512_packus_epi16(sum_lo, sum_hi);
+}
+
+static inline SIMD_TARGET_AVX512BW __m512i avx512_spread3(__m512i m, int piece) {
+    return _mm512_shuffle_epi8(m, avx512_table(avx2_spread3_shuffle[piece]));
+}
+
+static SIMD_TARGET_AVX512BW void invert_kernel_avx512bw(unsigned char *p, size_t n) {
+    const __m512i ones = _mm512_set1_epi8(-1);
+    size_t i;
+
+    for (i = 0; i + 64 <= n; i += 64)
+        _mm512_storeu_si512((void *) (p + i), _mm512_xor_si512(_mm512_loadu_si512((const void *) (p + i)), ones));
+    invert_kernel_scalar(p + i, n - i);
+}
+
+static SIMD_TARGET_AVX512BW void brightness_kernel_avx512bw(unsigned char *p, size_t n, int brightness, int sign) {
+    int delta = kernel_delta(brightness, sign);
+    const __m512i amount = _mm512_set1_epi8((char) (delta < 0 ? -delta : delta));
+    __m512i v;
+    size_t i;
+
+    for (i = 0; i + 64 <= n; i += 64) {
+        v = _mm512_loadu_si512((const void *) (p + i));
+        v = (delta < 0) ? _mm512_subs_epu8(v, amount) : _mm512_adds_epu8(v, amount);
+        _mm512_storeu_si512((void *) (p + i), v);
+    }
+    brightness_kernel_scalar(p + i, n - i, brightness, sign);
+}
+
+static SIMD_TARGET_AVX512BW void contrast_kernel_avx512bw(unsigned char *bgr, size_t npixels, int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+    int lo = kernel_contrast_lo(luma, threshold, sign), hi = kernel_contrast_hi(luma, threshold, sign);
+    const struct avx512_luma w = avx512_luma_weights(luma);
+    const __m512i up = _mm512_set1_epi8((char) (delta > 0 ? delta : 0));
+    const __m512i down = _mm512_set1_epi8((char) (delta < 0 ? -delta : 0));
+    __m512i v[3], m, mp;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 64 <= npixels; i += 64, bgr += 192) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx512_load_split(bgr + 16 * k);
+        m = avx512_luma_in_range(&w, avx512_gather3(v[0], v[1], v[2], 0), avx512_gather3(v[0], v[1], v[2], 1),
+                                 avx512_gather3(v[0], v[1], v[2], 2), lo, hi);
+        for (k = 0; k < 3; k++) {
+            mp = avx512_spread3(m, k);
+            v[k] = _mm512_subs_epu8(_mm512_adds_epu8(v[k], _mm512_and_si512(up, mp)), _mm512_and_si512(down, mp));
+            avx512_store_split(bgr + 16 * k, v[k]);
+        }
+    }
+    contrast_kernel_scalar(bgr, npixels - i, threshold, contrast_factor, sign);
+}
+
+static SIMD_TARGET_AVX512BW void threshold_kernel_avx512bw(unsigned char *bgr, size_t npixels, int threshold) {
+    int lo = luma_bound(luma, threshold), hi = luma_sum_max(luma) + 1;
+    const struct avx512_luma w = avx512_luma_weights(luma);
+    __m512i v[3], white;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 64 <= npixels; i += 64, bgr += 192) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx512_load_split(bgr + 16 * k);
+        white = avx512_luma_in_range(&w, avx512_gather3(v[0], v[1], v[2], 0), avx512_gather3(v[0], v[1], v[2], 1),
+                                     avx512_gather3(v[0], v[1], v[2], 2), lo, hi);
+        for (k = 0; k < 3; k++)
+            avx512_store_split(bgr + 16 * k, avx512_spread3(white, k));
+    }
+    threshold_kernel_scalar(bgr, npixels - i, threshold);
+}
+
+static SIMD_TARGET_AVX512BW void contrast_planar_kernel_avx512bw(unsigned char *b, unsigned char *g, unsigned char *r, size_t n,
+                                                                 int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+    int lo = kernel_contrast_lo(luma, threshold, sign), hi = kernel_contrast_hi(luma, threshold, sign);
+    const struct avx512_luma w = avx512_luma_weights(luma);
+    const __m512i up = _mm512_set1_epi8((char) (delta > 0 ? delta : 0));
+    const __m512i down = _mm512_set1_epi8((char) (delta < 0 ? -delta : 0));
+    unsigned char *plane[3] = { b, g, r };
+    __m512i v[3], m;
+    size_t i;
+    int c;
+
+    for (i = 0; i + 64 <= n; i += 64) {
+        for (c = 0; c < 3; c++)
+            v[c] = _mm512_loadu_si512((const void *) (plane[c] + i));
+        m = avx512_luma_in_range(&w, v[0], v[1], v[2], lo, hi);
+        for (c = 0; c < 3; c++)
+            _mm512_storeu_si512((void *) (plane[c] + i),
+                                _mm512_subs_epu8(_mm512_adds_epu8(v[c], _mm512_and_si512(up, m)), _mm512_and_si512(down, m)));
+    }
+    contrast_planar_kernel_scalar(b + i, g + i, r + i, n - i, threshold, contrast_factor, sign);
+}
+
+static SIMD_TARGET_AVX512BW void threshold_planar_kernel_avx512bw(unsigned char *b, unsigned char *g, unsigned char *r, size_t n, int threshold) {
+    int lo = luma_bound(luma, threshold), hi = luma_sum_max(luma) + 1;
+    const struct avx512_luma w = avx512_luma_weights(luma);
+    __m512i white;
+    size_t i;
+
+    for (i = 0; i + 64 <= n; i += 64) {
+        white = avx512_luma_in_range(&w, _mm512_loadu_si512((const void *) (b + i)), _mm512_loadu_si512((const void *) (g + i)),
+                                     _mm512_loadu_si512((const void *) (r + i)), lo, hi);
+        _mm512_storeu_si512((void *) (b + i), white);
+        _mm512_storeu_si512((void *) (g + i), white);
+        _mm512_storeu_si512((void *) (r + i), white);
+    }
+    threshold_planar_kernel_scalar(b + i, g + i, r + i, n - i, threshold);
+}
+
+static SIMD_TARGET_AVX512BW void contrast_gray_kernel_avx512bw(unsigned char *p, size_t n, int threshold, int contrast_factor, int sign) {
+    int bound, delta = kernel_delta(contrast_factor, sign);
+    enum gray_select select = kernel_gray_select(threshold, sign, &bound);
+    const __m512i vbound = _mm512_set1_epi8((char) bound);
+    const __mmask64 flip = (select == GRAY_BELOW) ? ~(__mmask64) 0 : 0;
+    const __m512i up = _mm512_set1_epi8((char) (delta > 0 ? delta : 0));
+    const __m512i down = _mm512_set1_epi8((char) (delta < 0 ? -delta : 0));
+    __m512i v;
+    __mmask64 m;
+    size_t i;
+
+    if (select == GRAY_NONE) return;
+    if (select == GRAY_ALL) {
+        brightness_kernel_avx512bw(p, n, contrast_factor, sign);
+        return;
+    }
+    for (i = 0; i + 64 <= n; i += 64) {
+        v = _mm512_loadu_si512((const void *) (p + i));
+        m = _mm512_cmpge_epu8_mask(v, vbound) ^ flip;
+        _mm512_storeu_si512((void *) (p + i), _mm512_mask_subs_epu8(v, m, _mm512_adds_epu8(v, up), down));
+    }
+    contrast_gray_kernel_scalar(p + i, n - i, threshold, contrast_factor, sign);
+}
+
+static SIMD_TARGET_AVX512BW void threshold_gray_kernel_avx512bw(unsigned char *p, size_t n, int threshold) {
+    int bound;
+    enum gray_select select = kernel_gray_white(threshold, &bound);
+    const __m512i vbound = _mm512_set1_epi8((char) bound);
+    size_t i;
+
+    if (select != GRAY_AT_LEAST) {
+        memset (p, (select == GRAY_ALL) ? 255 : 0, n);
+        return;
+    }
+    for (i = 0; i + 64 <= n; i += 64)
+        _mm512_storeu_si512((void *) (p + i),
+                            _mm512_movm_epi8(_mm512_cmpge_epu8_mask(_mm512_loadu_si512((const void *) (p + i)), vbound)));
+    threshold_gray_kernel_scalar(p + i, n - i, threshold);
+}
+
+static SIMD_TARGET_AVX512BW void grayscale_kernel_avx512bw(unsigned char *bgr, size_t npixels) {
+    const struct avx512_luma w = avx512_luma_weights(luma);
+    __m512i v[3], gray;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 64 <= npixels; i += 64, bgr += 192) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx512_load_split(bgr + 16 * k);
+        gray = avx512_luma(&w, avx512_gather3(v[0], v[1], v[2], 0), avx512_gather3(v[0], v[1], v[2], 1),
+                           avx512_gather3(v[0], v[1], v[2], 2));
+        for (k = 0; k < 3; k++)
+            avx512_store_split(bgr + 16 * k, avx512_spread3(gray, k));
+    }
+    grayscale_kernel_scalar(bgr, npixels - i);
+}
+
+static SIMD_TARGET_AVX512BW void gray_from_bgr_kernel_avx512bw(const unsigned char *bgr, unsigned char *gray, size_t npixels) {
+    const struct avx512_luma w = avx512_luma_weights(luma);
+    __m512i v[3];
+    size_t i;
+    int k;
+
+    for (i = 0; i + 64 <= npixels; i += 64, bgr += 192) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx512_load_split(bgr + 16 * k);
+        _mm512_storeu_si512((void *) (gray + i),
+                            avx512_luma(&w, avx512_gather3(v[0], v[1], v[2], 0), avx512_gather3(v[0], v[1], v[2], 1),
+                                        avx512_gather3(v[0], v[1], v[2], 2)));
+    }
+    gray_from_bgr_kernel_scalar(bgr, gray + i, npixels - i);
+}
+
+static SIMD_TARGET_AVX512BW void gray_from_planar_kernel_avx512bw(const unsigned char *b, const unsigned char *g,
+                                                                  const unsigned char *r, unsigned char *gray, size_t n) {
+    const struct avx512_luma w = avx512_luma_weights(luma);
+    size_t i;
+
+    for (i = 0; i + 64 <= n; i += 64)
+        _mm512_storeu_si512((void *) (gray + i),
+                            avx512_luma(&w, _mm512_loadu_si512((const void *) (b + i)), _mm512_loadu_si512((const void *) (g + i)),
+                                        _mm512_loadu_si512((const void *) (r + i))));
+    gray_from_planar_kernel_scalar(b + i, g + i, r + i, gray + i, n - i);
+}
+
+static SIMD_TARGET_AVX512BW void deinterleave_kernel_avx512bw(const unsigned char *bgr, unsigned char *b, unsigned char *g, unsigned char *r, size_t n) {
+    __m512i v[3];
+    size_t i;
+    int k;
+
+    for (i = 0; i + 64 <= n; i += 64) {
+        for (k = 0; k < 3; k++)
+            v[k] = avx512_load_split(bgr + 3 * i + 16 * k);
+        _mm512_storeu_si512((void *) (b + i), avx512_gather3(v[0], v[1], v[2], 0));
+        _mm512_storeu_si512((void *) (g + i), avx512_gather3(v[0], v[1], v[2], 1));
+        _mm512_storeu_si512((void *) (r + i), avx512_gather3(v[0], v[1], v[2], 2));
+    }
+    deinterleave_kernel_scalar(bgr + 3 * i, b + i, g + i, r + i, n - i);
+}
+
+static SIMD_TARGET_AVX512BW void interleave_kernel_avx512bw(const unsigned char *b, const unsigned char *g, const unsigned char *r, unsigned char *bgr, size_t n) {
+    __m512i vb, vg, vr;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 64 <= n; i += 64) {
+        vb = _mm512_loadu_si512((const void *) (b + i));
+        vg = _mm512_loadu_si512((const void *) (g + i));
+        vr = _mm512_loadu_si512((const void *) (r + i));
+        for (k = 0; k < 3; k++)
+            avx512_store_split(bgr + 3 * i + 16 * k, avx512_scatter3(vb, vg, vr, k));
+    }
+    interleave_kernel_scalar(b + i, g + i, r + i, bgr + 3 * i, n - i);
+}
+
+static SIMD_TARGET_AVX512BW void resize_vertical_kernel_avx512bw(const short *const *rows, const short *weights, int taps, unsigned char *out, size_t n) {
+    const __m512i round = _mm512_set1_epi32(1 << (RESIZE_SHIFT - 1));
+    __m512i lo, hi, a, b, w;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        lo = round;
+        hi = round;
+        for (t = 0; t < taps; t += 2) {
+            a = _mm512_loadu_si512((const void *) (rows[t] + i));
+            b = (t + 1 < taps) ? _mm512_loadu_si512((const void *) (rows[t + 1] + i)) : _mm512_setzero_si512();
+            w = _mm512_set1_epi32(resize_weight_pair(weights, t, taps));
+            lo = _mm512_add_epi32(lo, _mm512_madd_epi16(_mm512_unpacklo_epi16(a, b), w));
+            hi = _mm512_add_epi32(hi, _mm512_madd_epi16(_mm512_unpackhi_epi16(a, b), w));
+        }
+        // the results are in 0..255, so truncating each 16-bit lane gives the bytes
+        a = _mm512_packs_epi32(_mm512_srai_epi32(lo, RESIZE_SHIFT), _mm512_srai_epi32(hi, RESIZE_SHIFT));
+        _mm256_storeu_si256((__m256i *) (out + i), _mm512_cvtepi16_epi8(a));
+    }
+    resize_vertical_range(rows, weights, taps, out, i, n);
+}
+
+static SIMD_TARGET_AVX512BW void convolve_horizontal_kernel_avx512bw(const unsigned char *src, const short *weights,
+                                                                     int taps, int shift, short *out, size_t n) {
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m512i round = _mm512_set1_epi32(shift ? 1 << (shift - 1) : 0);
+    __m512i lo, hi, a, b, w;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        lo = round;
+        hi = round;
+        for (t = 0; t < taps; t += 2) {
+            a = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (src + i + t)));
+            b = (t + 1 < taps) ? _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *) (src + i + t + 1)))
+                               : _mm512_setzero_si512();
+            w = _mm512_set1_epi32(resize_weight_pair(weights, t, taps));
+            lo = _mm512_add_epi32(lo, _mm512_madd_epi16(_mm512_unpacklo_epi16(a, b), w));
+            hi = _mm512_add_epi32(hi, _mm512_madd_epi16(_mm512_unpackhi_epi16(a, b), w));
+        }
+        _mm512_storeu_si512((void *) (out + i),
+                            _mm512_packs_epi32(_mm512_sra_epi32(lo, count), _mm512_sra_epi32(hi, count)));
+    }
+    convolve_horizontal_range(src, weights, taps, shift, out, i, n);
+}
+
+// lo and hi take turns by 128-bit lane: lo holds results 0-3, 8-11, 16-19 and 24-27
+static SIMD_TARGET_AVX512BW void convolve_vertical_signed_kernel_avx512bw(const short *const *rows, const short *weights,
+                                                                          int taps, int *out, size_t n) {
+    const __m512i first = _mm512_set_epi64(11, 10, 3, 2, 9, 8, 1, 0);
+    const __m512i second = _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4);
+    __m512i lo, hi, a, b, w;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        lo = _mm512_setzero_si512();
+        hi = _mm512_setzero_si512();
+        for (t = 0; t < taps; t += 2) {
+            a = _mm512_loadu_si512((const void *) (rows[t] + i));
+            b = (t + 1 < taps) ? _mm512_loadu_si512((const void *) (rows[t + 1] + i)) : _mm512_setzero_si512();
+            w = _mm512_set1_epi32(resize_weight_pair(weights, t, taps));
+            lo = _mm512_add_epi32(lo, _mm512_madd_epi16(_mm512_unpacklo_epi16(a, b), w));
+            hi = _mm512_add_epi32(hi, _mm512_madd_epi16(_mm512_unpackhi_epi16(a, b), w));
+        }
+        _mm512_storeu_si512((void *) (out + i), _mm512_permutex2var_epi64(lo, first, hi));
+        _mm512_storeu_si512((void *) (out + i + 16), _mm512_permutex2var_epi64(lo, second, hi));
+    }
+    convolve_vertical_signed_range(rows, weights, taps, out, i, n);
+}
+
+static inline SIMD_TARGET_AVX512BW void avx512_sort2(__m512i *a, __m512i *b) {
+    __m512i t = _mm512_min_epu8(*a, *b);
+
+    *b = _mm512_max_epu8(*a, *b);
+    *a = t;
+}
+
+static inline SIMD_TARGET_AVX512BW __m512i avx512_median3(__m512i a, __m512i b, __m512i c) {
+    return _mm512_max_epu8(_mm512_min_epu8(a, b), _mm512_min_epu8(_mm512_max_epu8(a, b), c));
+}
+
+static SIMD_TARGET_AVX512BW void median3_kernel_avx512bw(const unsigned char *const *rows, unsigned char *out,
+                                                         size_t n) {
+    __m512i lo[3], mid[3], hi[3], low, high;
+    size_t i;
+    int j;
+
+    for (i = 0; i + 64 <= n; i += 64) {
+        for (j = 0; j < 3; j++) {
+            lo[j] = _mm512_loadu_si512((const void *) (rows[0] + i + j));
+            mid[j] = _mm512_loadu_si512((const void *) (rows[1] + i + j));
+            hi[j] = _mm512_loadu_si512((const void *) (rows[2] + i + j));
+            avx512_sort2(&lo[j], &mid[j]);
+            avx512_sort2(&mid[j], &hi[j]);
+            avx512_sort2(&lo[j], &mid[j]);
+        }
+        low = _mm512_max_epu8(_mm512_max_epu8(lo[0], lo[1]), lo[2]);
+        high = _mm512_min_epu8(_mm512_min_epu8(hi[0], hi[1]), hi[2]);
+        _mm512_storeu_si512((void *) (out + i), avx512_median3(low, avx512_median3(mid[0], mid[1], mid[2]), high));
+    }
+    median3_range(rows, out, i, n);
+}
+
+#endif
+
+/********************************************
+*                   NEON                    *
+********************************************/
+#if defined(SIMD_HAVE_NEON)
+
+// Luma weights (luma.h): the channel weights fit in a byte, so the sums are widening
+// byte multiply-accumulates
+struct neon_luma {
+    uint8x8_t wb, wg, wr;
+    uint16x8_t add;
+    uint16x4_t mul;
+    int unit;                   // all weights one, see luma_unit
+};
+
+static inline struct neon_luma neon_luma_weights(const struct luma_weights *l) {
+    struct neon_luma w;
+
+    w.wb = vdup_n_u8((uint8_t) l->wb);
+    w.wg = vdup_n_u8((uint8_t) l->wg);
+    w.wr = vdup_n_u8((uint8_t) l->wr);
+    w.add = vdupq_n_u16((uint16_t) l->add);
+    w.mul = vdup_n_u16((uint16_t) l->mul);
+    w.unit = luma_unit(l);
+    return w;
+}
+
+static inline uint16x8_t neon_luma_sum(const struct neon_luma *w, uint8x8_t b, uint8x8_t g, uint8x8_t r) {
+    if (w->unit) return vaddw_u8(vaddl_u8(b, g), r);
+    return vmlal_u8(vmlal_u8(vmull_u8(b, w->wb), g, w->wg), r, w->wr);
+}
+
+// 0xff for each of 16 pixels whose luma sum lies in [lo, hi)
+static inline uint8x16_t neon_luma_in_range(const struct neon_luma *w, uint8x16x3_t px, int lo, int hi) {
+    uint16x8_t sum_lo = neon_luma_sum(w, vget_low_u8(px.val[0]), vget_low_u8(px.val[1]), vget_low_u8(px.val[2]));
+    uint16x8_t sum_hi = neon_luma_sum(w, vget_high_u8(px.val[0]), vget_high_u8(px.val[1]), vget_high_u8(px.val[2]));
+    uint16x8_t vlo = vdupq_n_u16((uint16_t) lo), vhi = vdupq_n_u16((uint16_t) hi);
+    uint16x8_t in_lo = vandq_u16(vcgeq_u16(sum_lo, vlo), vcltq_u16(sum_lo, vhi));
+    uint16x8_t in_hi = vandq_u16(vcgeq_u16(sum_hi, vlo), vcltq_u16(sum_hi, vhi));
+    return vcombine_u8(vmovn_u16(in_lo), vmovn_u16(in_hi));
+}
+
+// Gray levels of 8 pixels from their sums; NEON has no 16-bit high-half multiply, so
+// the products are widened and narrowed again by the first 16 bits of the shift
+static inline uint8x8_t neon_luma_gray(const struct neon_luma *w, uint16x8_t sum) {
+    uint16x8_t s = vaddq_u16(sum, w->add);
+    uint16x8_t high = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(s), w->mul), 16),
+                                   vshrn_n_u32(vmull_u16(vget_high_u16(s), w->mul), 16));
+    return vmovn_u16(vshrq_n_u16(high, LUMA_SHIFT - 16));
+}
+
+// Gray levels of 16 pixels
+static inline uint8x16_t neon_luma(const struct neon_luma *w, uint8x16x3_t px) {
+    return vcombine_u8(neon_luma_gray(w, neon_luma_sum(w, vget_low_u8(px.val[0]), vget_low_u8(px.val[1]), vget_low_u8(px.val[2]))),
+                       neon_luma_gray(w, neon_luma_sum(w, vget_high_u8(px.val[0]), vget_high_u8(px.val[1]), vget_high_u8(px.val[2]))));
+}
+
+static void invert_kernel_neon(unsigned char *p, size_t n) {
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+        vst1q_u8(p + i, vmvnq_u8(vld1q_u8(p + i)));
+    invert_kernel_scalar(p + i, n - i);
+}
+
+static void brightness_kernel_neon(unsigned char *p, size_t n, int brightness, int sign) {
+    int delta = kernel_delta(brightness, sign);
+    const uint8x16_t amount = vdupq_n_u8((uint8_t) (delta < 0 ? -delta : delta));
+    size_t i;
+
+    if (delta < 0) {
+        for (i = 0; i + 16 <= n; i += 16)
+            vst1q_u8(p + i, vqsubq_u8(vld1q_u8(p + i), amount));
+    } else {
+        for (i = 0; i + 16 <= n; i += 16)
+            vst1q_u8(p + i, vqaddq_u8(vld1q_u8(p + i), amount));
+    }
+    brightness_kernel_scalar(p + i, n - i, brightness, sign);
+}
+
+static void contrast_kernel_neon(unsigned char *bgr, size_t npixels, int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+    int lo = kernel_contrast_lo(luma, threshold, sign), hi = kernel_contrast_hi(luma, threshold, sign);
+    const struct neon_luma w = neon_luma_weights(luma);
+    const uint8x16_t up = vdupq_n_u8((uint8_t) (delta > 0 ? delta : 0));
+    const uint8x16_t down = vdupq_n_u8((uint8_t) (delta < 0 ? -delta : 0));
+    uint8x16x3_t px;
+    uint8x16_t m;
+    size_t i;
+    int c;
+
+    for (i = 0; i + 16 <= npixels; i += 16, bgr += 48) {
+        px = vld3q_u8(bgr);
+        m = neon_luma_in_range(&w, px, lo, hi);
+        for (c = 0; c < 3; c++)
+            px.val[c] = vqsubq_u8(vqaddq_u8(px.val[c], vandq_u8(up, m)), vandq_u8(down, m));
+        vst3q_u8(bgr, px);
+    }
+    contrast_kernel_scalar(bgr, npixels - i, threshold, contrast_factor, sign);
+}
+
+static void threshold_kernel_neon(unsigned char *bgr, size_t npixels, int threshold) {
+    int lo = luma_bound(luma, threshold), hi = luma_sum_max(luma) + 1;
+    const struct neon_luma w = neon_luma_weights(luma);
+    uint8x16x3_t px;
+    size_t i;
+
+    for (i = 0; i + 16 <= npixels; i += 16, bgr += 48) {
+        px = vld3q_u8(bgr);
+        px.val[0] = neon_luma_in_range(&w, px, lo, hi);
+        px.val[1] = px.val[0];
+        px.val[2] = px.val[0];
+        vst3q_u8(bgr, px);
+    }
+    threshold_kernel_scalar(bgr, npixels - i, threshold);
+}
+
+static void contrast_planar_kernel_neon(unsigned char *b, unsigned char *g, unsigned char *r, size_t n,
+                                        int threshold, int contrast_factor, int sign) {
+    int delta = kernel_delta(contrast_factor, sign);
+    int lo = kernel_contrast_lo(luma, threshold, sign), hi = kernel_contrast_hi(luma, threshold, sign);
+    const struct neon_luma w = neon_luma_weights(luma);
+    const uint8x16_t up = vdupq_n_u8((uint8_t) (delta > 0 ? delta : 0));
+    const uint8x16_t down = vdupq_n_u8((uint8_t) (delta < 0 ? -delta : 0));
+    unsigned char *plane[3] = { b, g, r };
+    uint8x16x3_t px;
+    uint8x16_t m;
+    size_t i;
+    int c;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        for (c = 0; c < 3; c++)
+            px.val[c] = vld1q_u8(plane[c] + i);
+        m = neon_luma_in_range(&w, px, lo, hi);
+        for (c = 0; c < 3; c++)
+            vst1q_u8(plane[c] + i, vqsubq_u8(vqaddq_u8(px.val[c], vandq_u8(up, m)), vandq_u8(down, m)));
+    }
+    contrast_planar_kernel_scalar(b + i, g + i, r + i, n - i, threshold, contrast_factor, sign);
+}
+
+static void threshold_planar_kernel_neon(unsigned char *b, unsigned char *g, unsigned char *r, size_t n, int threshold) {
+    int lo = luma_bound(luma, threshold), hi = luma_sum_max(luma) + 1;
+    const struct neon_luma w = neon_luma_weights(luma);
+    uint8x16x3_t px;
+    uint8x16_t white;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        px.val[0] = vld1q_u8(b + i);
+        px.val[1] = vld1q_u8(g + i);
+        px.val[2] = vld1q_u8(r + i);
+        white = neon_luma_in_range(&w, px, lo, hi);
+        vst1q_u8(b + i, white);
+        vst1q_u8(g + i, white);
+        vst1q_u8(r + i, white);
+    }
+    threshold_planar_kernel_scalar(b + i, g + i, r + i, n - i, threshold);
+}
+
+static void contrast_gray_kernel_neon(unsigned char *p, size_t n, int threshold, int contrast_factor, int sign) {
+    int bound, delta = kernel_delta(contrast_factor, sign);
+    enum gray_select select = kernel_gray_select(threshold, sign, &bound);
+    const uint8x16_t vbound = vdupq_n_u8((uint8_t) bound), flip = vdupq_n_u8(select == GRAY_BELOW ? 0xff : 0);
+    const uint8x16_t up = vdupq_n_u8((uint8_t) (delta > 0 ? delta : 0));
+    const uint8x16_t down = vdupq_n_u8((uint8_t) (delta < 0 ? -delta : 0));
+    uint8x16_t v, m;
+    size_t i;
+
+    if (select == GRAY_NONE) return;
+    if (select == GRAY_ALL) {
+        brightness_kernel_neon(p, n, contrast_factor, sign);
+        return;
+    }
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = vld1q_u8(p + i);
+        m = veorq_u8(vcgeq_u8(v, vbound), flip);
+        vst1q_u8(p + i, vqsubq_u8(vqaddq_u8(v, vandq_u8(up, m)), vandq_u8(down, m)));
+    }
+    contrast_gray_kernel_scalar(p + i, n - i, threshold, contrast_factor, sign);
+}
+
+static void threshold_gray_kernel_neon(unsigned char *p, size_t n, int threshold) {
+    int bound;
+    enum gray_select select = kernel_gray_white(threshold, &bound);
+    const uint8x16_t vbound = vdupq_n_u8((uint8_t) bound);
+    size_t i;
+
+    if (select != GRAY_AT_LEAST) {
+        memset (p, (select == GRAY_ALL) ? 255 : 0, n);
+        return;
+    }
+    for (i = 0; i + 16 <= n; i += 16)
+        vst1q_u8(p + i, vcgeq_u8(vld1q_u8(p + i), vbound));
+    threshold_gray_kernel_scalar(p + i, n - i, threshold);
+}
+
+static void grayscale_kernel_neon(unsigned char *bgr, size_t npixels) {
+    const struct neon_luma w = neon_luma_weights(luma);
+    uint8x16x3_t px;
+    size_t i;
+
+    for (i = 0; i + 16 <= npixels; i += 16, bgr += 48) {
+        px = vld3q_u8(bgr);
+        px.val[0] = neon_luma(&w, px);
+        px.val[1] = px.val[0];
+        px.val[2] = px.val[0];
+        vst3q_u8(bgr, px);
+    }
+    grayscale_kernel_scalar(bgr, npixels - i);
+}
+
+static void gray_from_bgr_kernel_neon(const unsigned char *bgr, unsigned char *gray, size_t npixels) {
+    const struct neon_luma w = neon_luma_weights(luma);
+    size_t i;
+
+    for (i = 0; i + 16 <= npixels; i += 16, bgr += 48)
+        vst1q_u8(gray + i, neon_luma(&w, vld3q_u8(bgr)));
+    gray_from_bgr_kernel_scalar(bgr, gray + i, npixels - i);
+}
+
+static void gray_from_planar_kernel_neon(const unsigned char *b, const unsigned char *g, const unsigned char *r,
+                                         unsigned char *gray, size_t n) {
+    const struct neon_luma w = neon_luma_weights(luma);
+    uint8x16x3_t px;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        px.val[0] = vld1q_u8(b + i);
+        px.val[1] = vld1q_u8(g + i);
+        px.val[2] = vld1q_u8(r + i);
+        vst1q_u8(gray + i, neon_luma(&w, px));
+    }
+    gray_from_planar_kernel_scalar(b + i, g + i, r + i, gray + i, n - i);
+}
+
+static void deinterleave_kernel_neon(const unsigned char *bgr, unsigned char *b, unsigned char *g, unsigned char *r, size_t n) {
+    uint8x16x3_t px;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        px = vld3q_u8(bgr + 3 * i);
+        vst1q_u8(b + i, px.val[0]);
+        vst1q_u8(g + i, px.val[1]);
+        vst1q_u8(r + i, px.val[2]);
+    }
+    deinterleave_kernel_scalar(bgr + 3 * i, b + i, g + i, r + i, n - i);
+}
+
+static void interleave_kernel_neon(const unsigned char *b, const unsigned char *g, const unsigned char *r, unsigned char *bgr, size_t n) {
+    uint8x16x3_t px;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        px.val[0] = vld1q_u8(b + i);
+        px.val[1] = vld1q_u8(g + i);
+        px.val[2] = vld1q_u8(r + i);
+        vst3q_u8(bgr + 3 * i, px);
+    }
+    interleave_kernel_scalar(b + i, g + i, r + i, bgr + 3 * i, n - i);
+}
+
+static void resize_vertical_kernel_neon(const short *const *rows, const short *weights, int taps, unsigned char *out, size_t n) {
+    int32x4_t lo, hi;
+    int16x8_t a;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        lo = vdupq_n_s32(1 << (RESIZE_SHIFT - 1));
+        hi = lo;
+        for (t = 0; t < taps; t++) {
+            a = vld1q_s16(rows[t] + i);
+            lo = vmlal_n_s16(lo, vget_low_s16(a), weights[t]);
+            hi = vmlal_n_s16(hi, vget_high_s16(a), weights[t]);
+        }
+        a = vcombine_s16(vmovn_s32(vshrq_n_s32(lo, RESIZE_SHIFT)), vmovn_s32(vshrq_n_s32(hi, RESIZE_SHIFT)));
+        vst1_u8(out + i, vqmovun_s16(a));
+    }
+    resize_vertical_range(rows, weights, taps, out, i, n);
+}
+
+static void convolve_horizontal_kernel_neon(const unsigned char *src, const short *weights, int taps, int shift,
+                                            short *out, size_t n) {
+    const int32x4_t round = vdupq_n_s32(shift ? 1 << (shift - 1) : 0), count = vdupq_n_s32(-shift);
+    int32x4_t lo, hi;
+    int16x8_t a;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        lo = round;
+        hi = round;
+        for (t = 0; t < taps; t++) {
+            a = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(src + i + t)));
+            lo = vmlal_n_s16(lo, vget_low_s16(a), weights[t]);
+            hi = vmlal_n_s16(hi, vget_high_s16(a), weights[t]);
+        }
+        // a shift left by a negative count is an arithmetic shift right
+        vst1q_s16(out + i, vcombine_s16(vmovn_s32(vshlq_s32(lo, count)), vmovn_s32(vshlq_s32(hi, count))));
+    }
+    convolve_horizontal_range(src, weights, taps, shift, out, i, n);
+}
+
+static void convolve_vertical_signed_kernel_neon(const short *const *rows, const short *weights, int taps, int *out,
+                                                 size_t n) {
+    int32x4_t lo, hi;
+    int16x8_t a;
+    size_t i;
+    int t;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        lo = vdupq_n_s32(0);
+        hi = lo;
+        for (t = 0; t < taps; t++) {
+            a = vld1q_s16(rows[t] + i);
+            lo = vmlal_n_s16(lo, vget_low_s16(a), weights[t]);
+            hi = vmlal_n_s16(hi, vget_high_s16(a), weights[t]);
+        }
+        vst1q_s32(out + i, lo);
+        vst1q_s32(out + i + 4, hi);
+    }
+    convolve_vertical_signed_range(rows, weights, taps, out, i, n);
+}
+
+static inline void neon_sort2(uint8x16_t *a, uint8x16_t *b) {
+    uint8x16_t t = vminq_u8(*a, *b);
+
+    *b = vmaxq_u8(*a, *b);
+    *a = t;
+}
+
+static inline uint8x16_t neon_median3(uint8x16_t a, uint8x16_t b, uint8x16_t c) {
+    return vmaxq_u8(vminq_u8(a, b), vminq_u8(vmaxq_u8(a, b), c));
+}
+
+static void median3_kernel_neon(const unsigned char *const *rows, unsigned char *out, size_t n) {
+    uint8x16_t lo[3], mid[3], hi[3], low, high;
+    size_t i;
+    int j;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        for (j = 0; j < 3; j++) {
+            lo[j] = vld1q_u8(rows[0] + i + j);
+            mid[j] = vld1q_u8(rows[1] + i + j);
+            hi[j] = vld1q_u8(rows[2] + i + j);
+            neon_sort2(&lo[j], &mid[j]);
+            neon_sort2(&mid[j], &hi[j]);
+            neon_sort2(&lo[j], &mid[j]);
+        }
+        low = vmaxq_u8(vmaxq_u8(lo[0], lo[1]), lo[2]);
+        high = vminq_u8(vminq_u8(hi[0], hi[1]), hi[2]);
+        vst1q_u8(out + i, neon_median3(low, neon_median3(mid[0], mid[1], mid[2]), high));
+    }
+    median3_range(rows, out, i, n);
+}
+
+#endif
+
+#endif
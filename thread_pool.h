@@ -0,0 +1,160 @@
+// Persistent worker threads for row-band parallelism.
+//
+// thread_pool_run() splits rows [0, rows) into one band per thread, runs fn on every
+// band (the calling thread takes the first one) and returns once all bands are done,
+// so each call doubles as a barrier between stages. The workers are created once and
+// sleep between calls, so a sweep costs a wake-up rather than a thread start.
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define THREAD_POOL_MAX_THREADS 1024   // the most a pool is asked for (-j)
+
+// Work for one band of rows [y0, y1)
+typedef void (*band_fn)(void *ctx, int y0, int y1);
+
+struct thread_pool;
+
+struct thread_pool_worker {
+    struct thread_pool *pool;
+    int index;
+    pthread_t thread;
+};
+
+struct thread_pool {
+    int nthreads;                       // bands per run, including the calling thread
+    struct thread_pool_worker *workers; // nthreads - 1 helpers
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                // a new run is ready, or the pool is shutting down
+    pthread_cond_t idle;                // the last helper finished its band
+    band_fn fn;
+    void *ctx;
+    int rows;
+    unsigned long generation;           // bumped for every run
+    int busy;                           // helpers still working on the current run
+    int quit;
+};
+
+// Number of online CPUs, used as the default thread count
+static int thread_pool_cpus(void) {
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : (int) n;
+}
+
+static void thread_pool_band(const struct thread_pool *pool, int index, int *y0, int *y1) {
+    *y0 = (int) ((long long) pool->rows * index / pool->nthreads);
+    *y1 = (int) ((long long) pool->rows * (index + 1) / pool->nthreads);
+}
+
+// Which band of a run over rows rows starts at row y0, from 0 to nthreads - 1, so that
+// a band function can pick scratch memory of its own
+static inline int thread_pool_band_index(const struct thread_pool *pool, int rows, int y0) {
+    if (pool->nthreads == 1 || rows < pool->nthreads) return 0;
+    return (int) (((long long) y0 * pool->nthreads + rows - 1) / rows);
+}
+
+// Number of bands a run over rows rows is split into, all of them non-empty
+static inline int thread_pool_bands(const struct thread_pool *pool, int rows) {
+    return (rows < pool->nthreads) ? 1 : pool->nthreads;
+}
+
+static void *thread_pool_main(void *arg) {
+    struct thread_pool_worker *self = (struct thread_pool_worker *) arg;
+    struct thread_pool *pool = self->pool;
+    unsigned long seen = 0;
+    int y0, y1;
+
+    pthread_mutex_lock (&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->quit)
+            pthread_cond_wait (&pool->wake, &pool->lock);
+        if (pool->quit) break;
+        seen = pool->generation;
+        thread_pool_band (pool, self->index, &y0, &y1);
+        pthread_mutex_unlock (&pool->lock);
+
+        if (y1 > y0) pool->fn (pool->ctx, y0, y1);
+
+        pthread_mutex_lock (&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal (&pool->idle);
+    }
+    pthread_mutex_unlock (&pool->lock);
+    return NULL;
+}
+
+// Start a pool of nthreads (counting the caller). Returns NULL on failure.
+static struct thread_pool *thread_pool_create(int nthreads) {
+    struct thread_pool *pool = calloc (1, sizeof(struct thread_pool));
+    int i;
+
+    if (!pool) return NULL;
+    if (nthreads < 1) nthreads = 1;
+    pool->nthreads = nthreads;
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->wake, NULL);
+    pthread_cond_init (&pool->idle, NULL);
+    pool->workers = calloc (nthreads, sizeof(struct thread_pool_worker));
+    if (!pool->workers) {
+        free (pool);
+        return NULL;
+    }
+    for (i = 1; i < nthreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create (&pool->workers[i].thread, NULL, thread_pool_main, &pool->workers[i]) != 0) {
+            // run with the helpers that did start
+            pool->nthreads = i;
+            break;
+        }
+    }
+    return pool;
+}
+
+// Run fn over rows [0, rows) split into bands and wait for every band to finish
+static void thread_pool_run(struct thread_pool *pool, int rows, band_fn fn, void *ctx) {
+    int y0, y1;
+
+    if (pool->nthreads == 1 || rows < pool->nthreads) {
+        fn (ctx, 0, rows);
+        return;
+    }
+    pthread_mutex_lock (&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->rows = rows;
+    pool->busy = pool->nthreads - 1;
+    pool->generation++;
+    pthread_cond_broadcast (&pool->wake);
+    thread_pool_band (pool, 0, &y0, &y1);
+    pthread_mutex_unlock (&pool->lock);
+
+    fn (ctx, y0, y1);
+
+    pthread_mutex_lock (&pool->lock);
+    while (pool->busy > 0)
+        pthread_cond_wait (&pool->idle, &pool->lock);
+    pthread_mutex_unlock (&pool->lock);
+}
+
+static void thread_pool_destroy(struct thread_pool *pool) {
+    int i;
+
+    if (!pool) return;
+    pthread_mutex_lock (&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast (&pool->wake);
+    pthread_mutex_unlock (&pool->lock);
+    for (i = 1; i < pool->nthreads; i++)
+        pthread_join (pool->workers[i].thread, NULL);
+    pthread_cond_destroy (&pool->wake);
+    pthread_cond_destroy (&pool->idle);
+    pthread_mutex_destroy (&pool->lock);
+    free (pool->workers);
+    free (pool);
+}
+
+#endif
@@ -0,0 +1,140 @@
+// Wall-clock instrumentation for the processing stages.
+//
+// Each measured step (reading, every stage, writing, the whole run) owns a slot. A run
+// may be repeated for several iterations; every iteration adds one sample per slot, and
+// a slot may be fed several times per iteration (strip mode adds every strip's time
+// to the same sample). The report gives min, median and 99th percentile per slot plus
+// throughput at the median, as a table or as JSON.
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TIMING_MAX_ITERATIONS 1000000
+
+struct timing_slot {
+    const char *name;
+    long long *ns;          // one sample per iteration
+    long long pixels;       // pixels processed in one iteration
+    long long bytes;        // bytes of image data processed in one iteration
+};
+
+struct timing {
+    int iterations;
+    int iteration;          // the iteration being measured
+    int nslots;             // slots used so far
+    int maxslots;
+    struct timing_slot *slot;
+};
+
+// Monotonic wall-clock time in nanoseconds
+static inline long long timing_now(void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void timing_free(struct timing *t) {
+    int i;
+
+    for (i = 0; i < t->maxslots; i++)
+        free (t->slot[i].ns);
+    free (t->slot);
+    t->slot = NULL;
+    t->maxslots = 0;
+}
+
+// Room for slots 0 to maxslots - 1 and from 1 to TIMING_MAX_ITERATIONS iterations.
+// Returns -1 if out of memory, with nothing left to free.
+static inline int timing_init(struct timing *t, int iterations, int maxslots) {
+    int i;
+
+    memset (t, 0, sizeof(struct timing));
+    t->iterations = (iterations < 1) ? 1 : ((iterations > TIMING_MAX_ITERATIONS) ? TIMING_MAX_ITERATIONS : iterations);
+    t->slot = calloc (maxslots, sizeof(struct timing_slot));
+    if (!t->slot) return -1;
+    t->maxslots = maxslots;
+    for (i = 0; i < maxslots; i++) {
+        t->slot[i].ns = calloc (t->iterations, sizeof(long long));
+        if (!t->slot[i].ns) {
+            timing_free (t);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Add ns to this iteration's sample for a slot. The work size is counted in the first
+// iteration only, since every iteration repeats the same work.
+static inline void timing_add(struct timing *t, int slot, const char *name, long long ns, long long pixels, long long bytes) {
+    struct timing_slot *s;
+
+    if (!t || slot < 0 || slot >= t->maxslots || t->iteration >= t->iterations) return;
+    s = &t->slot[slot];
+    s->name = name;
+    s->ns[t->iteration] += ns;
+    if (t->iteration == 0) {
+        s->pixels += pixels;
+        s->bytes += bytes;
+    }
+    if (slot >= t->nslots) t->nslots = slot + 1;
+}
+
+static inline void timing_next(struct timing *t) {
+    if (t) t->iteration++;
+}
+
+static inline int timing_compare(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+// Sorted samples of one slot; p is a percentile (nearest rank)
+static inline long long timing_percentile(const long long *sorted, int n, int p) {
+    int rank = (n * p + 99) / 100;
+    return sorted[(rank < 1) ? 0 : rank - 1];
+}
+
+// Returns -1 if out of memory for sorting the samples
+static inline int timing_report(struct timing *t, FILE *out, int json) {
+    long long *sorted, lo, median, p99;
+    double mbps, mpps;
+    int i, printed = 0, n = (t->iteration < t->iterations) ? t->iteration : t->iterations;
+    struct timing_slot *s;
+
+    if (n < 1) return 0;
+    sorted = malloc (sizeof(long long) * n);
+    if (!sorted) return -1;
+    if (json)
+        fprintf (out, "{\"iterations\": %d, \"stages\": [", n);
+    else
+        fprintf (out, "%-14s %10s %10s %10s %10s %10s\n", "STAGE", "MIN ms", "MEDIAN ms", "P99 ms", "MB/s", "MP/s");
+    for (i = 0; i < t->nslots; i++) {
+        s = &t->slot[i];
+        if (!s->name) continue;
+        memcpy (sorted, s->ns, n * sizeof(long long));
+        qsort (sorted, n, sizeof(long long), timing_compare);
+        lo = sorted[0];
+        median = timing_percentile (sorted, n, 50);
+        p99 = timing_percentile (sorted, n, 99);
+        // bytes per ns * 1e9 / 1e6 = MB/s
+        mbps = (median > 0) ? s->bytes * 1e3 / median : 0;
+        mpps = (median > 0) ? s->pixels * 1e3 / median : 0;
+        if (json)
+            fprintf (out, "%s\n  {\"stage\": \"%s\", \"min_ns\": %lld, \"median_ns\": %lld, \"p99_ns\": %lld, "
+                     "\"bytes\": %lld, \"pixels\": %lld, \"mb_per_s\": %.1f, \"mp_per_s\": %.1f}",
+                     printed++ ? "," : "", s->name, lo, median, p99, s->bytes, s->pixels, mbps, mpps);
+        else
+            fprintf (out, "%-14s %10.3f %10.3f %10.3f %10.1f %10.1f\n", s->name, lo / 1e6, median / 1e6, p99 / 1e6,
+                     mbps, mpps);
+    }
+    if (json) fprintf (out, "\n]}\n");
+    free (sorted);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,163 @@
+// Software stand-in for the DE1-SoC video driver in <intelfpgaup/video.h>.
+//
+// Build with -DVIDEO_SW to run the display path away from the board. The calls draw
+// into an in-memory RGB565 back buffer the size of the VGA pixel buffer, and
+// video_show swaps it with the front buffer the way the driver flips pages. Every
+// call and every byte written to the pixel buffer is counted so the cost of the
+// display path can be measured on any Linux machine.
+//
+// Environment:
+//   VIDEO_SW_DUMP   file name prefix; each shown frame is written to <prefix>NNNN.ppm
+//   VIDEO_SW_STATS  if set, the counters are printed to stderr by video_close
+#ifndef VIDEO_SW_H
+#define VIDEO_SW_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Resolution of the VGA pixel buffer and of its character buffer
+#ifndef VIDEO_SW_WIDTH
+#define VIDEO_SW_WIDTH 320
+#endif
+#ifndef VIDEO_SW_HEIGHT
+#define VIDEO_SW_HEIGHT 240
+#endif
+#define VIDEO_SW_CHAR_WIDTH (VIDEO_SW_WIDTH / 4)
+#define VIDEO_SW_CHAR_HEIGHT (VIDEO_SW_HEIGHT / 4)
+
+struct video_sw_counters {
+    long long open, read, clear, pixel, row, show, close;  // calls
+    long long clipped;          // pixels outside the screen
+    long long bytes;            // bytes written to the back buffer
+    long long frames_dumped;
+};
+
+struct video_sw_device {
+    int is_open;
+    int back;                   // index of the buffer being drawn into
+    const char *dump_prefix;
+    unsigned short buffer[2][VIDEO_SW_HEIGHT][VIDEO_SW_WIDTH];
+    struct video_sw_counters count;
+};
+
+static struct video_sw_device video_sw;
+
+// The buffer currently on screen
+static inline unsigned short (*video_sw_front(void))[VIDEO_SW_WIDTH] {
+    return video_sw.buffer[video_sw.back ^ 1];
+}
+
+// Write the front buffer as a binary PPM, expanding RGB565 to 8 bits per channel.
+// Returns -1 if the file cannot be written.
+static inline int video_sw_dump(const char *filename) {
+    unsigned short (*front)[VIDEO_SW_WIDTH] = video_sw_front ();
+    unsigned char row[VIDEO_SW_WIDTH * 3];
+    int x, y, r, g, b, ok;
+    FILE *fp;
+
+    fp = fopen (filename, "wb");
+    if (!fp) return -1;
+    ok = fprintf (fp, "P6\n%d %d\n255\n", VIDEO_SW_WIDTH, VIDEO_SW_HEIGHT) > 0;
+    for (y = 0; y < VIDEO_SW_HEIGHT && ok; y++) {
+        for (x = 0; x < VIDEO_SW_WIDTH; x++) {
+            r = (front[y][x] >> 11) & 0x1f;
+            g = (front[y][x] >> 5) & 0x3f;
+            b = front[y][x] & 0x1f;
+            row[3 * x] = (r << 3) | (r >> 2);
+            row[3 * x + 1] = (g << 2) | (g >> 4);
+            row[3 * x + 2] = (b << 3) | (b >> 2);
+        }
+        ok = fwrite (row, sizeof(row), 1, fp) == 1;
+    }
+    if (fclose (fp) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+static inline void video_sw_report(FILE *out) {
+    struct video_sw_counters *c = &video_sw.count;
+
+    fprintf (out, "video: %lld open, %lld read, %lld clear, %lld pixel, %lld row, %lld show, %lld close\n",
+             c->open, c->read, c->clear, c->pixel, c->row, c->show, c->close);
+    fprintf (out, "video: %lld pixels clipped\n", c->clipped);
+    fprintf (out, "video: %lld bytes written, %lld frames dumped\n", c->bytes, c->frames_dumped);
+}
+
+static inline int video_open(void) {
+    video_sw.count.open++;
+    memset (video_sw.buffer, 0, sizeof(video_sw.buffer));
+    video_sw.back = 0;
+    video_sw.dump_prefix = getenv ("VIDEO_SW_DUMP");
+    video_sw.is_open = 1;
+    return 1;
+}
+
+static inline int video_read(int *width, int *height, int *char_width, int *char_height) {
+    video_sw.count.read++;
+    *width = VIDEO_SW_WIDTH;
+    *height = VIDEO_SW_HEIGHT;
+    *char_width = VIDEO_SW_CHAR_WIDTH;
+    *char_height = VIDEO_SW_CHAR_HEIGHT;
+    return video_sw.is_open;
+}
+
+static inline void video_clear(void) {
+    video_sw.count.clear++;
+    memset (video_sw.buffer[video_sw.back], 0, sizeof(video_sw.buffer[0]));
+    video_sw.count.bytes += sizeof(video_sw.buffer[0]);
+}
+
+static inline void video_pixel(int x, int y, short color) {
+    video_sw.count.pixel++;
+    if (x < 0 || x >= VIDEO_SW_WIDTH || y < 0 || y >= VIDEO_SW_HEIGHT) {
+        video_sw.count.clipped++;
+        return;
+    }
+    video_sw.buffer[video_sw.back][y][x] = (unsigned short) color;
+    video_sw.count.bytes += sizeof(unsigned short);
+}
+
+// Write n pixels of row y starting at column x with a single call. The board's driver
+// has no such call; display.h uses this one to stand in for a bulk write into the
+// mapped pixel buffer.
+static inline void video_sw_row(int x, int y, const unsigned short *pixels, int n) {
+    video_sw.count.row++;
+    if (y < 0 || y >= VIDEO_SW_HEIGHT) {
+        video_sw.count.clipped += n;
+        return;
+    }
+    if (x < 0) {
+        video_sw.count.clipped += -x;
+        pixels -= x;
+        n += x;
+        x = 0;
+    }
+    if (x + n > VIDEO_SW_WIDTH) {
+        video_sw.count.clipped += x + n - VIDEO_SW_WIDTH;
+        n = VIDEO_SW_WIDTH - x;
+    }
+    if (n <= 0) return;
+    memcpy (&video_sw.buffer[video_sw.back][y][x], pixels, n * sizeof(unsigned short));
+    video_sw.count.bytes += n * sizeof(unsigned short);
+}
+
+static inline void video_show(void) {
+    char filename[4096];
+
+    video_sw.count.show++;
+    video_sw.back ^= 1;
+    if (!video_sw.dump_prefix) return;
+    snprintf (filename, sizeof(filename), "%s%04lld.ppm", video_sw.dump_prefix, video_sw.count.show - 1);
+    if (video_sw_dump (filename) < 0)
+        printf ("Error: could not write frame %s\n", filename);
+    else
+        video_sw.count.frames_dumped++;
+}
+
+static inline void video_close(void) {
+    video_sw.count.close++;
+    video_sw.is_open = 0;
+    if (getenv ("VIDEO_SW_STATS")) video_sw_report (stderr);
+}
+
+#endif
@@ -0,0 +1,83 @@
+// Bounded queue handing work from one thread to the next.
+//
+// Batch mode connects its reader, processing and writer threads with these. A push
+// blocks while the queue is full, so a fast producer can only run a fixed number of
+// items ahead of its consumer, which bounds the images in memory. The producer closes
+// the queue when it is done; the consumer then drains it and gets NULL.
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct work_queue {
+    void **items;
+    int capacity;
+    int head;                   // index of the oldest item
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;   // an item was pushed, or the queue was closed
+    pthread_cond_t not_full;    // an item was popped
+};
+
+// Returns -1 if out of memory
+static int work_queue_init(struct work_queue *q, int capacity) {
+    q->items = calloc (capacity, sizeof(void *));
+    if (!q->items) return -1;
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init (&q->lock, NULL);
+    pthread_cond_init (&q->not_empty, NULL);
+    pthread_cond_init (&q->not_full, NULL);
+    return 0;
+}
+
+static void work_queue_destroy(struct work_queue *q) {
+    pthread_cond_destroy (&q->not_empty);
+    pthread_cond_destroy (&q->not_full);
+    pthread_mutex_destroy (&q->lock);
+    free (q->items);
+    q->items = NULL;
+}
+
+// Add an item, waiting for room if the queue is full
+static void work_queue_push(struct work_queue *q, void *item) {
+    pthread_mutex_lock (&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait (&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal (&q->not_empty);
+    pthread_mutex_unlock (&q->lock);
+}
+
+// Take the oldest item, waiting for one if the queue is empty. Returns NULL once the
+// queue is closed and empty.
+static void *work_queue_pop(struct work_queue *q) {
+    void *item = NULL;
+
+    pthread_mutex_lock (&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait (&q->not_empty, &q->lock);
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal (&q->not_full);
+    }
+    pthread_mutex_unlock (&q->lock);
+    return item;
+}
+
+// No more items will be pushed
+static void work_queue_close(struct work_queue *q) {
+    pthread_mutex_lock (&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast (&q->not_empty);
+    pthread_mutex_unlock (&q->lock);
+}
+
+#endif